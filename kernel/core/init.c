@@ -22,6 +22,7 @@
 #include "ksu.h"
 #include "infra/file_wrapper.h"
 #include "selinux/selinux.h"
+#include "selinux/avc_evict.h"
 #include "hook/syscall_hook.h"
 #include "feature/adb_root.h"
 #include "feature/selinux_hide.h"
@@ -83,6 +84,15 @@ module_param(allow_shell, bool, 0);
 bool ksu_no_custom_rc = false;
 module_param_named(norc, ksu_no_custom_rc, bool, 0);
 
+// Resolved in one kallsyms pass before any of these modules initializes
+static struct ksu_symbol_table *const init_symbol_tables[] = {
+    &ksu_syscall_hook_symbols,
+    &ksu_lsm_hook_symbols,
+    &ksu_selinux_hide_symbols,
+    &ksu_avc_evict_symbols,
+    &ksu_app_profile_symbols,
+};
+
 int __init kernelsu_init(void)
 {
 #if defined(__x86_64__) && !defined(CONFIG_KSU_X86_PATCH_SYSCALL_DISPATCHER)
@@ -126,7 +136,7 @@ int __init kernelsu_init(void)
         return -ENOSYS;
     }
 
-    ksu_init_symbol_resolver();
+    ksu_init_symbol_resolver(init_symbol_tables, ARRAY_SIZE(init_symbol_tables));
     ksu_syscall_hook_init();
 
     ksu_feature_init();
@@ -208,6 +218,8 @@ void __exit kernelsu_exit(void)
     ksu_allowlist_exit();
 
     ksu_selinux_hide_exit();
+    ksu_avc_evict_exit();
+    ksu_sid_cache_exit();
     ksu_lsm_hook_exit();
     ksu_adb_root_exit();
     ksu_sulog_exit();
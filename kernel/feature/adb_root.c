@@ -12,6 +12,7 @@
 
 #include "adb_root.h"
 #include "arch.h"
+#include "hook/syscall_hook_manager.h"
 #include "policy/feature.h"
 #include "selinux/selinux.h"
 
@@ -204,11 +205,8 @@ static int kernel_adb_root_feature_get(u64 *value)
 static int kernel_adb_root_feature_set(u64 value)
 {
     bool enable = value != 0;
-    if (enable) {
-        static_key_enable(&ksu_adb_root.key);
-    } else {
-        static_key_disable(&ksu_adb_root.key);
-    }
+    // ksu_adb_root follows the execve handlers of this consumer
+    ksu_set_hook_consumer(KSU_HOOK_CONSUMER_ADB_ROOT, enable);
     pr_info("adb_root: set to %d\n", enable);
     return 0;
 }
@@ -1,6 +1,9 @@
 #ifndef __KSU_H_ADB_ROOT
 #define __KSU_H_ADB_ROOT
 #include <asm/ptrace.h>
+#include <linux/jump_label.h>
+
+DECLARE_STATIC_KEY_FALSE(ksu_adb_root);
 
 long ksu_adb_root_handle_execve(struct pt_regs *regs);
 long ksu_adb_root_handle_execveat(struct pt_regs *regs);
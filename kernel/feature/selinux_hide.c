@@ -1,7 +1,7 @@
 #include "selinux_hide.h"
 #include "infra/symbol_resolver.h"
 #include "linux/jump_label.h"
-#include "selinux/sepolicy.h"
+#include "selinux/hidden_policy.h"
 #include <linux/cred.h>
 #include <linux/cpu.h>
 #include <linux/memory.h>
@@ -9,11 +9,14 @@
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/spinlock.h>
 #include <linux/fs.h>
 #include <asm-generic/errno-base.h>
 #include <net/genetlink.h>
 #include <linux/moduleparam.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
 // security/selinux/include/security.h
 #include <security.h>
 #include <ss/context.h>
@@ -61,21 +64,175 @@ typedef ssize_t (*write_op_fn)(struct file *, char *, size_t);
 
 static write_op_fn *selinux_write_op;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
-static int security_context_to_sid_with_policy(struct selinux_policy *policy, const char *scontext, u32 scontext_len,
-                                               u32 *sid, u32 def_sid, gfp_t gfp_flags);
-static int security_sid_to_context_with_policy(struct selinux_policy *policy, u32 sid, char **scontext,
-                                               u32 *scontext_len);
-static void security_compute_av_user_with_policy(struct selinux_policy *policy, u32 ssid, u32 tsid, u16 tclass,
-                                                 struct av_decision *avd);
+static struct ksu_symbol_request selinux_hide_symbol_reqs[] = {
+    { "write_op", KSU_SYMBOL_EXACT },
+    { "security_dump_masked_av", KSU_SYMBOL_EXACT },
+    { "sel_handle_status_ops", KSU_SYMBOL_EXACT },
+    { "selinux_setprocattr", KSU_SYMBOL_FUNCTABLE },
+};
+struct ksu_symbol_table ksu_selinux_hide_symbols = KSU_SYMBOL_TABLE(selinux_hide_symbol_reqs);
+
+// The hidden policy is the live one minus what KernelSU changed, see
+// selinux/hidden_policy.h. These answer from it, with the live sidtab.
+static int hidden_context_to_sid(const char *scontext, u32 scontext_len, u32 *sid, gfp_t gfp_flags);
+static int hidden_sid_to_context(u32 sid, char **scontext, u32 *scontext_len);
+static void hidden_compute_av_user(u32 ssid, u32 tsid, u16 tclass, struct av_decision *avd);
 static void (*security_dump_masked_av_fn)(struct policydb *policydb, struct context *scontext, struct context *tcontext,
                                           u16 tclass, u32 permissions, const char *reason) = NULL;
-static void (*context_struct_compute_av_fn)(struct policydb *policydb, struct context *scontext,
-                                            struct context *tcontext, u16 tclass, struct av_decision *avd,
-                                            struct extended_perms *xperms) = NULL;
-#else
-static struct selinux_state fake_state;
-#endif
+
+// Probing apps repeat the same few queries in tight loops. Keep the latest
+// context -> SID and (ssid, tsid, tclass) -> decision answers, most recent
+// first. Both are flushed when the live policy seqno moves, a policy load.
+#define HIDE_SID_CACHE_SIZE 32
+#define HIDE_AV_CACHE_SIZE 64
+#define HIDE_CTX_MAX 128
+
+struct hide_sid_entry {
+    struct list_head lru;
+    u32 sid; // SECSID_NULL when unused
+    u32 len;
+    char ctx[HIDE_CTX_MAX];
+};
+
+struct hide_av_entry {
+    struct list_head lru;
+    u32 ssid; // SECSID_NULL when unused
+    u32 tsid;
+    u16 tclass;
+    struct av_decision avd;
+};
+
+static DEFINE_SPINLOCK(hide_cache_lock);
+static LIST_HEAD(hide_sid_lru);
+static LIST_HEAD(hide_av_lru);
+static struct hide_sid_entry hide_sid_cache[HIDE_SID_CACHE_SIZE];
+static struct hide_av_entry hide_av_cache[HIDE_AV_CACHE_SIZE];
+static u32 hide_cache_seqno;
+
+static void __init hide_cache_init(void)
+{
+    int i;
+
+    for (i = 0; i < HIDE_SID_CACHE_SIZE; i++)
+        list_add_tail(&hide_sid_cache[i].lru, &hide_sid_lru);
+    for (i = 0; i < HIDE_AV_CACHE_SIZE; i++)
+        list_add_tail(&hide_av_cache[i].lru, &hide_av_lru);
+}
+
+static u32 live_policy_seqno(void)
+{
+    u32 seqno;
+
+    rcu_read_lock();
+    seqno = rcu_dereference(selinux_state.policy)->latest_granting;
+    rcu_read_unlock();
+    return seqno;
+}
+
+// Flush both caches if they were filled under another seqno, caller holds
+// hide_cache_lock. Returns false if @seqno is older than the cache.
+static bool hide_cache_sync_locked(u32 seqno)
+{
+    int i;
+
+    if (seqno == hide_cache_seqno)
+        return true;
+    if ((s32)(seqno - hide_cache_seqno) < 0)
+        return false;
+
+    for (i = 0; i < HIDE_SID_CACHE_SIZE; i++)
+        hide_sid_cache[i].sid = SECSID_NULL;
+    for (i = 0; i < HIDE_AV_CACHE_SIZE; i++)
+        hide_av_cache[i].ssid = SECSID_NULL;
+    hide_cache_seqno = seqno;
+    return true;
+}
+
+static int cached_context_to_sid(const char *scontext, u32 scontext_len, u32 *sid)
+{
+    struct hide_sid_entry *e;
+    u32 seqno = live_policy_seqno();
+    int rc;
+
+    if (scontext_len >= HIDE_CTX_MAX)
+        return hidden_context_to_sid(scontext, scontext_len, sid, GFP_KERNEL);
+
+    spin_lock(&hide_cache_lock);
+    if (hide_cache_sync_locked(seqno)) {
+        list_for_each_entry (e, &hide_sid_lru, lru) {
+            if (e->sid == SECSID_NULL || e->len != scontext_len || memcmp(e->ctx, scontext, scontext_len))
+                continue;
+            list_move(&e->lru, &hide_sid_lru);
+            *sid = e->sid;
+            spin_unlock(&hide_cache_lock);
+            return 0;
+        }
+    }
+    spin_unlock(&hide_cache_lock);
+
+    rc = hidden_context_to_sid(scontext, scontext_len, sid, GFP_KERNEL);
+    if (rc)
+        return rc;
+
+    spin_lock(&hide_cache_lock);
+    if (hide_cache_sync_locked(seqno)) {
+        e = list_last_entry(&hide_sid_lru, struct hide_sid_entry, lru);
+        memcpy(e->ctx, scontext, scontext_len);
+        e->len = scontext_len;
+        e->sid = *sid;
+        list_move(&e->lru, &hide_sid_lru);
+    }
+    spin_unlock(&hide_cache_lock);
+    return 0;
+}
+
+static void cached_compute_av_user(u32 ssid, u32 tsid, u16 tclass, struct av_decision *avd)
+{
+    struct hide_av_entry *e;
+    u32 seqno = live_policy_seqno();
+
+    spin_lock(&hide_cache_lock);
+    if (hide_cache_sync_locked(seqno)) {
+        list_for_each_entry (e, &hide_av_lru, lru) {
+            if (e->ssid != ssid || e->tsid != tsid || e->tclass != tclass)
+                continue;
+            list_move(&e->lru, &hide_av_lru);
+            *avd = e->avd;
+            spin_unlock(&hide_cache_lock);
+            return;
+        }
+    }
+    spin_unlock(&hide_cache_lock);
+
+    hidden_compute_av_user(ssid, tsid, tclass, avd);
+
+    spin_lock(&hide_cache_lock);
+    if (hide_cache_sync_locked(seqno)) {
+        e = list_last_entry(&hide_av_lru, struct hide_av_entry, lru);
+        e->ssid = ssid;
+        e->tsid = tsid;
+        e->tclass = tclass;
+        e->avd = *avd;
+        list_move(&e->lru, &hide_av_lru);
+    }
+    spin_unlock(&hide_cache_lock);
+}
+
+// Split "scontext tcontext tclass" in place, like sscanf("%s %s %hu")
+static char *next_token(char **p)
+{
+    char *tok = skip_spaces(*p);
+    char *end = tok;
+
+    if (!*tok)
+        return NULL;
+    while (*end && !isspace(*end))
+        end++;
+    if (*end)
+        *end++ = 0;
+    *p = end;
+    return tok;
+}
 
 static write_op_fn *context_write, *access_write;
 static write_op_fn orig_context_write, orig_access_write;
@@ -92,13 +249,18 @@ static ssize_t my_write_context(struct file *file, char *buf, size_t size)
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
     length = avc_has_perm(current_sid(), SECINITSID_SECURITY, SECCLASS_SECURITY, SECURITY__CHECK_CONTEXT, NULL);
+#else
+    length = avc_has_perm(&selinux_state, current_sid(), SECINITSID_SECURITY, SECCLASS_SECURITY,
+                          SECURITY__CHECK_CONTEXT, NULL);
+#endif
     if (length)
         goto out;
-    length = security_context_to_sid_with_policy(backup_sepolicy, buf, size, &sid, SECSID_NULL, GFP_KERNEL);
+
+    length = cached_context_to_sid(buf, size, &sid);
     if (length)
         goto out;
 
-    length = security_sid_to_context_with_policy(backup_sepolicy, sid, &canon, &len);
+    length = hidden_sid_to_context(sid, &canon, &len);
     if (length)
         goto out;
 
@@ -109,20 +271,6 @@ static ssize_t my_write_context(struct file *file, char *buf, size_t size)
                __func__, len);
         goto out;
     }
-#else
-    length = avc_has_perm(&selinux_state, current_sid(), SECINITSID_SECURITY, SECCLASS_SECURITY,
-                          SECURITY__CHECK_CONTEXT, NULL);
-    if (length)
-        goto out;
-
-    length = security_context_to_sid(&fake_state, buf, size, &sid, GFP_KERNEL);
-    if (length)
-        goto out;
-
-    length = security_sid_to_context(&fake_state, sid, &canon, &len);
-    if (length)
-        goto out;
-#endif
 
     memcpy(buf, canon, len);
     length = len;
@@ -137,7 +285,7 @@ static ssize_t my_write_access(struct file *file, char *buf, size_t size)
     if (likely(current_uid().val < 10000)) {
         return orig_access_write(file, buf, size);
     }
-    char *scon = NULL, *tcon = NULL;
+    char *scon, *tcon, *p = buf;
     u32 ssid, tsid;
     u16 tclass;
     struct av_decision avd;
@@ -152,47 +300,26 @@ static ssize_t my_write_access(struct file *file, char *buf, size_t size)
     if (length)
         goto out;
 
-    length = -ENOMEM;
-    scon = kzalloc(size + 1, GFP_KERNEL);
-    if (!scon)
-        goto out;
-
-    length = -ENOMEM;
-    tcon = kzalloc(size + 1, GFP_KERNEL);
-    if (!tcon)
-        goto out;
-
+    // the transaction buffer is NUL terminated and overwritten by the answer
     length = -EINVAL;
-    if (sscanf(buf, "%s %s %hu", scon, tcon, &tclass) != 3)
-        goto out;
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
-    length = security_context_to_sid_with_policy(backup_sepolicy, scon, strlen(scon), &ssid, SECSID_NULL, GFP_KERNEL);
-    if (length)
-        goto out;
-
-    length = security_context_to_sid_with_policy(backup_sepolicy, tcon, strlen(tcon), &tsid, SECSID_NULL, GFP_KERNEL);
-    if (length)
+    scon = next_token(&p);
+    tcon = scon ? next_token(&p) : NULL;
+    if (!tcon || sscanf(p, "%hu", &tclass) != 1)
         goto out;
 
-    security_compute_av_user_with_policy(backup_sepolicy, ssid, tsid, tclass, &avd);
-#else
-    length = security_context_str_to_sid(&fake_state, scon, &ssid, GFP_KERNEL);
+    length = cached_context_to_sid(scon, strlen(scon), &ssid);
     if (length)
         goto out;
 
-    length = security_context_str_to_sid(&fake_state, tcon, &tsid, GFP_KERNEL);
+    length = cached_context_to_sid(tcon, strlen(tcon), &tsid);
     if (length)
         goto out;
 
-    security_compute_av_user(&fake_state, ssid, tsid, tclass, &avd);
-#endif
+    cached_compute_av_user(ssid, tsid, tclass, &avd);
 
     length = scnprintf(buf, SIMPLE_TRANSACTION_LIMIT, "%x %x %x %x %u %x", avd.allowed, 0xffffffff, avd.auditallow,
                        avd.auditdeny, avd.seqno, avd.flags);
 out:
-    kfree(tcon);
-    kfree(scon);
     return length;
 }
 
@@ -228,11 +355,7 @@ static int __nocfi my_setprocattr(const char *name, void *value, size_t size)
             str[size - 1] = 0;
             size--;
         }
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
-        error = security_context_to_sid_with_policy(backup_sepolicy, str, size, &sid, SECSID_NULL, GFP_KERNEL);
-#else
-        error = security_context_to_sid(&fake_state, str, size, &sid, GFP_KERNEL);
-#endif
+        error = cached_context_to_sid(str, size, &sid);
         if (error) {
             return error;
         }
@@ -313,8 +436,8 @@ static int ksu_selinux_hide_enable()
 {
     int ret;
     pr_info("selinux_hide: init selinux hide\n");
-    if (!backup_sepolicy) {
-        pr_err("no backup sepolicy available, please save feature and reboot to retry!\n");
+    if (!ksu_hidden_policy_available()) {
+        pr_err("no hidden policy available, please save feature and reboot to retry!\n");
         return -EAGAIN;
     }
     selinux_write_op = find_kernel_symbol_exact("write_op");
@@ -324,37 +447,34 @@ static int ksu_selinux_hide_enable()
     }
     hook_selinux_status_open();
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
     security_dump_masked_av_fn = find_kernel_symbol_exact("security_dump_masked_av");
     if (!security_dump_masked_av_fn) {
         pr_warn("security_dump_masked_av not found!\n");
     }
-    context_struct_compute_av_fn = find_kernel_symbol_exact("context_struct_compute_av");
-    if (!context_struct_compute_av_fn) {
-        pr_warn("context_struct_compute_av not found!\n");
-    }
-#else
-    fake_state.initialized = true;
-    fake_state.policy = backup_sepolicy;
-#endif
+
+    struct ksu_patch_batch batch;
+    write_op_fn my_context = my_write_context, my_access = my_write_access;
 
     context_write = &selinux_write_op[SEL_CONTEXT];
     pr_info("selinux_hide: context_write: 0x%lx [%pSb]\n", (unsigned long)*context_write, *context_write);
-    write_op_fn my = my_write_context;
-    orig_context_write = *context_write;
-    ret = ksu_patch_text(context_write, &my, sizeof(my), KSU_PATCH_TEXT_FLUSH_DCACHE);
+    access_write = &selinux_write_op[SEL_ACCESS];
+    pr_info("selinux_hide: access_write: 0x%lx [%pSb]\n", (unsigned long)*access_write, *access_write);
+
+    // both write ops are replaced under one stop_machine
+    ksu_patch_batch_init(&batch);
+    ret = ksu_patch_batch_add(&batch, context_write, &my_context, sizeof(my_context), KSU_PATCH_TEXT_FLUSH_DCACHE);
+    if (!ret)
+        ret = ksu_patch_batch_add(&batch, access_write, &my_access, sizeof(my_access), KSU_PATCH_TEXT_FLUSH_DCACHE);
     if (ret) {
-        pr_err("selinux_hide: init: patch_text context_write err: %d\n", ret);
+        ksu_patch_batch_release(&batch);
+        pr_err("selinux_hide: init: queue write ops err: %d\n", ret);
         goto unhook;
     }
-
-    access_write = &selinux_write_op[SEL_ACCESS];
-    pr_info("selinux_hide: access_write: 0x%lx [%pSb]\n", (unsigned long)*access_write, *access_write);
-    my = my_write_access;
+    orig_context_write = *context_write;
     orig_access_write = *access_write;
-    ret = ksu_patch_text(access_write, &my, sizeof(my), KSU_PATCH_TEXT_FLUSH_DCACHE);
+    ret = ksu_patch_batch_apply(&batch);
     if (ret) {
-        pr_err("selinux_hide: init: patch_text access_write err: %d\n", ret);
+        pr_err("selinux_hide: init: patch_text write ops err: %d\n", ret);
         goto unhook;
     }
 
@@ -373,30 +493,30 @@ unhook:
 
 static void ksu_selinux_hide_unhook()
 {
-    int ret;
-    if (orig_context_write) {
-        ret =
-            ksu_patch_text(context_write, &orig_context_write, sizeof(orig_context_write), KSU_PATCH_TEXT_FLUSH_DCACHE);
-        orig_context_write = NULL;
-        if (ret) {
-            pr_err("selinux_hide: exit: patch_text context_write err: %d\n", ret);
-        }
-    }
-    if (orig_access_write) {
-        ret = ksu_patch_text(access_write, &orig_access_write, sizeof(orig_access_write), KSU_PATCH_TEXT_FLUSH_DCACHE);
-        orig_access_write = NULL;
-        if (ret) {
-            pr_err("selinux_hide: exit: patch_text access_write err: %d\n", ret);
-        }
-    }
-    if (sel_open_handle_status_slot && orig_sel_open_handle_status) {
-        ret = ksu_patch_text(sel_open_handle_status_slot, &orig_sel_open_handle_status,
-                             sizeof(orig_sel_open_handle_status), KSU_PATCH_TEXT_FLUSH_DCACHE);
-        orig_sel_open_handle_status = NULL;
-        if (ret) {
-            pr_err("selinux_hide: exit: patch_text sel_open_handle_status err: %d\n", ret);
-        }
-    }
+    struct ksu_patch_batch batch;
+    int ret = 0;
+
+    // restore every replaced pointer under one stop_machine
+    ksu_patch_batch_init(&batch);
+    if (orig_context_write)
+        ret = ksu_patch_batch_add(&batch, context_write, &orig_context_write, sizeof(orig_context_write),
+                                  KSU_PATCH_TEXT_FLUSH_DCACHE);
+    if (!ret && orig_access_write)
+        ret = ksu_patch_batch_add(&batch, access_write, &orig_access_write, sizeof(orig_access_write),
+                                  KSU_PATCH_TEXT_FLUSH_DCACHE);
+    if (!ret && sel_open_handle_status_slot && orig_sel_open_handle_status)
+        ret = ksu_patch_batch_add(&batch, sel_open_handle_status_slot, &orig_sel_open_handle_status,
+                                  sizeof(orig_sel_open_handle_status), KSU_PATCH_TEXT_FLUSH_DCACHE);
+    if (!ret)
+        ret = ksu_patch_batch_apply(&batch);
+    else
+        ksu_patch_batch_release(&batch);
+    if (ret)
+        pr_err("selinux_hide: exit: patch_text restore err: %d\n", ret);
+
+    orig_context_write = NULL;
+    orig_access_write = NULL;
+    orig_sel_open_handle_status = NULL;
     ksu_lsm_unhook(&selinux_setprocattr_hook);
 }
 
@@ -486,6 +606,7 @@ static void hook_selinux_status_open()
 
 void __init ksu_selinux_hide_init()
 {
+    hide_cache_init();
     if (ksu_register_feature_handler(&selinux_hide_handler)) {
         pr_err("Failed to register selinux_hide feature handler\n");
     }
@@ -516,17 +637,13 @@ void __exit ksu_selinux_hide_exit()
 void ksu_selinux_hide_drop_backup_if_unused()
 {
     mutex_lock(&selinux_hide_mutex);
-    if (!ksu_selinux_hide_running && backup_sepolicy) {
-        pr_info("selinux_hide is not enabled - drop backup_sepolicy\n");
-        sidtab_destroy(backup_sepolicy->sidtab);
-        kfree(backup_sepolicy->sidtab);
-        ksu_destroy_sepolicy(backup_sepolicy);
-        backup_sepolicy = NULL;
+    if (!ksu_selinux_hide_running && ksu_hidden_policy_available()) {
+        pr_info("selinux_hide is not enabled - drop hidden policy\n");
+        ksu_hidden_policy_drop();
     }
     mutex_unlock(&selinux_hide_mutex);
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
 /*
  * Caveat:  Mutates scontext.
  */
@@ -585,7 +702,7 @@ static int string_to_context_struct(struct policydb *pol, struct sidtab *sidtabp
     *p++ = 0;
 
     typdatum = symtab_search(&pol->p_types, scontextp);
-    if (!typdatum || typdatum->attribute)
+    if (!typdatum || typdatum->attribute || ksu_hidden_type(typdatum->value))
         goto out;
 
     ctx->type = typdatum->value;
@@ -605,12 +722,12 @@ out:
     return rc;
 }
 
-static int security_context_to_sid_with_policy(struct selinux_policy *policy, const char *scontext, u32 scontext_len,
-                                               u32 *sid, u32 def_sid, gfp_t gfp_flags)
+static int hidden_context_to_sid(const char *scontext, u32 scontext_len, u32 *sid, gfp_t gfp_flags)
 {
+    struct selinux_policy *policy;
     struct policydb *policydb;
     struct sidtab *sidtab;
-    char *scontext2, *str = NULL;
+    char *scontext2;
     struct context context;
     int rc = 0;
 
@@ -618,30 +735,33 @@ static int security_context_to_sid_with_policy(struct selinux_policy *policy, co
     if (!scontext_len)
         return -EINVAL;
 
+    *sid = SECSID_NULL;
+retry:
     /* Copy the string to allow changes and ensure a NUL terminator */
     scontext2 = kmemdup_nul(scontext, scontext_len, gfp_flags);
     if (!scontext2)
         return -ENOMEM;
 
     // removed: if (!selinux_initialized())
-    *sid = SECSID_NULL;
-
     // removed: if (force)
-    // removed: rcu lock
+    rcu_read_lock();
+    policy = rcu_dereference(selinux_state.policy);
     policydb = &policy->policydb;
     sidtab = policy->sidtab;
-    rc = string_to_context_struct(policydb, sidtab, scontext2, &context, def_sid);
+    rc = string_to_context_struct(policydb, sidtab, scontext2, &context, SECSID_NULL);
     if (rc)
-        goto out;
+        goto out_unlock;
     rc = sidtab_context_to_sid(sidtab, &context, sid);
-    // rc should not be frozen
-    if (rc)
-        goto out;
-    // removed: if (rc == -ESTALE)
     context_destroy(&context);
-out:
+    if (rc == -ESTALE) {
+        // the sidtab is being converted by a policy load
+        rcu_read_unlock();
+        kfree(scontext2);
+        goto retry;
+    }
+out_unlock:
+    rcu_read_unlock();
     kfree(scontext2);
-    kfree(str);
     return rc;
 }
 
@@ -712,9 +832,9 @@ static int sidtab_entry_to_string(struct policydb *p, struct sidtab *sidtab, str
     return rc;
 }
 
-static int security_sid_to_context_with_policy(struct selinux_policy *policy, u32 sid, char **scontext,
-                                               u32 *scontext_len)
+static int hidden_sid_to_context(u32 sid, char **scontext, u32 *scontext_len)
 {
+    struct selinux_policy *policy;
     struct policydb *policydb;
     struct sidtab *sidtab;
     struct sidtab_entry *entry;
@@ -725,7 +845,8 @@ static int security_sid_to_context_with_policy(struct selinux_policy *policy, u3
     *scontext_len = 0;
 
     // removed: if (!selinux_initialized())
-    // removed: rcu lock
+    rcu_read_lock();
+    policy = rcu_dereference(selinux_state.policy);
     policydb = &policy->policydb;
     sidtab = policy->sidtab;
 
@@ -741,18 +862,17 @@ static int security_sid_to_context_with_policy(struct selinux_policy *policy, u3
     rc = sidtab_entry_to_string(policydb, sidtab, entry, scontext, scontext_len);
 
 out_unlock:
+    rcu_read_unlock();
     return rc;
 }
 
-static void avd_init(struct selinux_policy *policy, struct av_decision *avd)
+static void avd_init(struct av_decision *avd)
 {
     avd->allowed = 0;
     avd->auditallow = 0;
     avd->auditdeny = 0xffffffff;
-    if (policy)
-        avd->seqno = policy->latest_granting;
-    else
-        avd->seqno = 0;
+    // the seqno the stock policy was published with
+    avd->seqno = ksu_hidden_seqno();
     avd->flags = 0;
 }
 
@@ -820,9 +940,10 @@ static void __nocfi type_attribute_bounds_av(struct policydb *policydb, struct c
  * constraint_expr_eval should pass in NULL for xcontext.
  */
 static int constraint_expr_eval(struct policydb *policydb, struct context *scontext, struct context *tcontext,
-                                struct context *xcontext, struct constraint_expr *cexpr)
+                                struct context *xcontext, struct constraint_expr *cexpr, u16 tclass, u32 cidx)
 {
-    u32 val1, val2;
+    u32 val1, val2, eidx;
+    bool bit;
     struct context *c;
     struct role_datum *r1, *r2;
     struct mls_level *l1, *l2;
@@ -830,7 +951,7 @@ static int constraint_expr_eval(struct policydb *policydb, struct context *scont
     int s[CEXPR_MAXDEPTH];
     int sp = -1;
 
-    for (e = cexpr; e; e = e->next) {
+    for (e = cexpr, eidx = 0; e; e = e->next, eidx++) {
         switch (e->expr_type) {
         case CEXPR_NOT:
             BUG_ON(sp < 0);
@@ -965,12 +1086,17 @@ static int constraint_expr_eval(struct policydb *policydb, struct context *scont
                 return 0;
             }
 
+            bit = ebitmap_get_bit(&e->names, val1 - 1);
+            // names of types KernelSU gave a constrained attribute
+            if (bit && (e->attr & CEXPR_TYPE) && ksu_hidden_names_added(tclass, cidx, eidx, val1))
+                bit = false;
+
             switch (e->op) {
             case CEXPR_EQ:
-                s[++sp] = ebitmap_get_bit(&e->names, val1 - 1);
+                s[++sp] = bit;
                 break;
             case CEXPR_NEQ:
-                s[++sp] = !ebitmap_get_bit(&e->names, val1 - 1);
+                s[++sp] = !bit;
                 break;
             default:
                 BUG();
@@ -987,6 +1113,43 @@ static int constraint_expr_eval(struct policydb *policydb, struct context *scont
     return s[0];
 }
 
+// Attributes KernelSU added, or gave @type, are not in the stock policy
+static bool hidden_attr(u32 type, u32 attr)
+{
+    return ksu_hidden_type(attr) || ksu_hidden_attr_added(type, attr);
+}
+
+// Fold the stock datums of the AV keys KernelSU changed into @avd.
+// Returns the AVTAB_AV kinds that were changed, their live nodes are stale.
+static u16 fold_hidden_av(struct avtab_key *avkey, struct av_decision *avd)
+{
+    static const u16 kinds[] = { AVTAB_ALLOWED, AVTAB_AUDITALLOW, AVTAB_AUDITDENY };
+    struct avtab_key key = *avkey;
+    u16 changed = 0;
+    bool present;
+    u32 data;
+    int k;
+
+    if (!ksu_hidden_av_source(key.source_type))
+        return 0;
+
+    for (k = 0; k < ARRAY_SIZE(kinds); k++) {
+        key.specified = kinds[k];
+        if (!ksu_hidden_av(&key, &present, &data))
+            continue;
+        changed |= kinds[k];
+        if (!present)
+            continue;
+        if (kinds[k] == AVTAB_ALLOWED)
+            avd->allowed |= data;
+        else if (kinds[k] == AVTAB_AUDITALLOW)
+            avd->auditallow |= data;
+        else
+            avd->auditdeny &= data;
+    }
+    return changed;
+}
+
 /*
  * Compute access vectors and extended permissions based on a context
  * structure pair for the permissions in a particular class.
@@ -1002,6 +1165,8 @@ static void context_struct_compute_av(struct policydb *policydb, struct context
     struct ebitmap *sattr, *tattr;
     struct ebitmap_node *snode, *tnode;
     unsigned int i, j;
+    u32 cidx;
+    u16 changed;
 
     avd->allowed = 0;
     avd->auditallow = 0;
@@ -1028,12 +1193,19 @@ static void context_struct_compute_av(struct policydb *policydb, struct context
     tattr = &policydb->type_attr_map_array[tcontext->type - 1];
     ebitmap_for_each_positive_bit(sattr, snode, i)
     {
+        if (hidden_attr(scontext->type, i + 1))
+            continue;
         ebitmap_for_each_positive_bit(tattr, tnode, j)
         {
+            if (hidden_attr(tcontext->type, j + 1))
+                continue;
             avkey.source_type = i + 1;
             avkey.target_type = j + 1;
+            changed = fold_hidden_av(&avkey, avd);
             for (node = avtab_search_node(&policydb->te_avtab, &avkey); node;
                  node = avtab_search_node_next(node, avkey.specified)) {
+                if (node->key.specified & changed)
+                    continue;
                 if (node->key.specified == AVTAB_ALLOWED)
                     avd->allowed |= node->datum.u.data;
                 else if (node->key.specified == AVTAB_AUDITALLOW)
@@ -1054,12 +1226,14 @@ static void context_struct_compute_av(struct policydb *policydb, struct context
      * the MLS policy).
      */
     constraint = tclass_datum->constraints;
+    cidx = 0;
     while (constraint) {
         if ((constraint->permissions & (avd->allowed)) &&
-            !constraint_expr_eval(policydb, scontext, tcontext, NULL, constraint->expr)) {
+            !constraint_expr_eval(policydb, scontext, tcontext, NULL, constraint->expr, tclass, cidx)) {
             avd->allowed &= ~(constraint->permissions);
         }
         constraint = constraint->next;
+        cidx++;
     }
 
     /*
@@ -1085,17 +1259,18 @@ static void context_struct_compute_av(struct policydb *policydb, struct context
     type_attribute_bounds_av(policydb, scontext, tcontext, tclass, avd);
 }
 
-static void __nocfi security_compute_av_user_with_policy(struct selinux_policy *policy, u32 ssid, u32 tsid, u16 tclass,
-                                                         struct av_decision *avd)
+static void hidden_compute_av_user(u32 ssid, u32 tsid, u16 tclass, struct av_decision *avd)
 {
+    struct selinux_policy *policy;
     struct policydb *policydb;
     struct sidtab *sidtab;
     struct context *scontext = NULL, *tcontext = NULL;
 
-    // remove: rcu lock
-    avd_init(policy, avd);
+    rcu_read_lock();
+    avd_init(avd);
     // remove: if (!selinux_initialized())
 
+    policy = rcu_dereference(selinux_state.policy);
     policydb = &policy->policydb;
     sidtab = policy->sidtab;
 
@@ -1106,7 +1281,7 @@ static void __nocfi security_compute_av_user_with_policy(struct selinux_policy *
     }
 
     /* permissive domain? */
-    if (ebitmap_get_bit(&policydb->permissive_map, scontext->type))
+    if (ksu_hidden_permissive(scontext->type, ebitmap_get_bit(&policydb->permissive_map, scontext->type)))
         avd->flags |= AVD_FLAGS_PERMISSIVE;
 
     tcontext = sidtab_search(sidtab, tsid);
@@ -1121,15 +1296,12 @@ static void __nocfi security_compute_av_user_with_policy(struct selinux_policy *
         goto out;
     }
 
-    if (context_struct_compute_av_fn) {
-        context_struct_compute_av_fn(policydb, scontext, tcontext, tclass, avd, NULL);
-    } else {
-        context_struct_compute_av(policydb, scontext, tcontext, tclass, avd, NULL);
-    }
+    // the kernel's context_struct_compute_av() would see KernelSU's rules
+    context_struct_compute_av(policydb, scontext, tcontext, tclass, avd, NULL);
 out:
+    rcu_read_unlock();
     return;
 allow:
     avd->allowed = 0xffffffff;
     goto out;
 }
-#endif
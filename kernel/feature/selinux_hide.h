@@ -1,6 +1,9 @@
 #ifndef __KSU_H_SELINUX_HIDE
 #define __KSU_H_SELINUX_HIDE
 
+// Symbols the hide hooks look up, see ksu_init_symbol_resolver()
+extern struct ksu_symbol_table ksu_selinux_hide_symbols;
+
 void ksu_selinux_hide_init();
 void ksu_selinux_hide_exit();
 void ksu_selinux_hide_drop_backup_if_unused();
@@ -23,6 +23,7 @@
 #include "feature/sucompat.h"
 #include "policy/app_profile.h"
 #include "hook/syscall_hook.h"
+#include "hook/syscall_hook_manager.h"
 #include "sulog/event.h"
 #include "ksu.h"
 #include "util.h"
@@ -42,6 +43,7 @@ static int su_compat_feature_set(u64 value)
 {
     bool enable = value != 0;
     ksu_su_compat_enabled = enable;
+    ksu_set_hook_consumer(KSU_HOOK_CONSUMER_SU_COMPAT, enable);
     pr_info("su_compat: set to %d\n", enable);
     return 0;
 }
@@ -87,10 +89,9 @@ static bool is_ksud_exists()
     return true;
 }
 
-long ksu_handle_faccessat_sucompat(int orig_nr, struct pt_regs *regs)
+int ksu_handle_faccessat_sucompat(int orig_nr, struct pt_regs *regs, long *ret)
 {
     const char __user **filename_user, *orig_filename;
-    long ret;
     const struct cred *old_cred;
 
     if (!ksu_is_allow_uid_for_current(current_uid().val)) {
@@ -109,23 +110,22 @@ long ksu_handle_faccessat_sucompat(int orig_nr, struct pt_regs *regs)
             pr_info("faccessat su->ksud!\n");
             orig_filename = *filename_user;
             *filename_user = ksud_user_path();
-            ret = ksu_syscall_table[orig_nr](regs);
+            *ret = ksu_syscall_table[orig_nr](regs);
             revert_creds(old_cred);
             *filename_user = orig_filename;
-            return ret;
+            return KSU_HOOK_HANDLED;
         } else {
             revert_creds(old_cred);
         }
     }
 
 do_orig_facessat:
-    return ksu_syscall_table[orig_nr](regs);
+    return KSU_HOOK_CONTINUE;
 }
 
-long ksu_handle_stat_sucompat(int orig_nr, struct pt_regs *regs)
+int ksu_handle_stat_sucompat(int orig_nr, struct pt_regs *regs, long *ret)
 {
     const char __user **filename_user, *orig_filename;
-    long ret;
     const struct cred *old_cred;
 
     if (!ksu_is_allow_uid_for_current(current_uid().val)) {
@@ -144,22 +144,22 @@ long ksu_handle_stat_sucompat(int orig_nr, struct pt_regs *regs)
             pr_info("newfstatat su->ksud!\n");
             orig_filename = *filename_user;
             *filename_user = ksud_user_path();
-            ret = ksu_syscall_table[orig_nr](regs);
+            *ret = ksu_syscall_table[orig_nr](regs);
             revert_creds(old_cred);
             *filename_user = orig_filename;
-            return ret;
+            return KSU_HOOK_HANDLED;
         } else {
             revert_creds(old_cred);
         }
     }
 
 do_orig_stat:
-    return ksu_syscall_table[orig_nr](regs);
+    return KSU_HOOK_CONTINUE;
 }
 
-static long ksu_handle_execve_sucompat_common(const char __user **filename_user,
-                                              const char __user *const __user *argv_user, unsigned long envp,
-                                              bool execveat, int orig_nr, struct pt_regs *regs)
+static int ksu_handle_execve_sucompat_common(const char __user **filename_user,
+                                             const char __user *const __user *argv_user, unsigned long envp,
+                                             bool execveat, struct pt_regs *regs, long *result)
 {
     const char __user *fn;
     struct ksu_sulog_pending_event *pending_sucompat = NULL;
@@ -241,22 +241,23 @@ static long ksu_handle_execve_sucompat_common(const char __user **filename_user,
         regs->__PT_SYSCALL_PARM4_REG = orig_regs[3];
         regs->__PT_PARM5_REG = orig_regs[4];
     }
-    return ret;
+    *result = ret;
+    return KSU_HOOK_HANDLED;
 
 do_orig_execve:
-    return ksu_syscall_table[orig_nr](regs);
+    return KSU_HOOK_CONTINUE;
 }
 
-long ksu_handle_execve_sucompat(const char __user **filename_user, int orig_nr, struct pt_regs *regs)
+int ksu_handle_execve_sucompat(const char __user **filename_user, struct pt_regs *regs, long *ret)
 {
     return ksu_handle_execve_sucompat_common(filename_user, (const char __user *const __user *)PT_REGS_PARM2(regs),
-                                             PT_REGS_PARM3(regs), false, orig_nr, regs);
+                                             PT_REGS_PARM3(regs), false, regs, ret);
 }
 
-long ksu_handle_execveat_sucompat(const char __user **filename_user, int orig_nr, struct pt_regs *regs)
+int ksu_handle_execveat_sucompat(const char __user **filename_user, struct pt_regs *regs, long *ret)
 {
     return ksu_handle_execve_sucompat_common(filename_user, (const char __user *const __user *)PT_REGS_PARM3(regs),
-                                             PT_REGS_SYSCALL_PARM4(regs), true, orig_nr, regs);
+                                             PT_REGS_SYSCALL_PARM4(regs), true, regs, ret);
 }
 
 // sucompat: permitted process can execute 'su' to gain root access.
@@ -265,6 +266,7 @@ void __init ksu_sucompat_init()
     if (ksu_register_feature_handler(&su_compat_handler)) {
         pr_err("Failed to register su_compat feature handler\n");
     }
+    ksu_set_hook_consumer(KSU_HOOK_CONSUMER_SU_COMPAT, ksu_su_compat_enabled);
 }
 
 void __exit ksu_sucompat_exit()
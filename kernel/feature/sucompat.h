@@ -8,10 +8,11 @@ extern bool ksu_su_compat_enabled;
 void ksu_sucompat_init(void);
 void ksu_sucompat_exit(void);
 
-// Handler functions exported for hook_manager
-long ksu_handle_faccessat_sucompat(int orig_nr, struct pt_regs *regs);
-long ksu_handle_stat_sucompat(int orig_nr, struct pt_regs *regs);
-long ksu_handle_execve_sucompat(const char __user **filename_user, int orig_nr, struct pt_regs *regs);
-long ksu_handle_execveat_sucompat(const char __user **filename_user, int orig_nr, struct pt_regs *regs);
+// Syscall chain handlers, return a ksu_hook_verdict and set *ret when the
+// syscall was redirected to ksud
+int ksu_handle_faccessat_sucompat(int orig_nr, struct pt_regs *regs, long *ret);
+int ksu_handle_stat_sucompat(int orig_nr, struct pt_regs *regs, long *ret);
+int ksu_handle_execve_sucompat(const char __user **filename_user, struct pt_regs *regs, long *ret);
+int ksu_handle_execveat_sucompat(const char __user **filename_user, struct pt_regs *regs, long *ret);
 
 #endif
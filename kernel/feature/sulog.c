@@ -2,6 +2,7 @@
 #include <linux/compiler_types.h>
 
 #include "feature/sulog.h"
+#include "hook/syscall_hook_manager.h"
 #include "klog.h" // IWYU pragma: keep
 #include "policy/feature.h"
 #include "sulog/event.h"
@@ -20,6 +21,7 @@ static int sulog_feature_set(u64 value)
     bool enable = value != 0;
 
     ksu_sulog_enabled = enable;
+    ksu_set_hook_consumer(KSU_HOOK_CONSUMER_SULOG, enable);
     pr_info("sulog: set to %d\n", enable);
     return 0;
 }
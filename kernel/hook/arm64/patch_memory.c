@@ -9,6 +9,8 @@
 #include "klog.h" // IWYU pragma: keep
 #include "linux/cpumask.h"
 #include "linux/gfp.h" // IWYU pragma: keep
+#include "linux/ktime.h"
+#include "linux/slab.h"
 #include "linux/uaccess.h"
 #include "linux/stop_machine.h"
 #include "asm/cacheflush.h"
@@ -103,11 +105,9 @@ fail:
 #endif
 
 struct patch_text_info {
-    void *dst;
-    void *src;
-    size_t len;
+    struct ksu_text_patch *patches;
+    int count;
     atomic_t cpu_count;
-    int flags;
 };
 
 // Implementation of arbitrary kernel address modification.
@@ -128,7 +128,7 @@ struct patch_text_info {
 // not a big problem because we are in stop_machine.
 // ^1: https://github.com/NothingOSS/android_kernel_device_modules_6.1_nothing_mt6878/blob/957dac185efe46cbf6336b0fff9516d84c8cd78f/drivers/misc/mediatek/mkp/mkp_main.c#L29
 // ^2: https://github.com/torvalds/linux/commit/c0eb315ad9719e41ce44708455cc69df7ac9f3f8
-static int ksu_patch_text_nosync(void *dst, void *src, size_t len, int flags)
+static int ksu_patch_text_nosync(void *dst, const void *src, size_t len)
 {
     pr_debug("patch dst=0x%lx src=0x%lx len=%ld\n", (unsigned long)dst, (unsigned long)src, len);
 
@@ -151,30 +151,47 @@ static int ksu_patch_text_nosync(void *dst, void *src, size_t len, int flags)
 
     clear_fixmap(FIX_TEXT_POKE0);
 
-    if (!ret) {
-        if (flags & KSU_PATCH_TEXT_FLUSH_ICACHE)
-            ksu_flush_icache((uintptr_t)dst, (uintptr_t)dst + len);
-        if (flags & KSU_PATCH_TEXT_FLUSH_DCACHE)
-            ksu_flush_dcache(dst, len);
-    }
-
 err:
     pr_debug("patch result=%d\n", ret);
     return ret;
 }
 
+static void ksu_patch_text_flush(void *dst, size_t len, int flags)
+{
+    if (flags & KSU_PATCH_TEXT_FLUSH_ICACHE)
+        ksu_flush_icache((uintptr_t)dst, (uintptr_t)dst + len);
+    if (flags & KSU_PATCH_TEXT_FLUSH_DCACHE)
+        ksu_flush_dcache(dst, len);
+}
+
+// Write all patches first, then do the cache maintenance for all of them
+static int ksu_patch_text_batch_nosync(struct ksu_text_patch *patches, int count)
+{
+    int ret = 0;
+    int i, done;
+
+    for (done = 0; done < count; done++) {
+        struct ksu_text_patch *p = &patches[done];
+
+        ret = ksu_patch_text_nosync(p->dst, p->src ?: p->buf, p->len);
+        if (ret)
+            break;
+    }
+    for (i = 0; i < done; i++)
+        ksu_patch_text_flush(patches[i].dst, patches[i].len, patches[i].flags);
+
+    return ret;
+}
+
 static int ksu_patch_text_cb(void *arg)
 {
     struct patch_text_info *pp = arg;
-    void *dst = pp->dst, *src = pp->src;
-    size_t len = pp->len;
-    int flags = pp->flags;
 
     int ret = 0;
 
     /* The last CPU becomes master */
     if (atomic_inc_return(&pp->cpu_count) == num_online_cpus()) {
-        ret = ksu_patch_text_nosync(dst, src, len, flags);
+        ret = ksu_patch_text_batch_nosync(pp->patches, pp->count);
         /* Notify other processors with an additional increment. */
         atomic_inc(&pp->cpu_count);
     } else {
@@ -186,17 +203,79 @@ static int ksu_patch_text_cb(void *arg)
     return ret;
 }
 
-int ksu_patch_text(void *dst, void *src, size_t len, int flags)
+static int ksu_patch_text_run(struct ksu_text_patch *patches, int count)
 {
     struct patch_text_info info = {
+        .patches = patches,
+        .count = count,
+        .cpu_count = ATOMIC_INIT(0),
+    };
+
+    return stop_machine(ksu_patch_text_cb, &info, cpu_online_mask);
+}
+
+int ksu_patch_text(void *dst, void *src, size_t len, int flags)
+{
+    struct ksu_text_patch patch = {
         .dst = dst,
         .src = src,
         .len = len,
-        .cpu_count = ATOMIC_INIT(0),
         .flags = flags,
     };
 
-    return stop_machine(ksu_patch_text_cb, &info, cpu_online_mask);
+    return ksu_patch_text_run(&patch, 1);
+}
+
+void ksu_patch_batch_init(struct ksu_patch_batch *batch)
+{
+    memset(batch, 0, sizeof(*batch));
+}
+
+int ksu_patch_batch_add(struct ksu_patch_batch *batch, void *dst, const void *src, size_t len, int flags)
+{
+    struct ksu_text_patch *patch;
+
+    if (len > KSU_PATCH_TEXT_MAX)
+        return -E2BIG;
+
+    if (batch->count == batch->cap) {
+        int cap = batch->cap ? batch->cap * 2 : 8;
+        struct ksu_text_patch *patches = krealloc(batch->patches, cap * sizeof(*patches), GFP_KERNEL);
+
+        if (!patches)
+            return -ENOMEM;
+        batch->patches = patches;
+        batch->cap = cap;
+    }
+
+    patch = &batch->patches[batch->count++];
+    patch->dst = dst;
+    patch->src = NULL;
+    patch->len = len;
+    patch->flags = flags;
+    memcpy(patch->buf, src, len);
+    return 0;
+}
+
+int ksu_patch_batch_apply(struct ksu_patch_batch *batch)
+{
+    u64 start;
+    int ret;
+
+    if (!batch->count)
+        return 0;
+
+    start = ktime_get_ns();
+    ret = ksu_patch_text_run(batch->patches, batch->count);
+    pr_info("patch batch: %d patches, stopped for %llu ns, ret: %d\n", batch->count, ktime_get_ns() - start, ret);
+    ksu_patch_batch_release(batch);
+    return ret;
+}
+
+void ksu_patch_batch_release(struct ksu_patch_batch *batch)
+{
+    kfree(batch->patches);
+    memset(batch, 0, sizeof(*batch));
 }
 
 /*
@@ -1,3 +1,4 @@
+#include <linux/bitmap.h>
 #include <linux/compiler.h>
 #include <linux/errno.h>
 #include <linux/kallsyms.h>
@@ -22,6 +23,16 @@ static DEFINE_MUTEX(ksu_lsm_hook_lock);
 static struct ksu_lsm_hook_entry ksu_lsm_hook_entries[16];
 static int ksu_lsm_hook_count;
 
+static struct ksu_symbol_request lsm_hook_symbol_reqs[] = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+    { "static_calls_table", KSU_SYMBOL_EXACT },
+    { "lsm_active_cnt", KSU_SYMBOL_EXACT },
+#else
+    { "security_hook_heads", KSU_SYMBOL_EXACT },
+#endif
+};
+struct ksu_symbol_table ksu_lsm_hook_symbols = KSU_SYMBOL_TABLE(lsm_hook_symbol_reqs);
+
 static bool ksu_lsm_hook_is_tracked(struct ksu_lsm_hook *hook)
 {
     int i;
@@ -393,6 +404,15 @@ out_unlock:
     return ret;
 }
 
+static void **ksu_lsm_hook_slot(struct ksu_lsm_hook *hook)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
+    if (hook->entry == &hook->list)
+        return (void **)&hook->list.head->first;
+#endif
+    return (void **)((char *)hook->entry + hook->hook_offset);
+}
+
 void ksu_lsm_unhook(struct ksu_lsm_hook *hook)
 {
     void **slot;
@@ -407,17 +427,7 @@ void ksu_lsm_unhook(struct ksu_lsm_hook *hook)
         return;
     }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
-    slot = (void **)((char *)hook->entry + hook->hook_offset);
-#else
-    if (hook->entry == &hook->list) {
-        slot = (void **)&hook->list.head->first;
-        pr_info("unhook patch head->first\n");
-    } else {
-        slot = (void **)((char *)hook->entry + hook->hook_offset);
-        pr_info("unhook patch slot\n");
-    }
-#endif
+    slot = ksu_lsm_hook_slot(hook);
     if (ksu_lsm_hook_patch_slot(slot, hook->original)) {
         pr_err("lsm_hook: failed to restore %s\n", hook->head_name ?: "unknown");
         mutex_unlock(&ksu_lsm_hook_lock);
@@ -458,12 +468,86 @@ void __init ksu_lsm_hook_init(void)
     pr_info("lsm_hook: init, tracked hooks=%d\n", READ_ONCE(ksu_lsm_hook_count));
 }
 
+static bool ksu_lsm_hook_patched(struct ksu_lsm_hook *hook)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+    return hook->entry && hook->scall;
+#else
+    return hook->entry;
+#endif
+}
+
+// Restore every tracked slot under one stop_machine. Returns 0 or the first
+// error, hooks that could not be restored stay tracked for ksu_lsm_unhook()
+static int ksu_lsm_hook_restore_all(void)
+{
+    struct ksu_patch_batch batch;
+    struct ksu_lsm_hook *hook;
+    DECLARE_BITMAP(failed, ARRAY_SIZE(ksu_lsm_hook_entries));
+    int kept = 0;
+    int ret = 0;
+    int i;
+
+    ksu_patch_batch_init(&batch);
+    mutex_lock(&ksu_lsm_hook_lock);
+    for (i = ksu_lsm_hook_count - 1; i >= 0 && !ret; i--) {
+        hook = ksu_lsm_hook_entries[i].hook;
+        if (ksu_lsm_hook_patched(hook))
+            ret = ksu_patch_batch_add(&batch, ksu_lsm_hook_slot(hook), &hook->original, sizeof(hook->original),
+                                      KSU_PATCH_TEXT_FLUSH_DCACHE);
+    }
+    ret = ret ?: ksu_patch_batch_apply(&batch);
+    ksu_patch_batch_release(&batch);
+    if (ret) {
+        mutex_unlock(&ksu_lsm_hook_lock);
+        pr_warn("lsm_hook: batch restore failed: %d, restoring one by one\n", ret);
+        return ret;
+    }
+    smp_wmb();
+
+    bitmap_zero(failed, ARRAY_SIZE(ksu_lsm_hook_entries));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+    for (i = ksu_lsm_hook_count - 1; i >= 0; i--) {
+        hook = ksu_lsm_hook_entries[i].hook;
+        if (!ksu_lsm_hook_patched(hook) || !ksu_lsm_hook_update_scall(hook->scall, hook->original))
+            continue;
+
+        // same as ksu_lsm_unhook(): the static call still targets us, so the slot must too
+        if (ksu_lsm_hook_patch_slot(ksu_lsm_hook_slot(hook), hook->replacement))
+            pr_err("lsm_hook: failed to reapply %s after static call restore failure\n", hook->head_name ?: "unknown");
+        __set_bit(i, failed);
+        ret = ret ?: -EFAULT;
+    }
+#endif
+
+    synchronize_rcu();
+    for (i = 0; i < ksu_lsm_hook_count; i++) {
+        hook = ksu_lsm_hook_entries[i].hook;
+        if (test_bit(i, failed)) {
+            ksu_lsm_hook_entries[kept++] = ksu_lsm_hook_entries[i];
+            continue;
+        }
+        if (ksu_lsm_hook_patched(hook))
+            pr_info("lsm_hook: restored %s to %px\n", hook->head_name ?: "unknown", hook->original);
+        hook->entry = NULL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+        hook->scall = NULL;
+#endif
+    }
+    ksu_lsm_hook_count = kept;
+    mutex_unlock(&ksu_lsm_hook_lock);
+    return ret;
+}
+
 void __exit ksu_lsm_hook_exit(void)
 {
     struct ksu_lsm_hook *hooks[ARRAY_SIZE(ksu_lsm_hook_entries)];
     int count;
     int i;
 
+    if (!ksu_lsm_hook_restore_all())
+        return;
+
     mutex_lock(&ksu_lsm_hook_lock);
     count = ksu_lsm_hook_count;
     for (i = 0; i < count; i++)
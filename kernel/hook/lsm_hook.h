@@ -71,6 +71,9 @@ void ksu_unregister_lsm_hook(struct ksu_lsm_hook *hook);
 // register/unregister. Safe to call more than once.
 void ksu_lsm_hook_init(void);
 
+// Symbols ksu_lsm_hook() looks up, see ksu_init_symbol_resolver()
+extern struct ksu_symbol_table ksu_lsm_hook_symbols;
+
 // Restore all currently tracked LSM hooks in reverse order and clear the
 // internal registry. Call this from module exit to avoid leaving patched LSM
 // hook slots behind.
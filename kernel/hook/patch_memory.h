@@ -28,6 +28,32 @@
 
 unsigned long phys_from_virt(unsigned long addr, int *err);
 int ksu_patch_text(void *dst, void *src, size_t len, int flags);
+
+// Patches queued by ksu_patch_batch_add() are applied together by
+// ksu_patch_batch_apply(), with every CPU stopped only once.
+#define KSU_PATCH_TEXT_MAX 16
+
+struct ksu_text_patch {
+    void *dst;
+    const void *src; // NULL for the copy in buf
+    size_t len;
+    int flags;
+    u8 buf[KSU_PATCH_TEXT_MAX];
+};
+
+struct ksu_patch_batch {
+    struct ksu_text_patch *patches;
+    int count;
+    int cap;
+};
+
+void ksu_patch_batch_init(struct ksu_patch_batch *batch);
+// @src is copied, at most KSU_PATCH_TEXT_MAX bytes
+int ksu_patch_batch_add(struct ksu_patch_batch *batch, void *dst, const void *src, size_t len, int flags);
+// Apply and release the batch. Patching stops at the first failure, the
+// patches before it stay applied.
+int ksu_patch_batch_apply(struct ksu_patch_batch *batch);
+void ksu_patch_batch_release(struct ksu_patch_batch *batch);
 void *scan_call_to(void *start, size_t size, void *target);
 
 #endif
@@ -16,6 +16,7 @@
 #include "runtime/ksud.h"
 #include "sulog/event.h"
 #include "hook/syscall_hook.h"
+#include "hook/syscall_hook_manager.h"
 #include "hook/syscall_event_bridge.h"
 #include "feature/adb_root.h"
 
@@ -48,87 +49,156 @@ static int ksu_handle_init_mark_tracker(const char __user **filename_user)
     return 0;
 }
 
-long __nocfi ksu_hook_newfstatat(int orig_nr, const struct pt_regs *regs)
+static inline bool is_init_child(void)
 {
-    if (!ksu_su_compat_enabled)
-        return ksu_syscall_table[orig_nr](regs);
+    return current->pid != 1 && is_init(current_cred());
+}
 
-    return ksu_handle_stat_sucompat(orig_nr, (struct pt_regs *)regs);
+static inline const char __user **execve_filename(int orig_nr, struct pt_regs *regs)
+{
+    return orig_nr == __NR_execveat ? (const char __user **)&PT_REGS_PARM2(regs) :
+                                      (const char __user **)&PT_REGS_PARM1(regs);
 }
 
-long __nocfi ksu_hook_faccessat(int orig_nr, const struct pt_regs *regs)
+static inline const char __user *const __user *execve_argv(int orig_nr, struct pt_regs *regs)
 {
-    if (!ksu_su_compat_enabled)
-        return ksu_syscall_table[orig_nr](regs);
+    return orig_nr == __NR_execveat ? (const char __user *const __user *)PT_REGS_PARM3(regs) :
+                                      (const char __user *const __user *)PT_REGS_PARM2(regs);
+}
 
-    return ksu_handle_faccessat_sucompat(orig_nr, (struct pt_regs *)regs);
+// Boot stage detection: second_stage init and the first zygote
+static int ksud_execve_pre(int orig_nr, struct pt_regs *regs, long *ret, void **data)
+{
+    if (orig_nr == __NR_execveat)
+        ksu_execveat_hook_ksud(regs);
+    else
+        ksu_execve_hook_ksud(regs);
+    return KSU_HOOK_CONTINUE;
 }
 
-DEFINE_STATIC_KEY_TRUE(ksud_execve_key);
+static int sulog_execve_pre(int orig_nr, struct pt_regs *regs, long *ret, void **data)
+{
+    if (current_euid().val == 0)
+        *data = ksu_sulog_capture_root_execve(*execve_filename(orig_nr, regs), execve_argv(orig_nr, regs),
+                                              GFP_KERNEL);
+    return KSU_HOOK_CONTINUE;
+}
 
-void ksu_stop_ksud_execve_hook()
+static void sulog_execve_post(int orig_nr, const struct pt_regs *regs, long ret, void *data)
 {
-    static_branch_disable(&ksud_execve_key);
+    ksu_sulog_emit_pending(data, ret, GFP_KERNEL);
 }
 
-static long __nocfi ksu_hook_execve_common(int orig_nr, const struct pt_regs *regs, bool execveat)
+static int init_tracker_execve_pre(int orig_nr, struct pt_regs *regs, long *ret, void **data)
 {
-    const char __user **filename_user =
-        execveat ? (const char __user **)&PT_REGS_PARM2(regs) : (const char __user **)&PT_REGS_PARM1(regs);
-    const char __user *const __user *argv_user = execveat ? (const char __user *const __user *)PT_REGS_PARM3(regs) :
-                                                            (const char __user *const __user *)PT_REGS_PARM2(regs);
-    bool current_is_init = is_init(current_cred());
-    struct ksu_sulog_pending_event *pending_root_execve = NULL;
-    long ret;
+    if (is_init_child())
+        ksu_handle_init_mark_tracker(execve_filename(orig_nr, regs));
+    return KSU_HOOK_CONTINUE;
+}
 
-    if (static_branch_unlikely(&ksud_execve_key)) {
-        if (execveat) {
-            ksu_execveat_hook_ksud(regs);
-        } else {
-            ksu_execve_hook_ksud(regs);
-        }
-    }
+static int adb_root_execve_pre(int orig_nr, struct pt_regs *regs, long *ret, void **data)
+{
+    long err;
 
-    if (current_euid().val == 0)
-        pending_root_execve = ksu_sulog_capture_root_execve(*filename_user, argv_user, GFP_KERNEL);
-
-    if (current->pid != 1 && current_is_init) {
-        ksu_handle_init_mark_tracker(filename_user);
-        ret = execveat ? ksu_adb_root_handle_execveat((struct pt_regs *)regs) :
-                         ksu_adb_root_handle_execve((struct pt_regs *)regs);
-        if (ret) {
-            pr_err("adb root failed: %ld\n", ret);
-        }
-    } else if (ksu_su_compat_enabled) {
-        ret = execveat ? ksu_handle_execveat_sucompat(filename_user, orig_nr, (struct pt_regs *)regs) :
-                         ksu_handle_execve_sucompat(filename_user, orig_nr, (struct pt_regs *)regs);
-        ksu_sulog_emit_pending(pending_root_execve, ret, GFP_KERNEL);
-        return ret;
+    if (!is_init_child())
+        return KSU_HOOK_CONTINUE;
+
+    err = orig_nr == __NR_execveat ? ksu_adb_root_handle_execveat(regs) : ksu_adb_root_handle_execve(regs);
+    if (err) {
+        pr_err("adb root failed: %ld\n", err);
     }
+    return KSU_HOOK_CONTINUE;
+}
+
+static int su_compat_execve_pre(int orig_nr, struct pt_regs *regs, long *ret, void **data)
+{
+    if (is_init_child())
+        return KSU_HOOK_CONTINUE;
 
-    ret = ksu_syscall_table[orig_nr](regs);
-    ksu_sulog_emit_pending(pending_root_execve, ret, GFP_KERNEL);
-    return ret;
+    return orig_nr == __NR_execveat ? ksu_handle_execveat_sucompat(execve_filename(orig_nr, regs), regs, ret) :
+                                      ksu_handle_execve_sucompat(execve_filename(orig_nr, regs), regs, ret);
 }
 
-long __nocfi ksu_hook_execve(int orig_nr, const struct pt_regs *regs)
+static int su_compat_faccessat_pre(int orig_nr, struct pt_regs *regs, long *ret, void **data)
 {
-    return ksu_hook_execve_common(orig_nr, regs, false);
+    return ksu_handle_faccessat_sucompat(orig_nr, regs, ret);
 }
 
-long __nocfi ksu_hook_execveat(int orig_nr, const struct pt_regs *regs)
+static int su_compat_newfstatat_pre(int orig_nr, struct pt_regs *regs, long *ret, void **data)
 {
-    return ksu_hook_execve_common(orig_nr, regs, true);
+    return ksu_handle_stat_sucompat(orig_nr, regs, ret);
 }
 
-long __nocfi ksu_hook_setresuid(int orig_nr, const struct pt_regs *regs)
+static int setresuid_pre(int orig_nr, struct pt_regs *regs, long *ret, void **data)
 {
-    uid_t old_uid = current_uid().val;
-    long ret = ksu_syscall_table[orig_nr](regs);
+    *data = (void *)(uintptr_t)current_uid().val;
+    return KSU_HOOK_CONTINUE;
+}
 
+static void setresuid_post(int orig_nr, const struct pt_regs *regs, long ret, void *data)
+{
     if (ret < 0)
-        return ret;
+        return;
+
+    ksu_handle_setresuid((uid_t)(uintptr_t)data, current_uid().val);
+}
+
+#define DEFINE_SYSCALL_HANDLER(_var, _name, _nr, _prio, _consumer, _pre, _post)                                     \
+    static struct ksu_syscall_handler _var = {                                                                     \
+        .name = _name,                                                                                             \
+        .nr = _nr,                                                                                                 \
+        .priority = _prio,                                                                                         \
+        .consumer = _consumer,                                                                                     \
+        .pre = _pre,                                                                                               \
+        .post = _post,                                                                                             \
+    }
+
+#define DEFINE_EXECVE_HANDLERS(_id, _prio, _consumer, _pre, _post)                                                 \
+    DEFINE_SYSCALL_HANDLER(_id##_execve_handler, #_id, __NR_execve, _prio, _consumer, _pre, _post);                \
+    DEFINE_SYSCALL_HANDLER(_id##_execveat_handler, #_id, __NR_execveat, _prio, _consumer, _pre, _post)
+
+// Chain order within execve/execveat: lower priority runs first
+// init_tracker unmarks init's children on exec for the whole session, so it
+// belongs to the core consumer rather than to the ksud boot stages.
+DEFINE_EXECVE_HANDLERS(ksud, 0, KSU_HOOK_CONSUMER_KSUD, ksud_execve_pre, NULL);
+DEFINE_EXECVE_HANDLERS(sulog, 10, KSU_HOOK_CONSUMER_SULOG, sulog_execve_pre, sulog_execve_post);
+DEFINE_EXECVE_HANDLERS(init_tracker, 20, KSU_HOOK_CONSUMER_CORE, init_tracker_execve_pre, NULL);
+DEFINE_EXECVE_HANDLERS(adb_root, 30, KSU_HOOK_CONSUMER_ADB_ROOT, adb_root_execve_pre, NULL);
+DEFINE_EXECVE_HANDLERS(su_compat, 40, KSU_HOOK_CONSUMER_SU_COMPAT, su_compat_execve_pre, NULL);
+
+DEFINE_SYSCALL_HANDLER(su_compat_faccessat_handler, "su_compat", __NR_faccessat, 0, KSU_HOOK_CONSUMER_SU_COMPAT,
+                       su_compat_faccessat_pre, NULL);
+DEFINE_SYSCALL_HANDLER(su_compat_newfstatat_handler, "su_compat", __NR_newfstatat, 0, KSU_HOOK_CONSUMER_SU_COMPAT,
+                       su_compat_newfstatat_pre, NULL);
+DEFINE_SYSCALL_HANDLER(setresuid_handler, "setresuid", __NR_setresuid, 0, KSU_HOOK_CONSUMER_CORE, setresuid_pre,
+                       setresuid_post);
+
+static struct ksu_syscall_handler *bridge_handlers[] = {
+    &ksud_execve_handler,          &ksud_execveat_handler,         &sulog_execve_handler,
+    &sulog_execveat_handler,       &init_tracker_execve_handler,   &init_tracker_execveat_handler,
+    &adb_root_execve_handler,      &adb_root_execveat_handler,     &su_compat_execve_handler,
+    &su_compat_execveat_handler,   &su_compat_faccessat_handler,   &su_compat_newfstatat_handler,
+    &setresuid_handler,
+};
 
-    ksu_handle_setresuid(old_uid, current_uid().val);
-    return ret;
+void ksu_stop_ksud_execve_hook()
+{
+    ksu_set_syscall_handler_enabled(&ksud_execve_handler, false);
+    ksu_set_syscall_handler_enabled(&ksud_execveat_handler, false);
+}
+
+void __init ksu_syscall_event_bridge_init(void)
+{
+    int i, ret;
+
+    // adb_root's static key follows its execve handlers
+    adb_root_execve_handler.key = &ksu_adb_root.key;
+    adb_root_execveat_handler.key = &ksu_adb_root.key;
+
+    for (i = 0; i < ARRAY_SIZE(bridge_handlers); i++) {
+        ret = ksu_register_syscall_handler(bridge_handlers[i]);
+        if (ret)
+            pr_err("hook_manager: register handler %s for syscall %d failed: %d\n", bridge_handlers[i]->name,
+                   bridge_handlers[i]->nr, ret);
+    }
 }
@@ -1,13 +1,8 @@
 #ifndef __KSU_H_SYSCALL_EVENT_BRIDGE
 #define __KSU_H_SYSCALL_EVENT_BRIDGE
 
-#include <asm/ptrace.h>
-
-long ksu_hook_newfstatat(int orig_nr, const struct pt_regs *regs);
-long ksu_hook_faccessat(int orig_nr, const struct pt_regs *regs);
-long ksu_hook_execve(int orig_nr, const struct pt_regs *regs);
-long ksu_hook_execveat(int orig_nr, const struct pt_regs *regs);
-long ksu_hook_setresuid(int orig_nr, const struct pt_regs *regs);
+// Register the syscall handlers of core and built-in features
+void ksu_syscall_event_bridge_init(void);
 
 void ksu_stop_ksud_execve_hook(void);
 
@@ -6,6 +6,10 @@
 typedef sys_call_ptr_t syscall_fn_t;
 #endif
 
+#ifndef __NR_syscalls
+#define __NR_syscalls (__NR_syscall_max + 1)
+#endif
+
 extern syscall_fn_t *ksu_syscall_table;
 
 // Dispatcher slot number in syscall table
@@ -35,16 +39,18 @@ bool ksu_has_syscall_hook(int nr);
 // --- Direct syscall table patching API (hook/unhook) ---
 // Directly overwrite syscall_table[@nr] with @fn using fixmap + stop_machine.
 // Saves the original handler to *@old (if non-NULL) and records the entry
-// for restoration at module exit. Use this for boot-time hooks that replace
-// a real syscall entry (e.g. ksud hooking __NR_execve/__NR_read/__NR_fstat).
+// for restoration at module exit. Use this only for hooks that must see
+// every task; per-task hooks should go through the dispatcher instead.
 void ksu_syscall_table_hook(int nr, syscall_fn_t fn, syscall_fn_t *old);
 
 // Restore syscall_table[@nr] to its original value recorded by
 // ksu_syscall_table_hook(), and remove the entry from the tracking list.
-// Use this to cleanly undo a direct hook when it is no longer needed
-// (e.g. ksud unhooking __NR_read after init.rc injection is done).
+// Use this to cleanly undo a direct hook when it is no longer needed.
 void ksu_syscall_table_unhook(int nr);
 
+// Symbols ksu_syscall_hook_init() looks up, see ksu_init_symbol_resolver()
+extern struct ksu_symbol_table ksu_syscall_hook_symbols;
+
 void ksu_syscall_hook_init(void);
 void ksu_syscall_hook_exit(void);
 
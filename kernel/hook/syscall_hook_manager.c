@@ -1,7 +1,14 @@
 #include "linux/printk.h"
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/refcount.h>
+#include <linux/srcu.h>
 #include <linux/kprobes.h>
+#include <linux/log2.h>
+#include <linux/timekeeping.h>
 #include <linux/tracepoint.h>
+#include <linux/wait.h>
 #include <asm/syscall.h>
 #include <linux/ptrace.h>
 #include <linux/slab.h>
@@ -21,6 +28,378 @@
 #include "hook/setuid_hook.h"
 #include "hook/syscall_hook.h"
 #include "hook/syscall_event_bridge.h"
+#include "ksu.h"
+
+#define KSU_CHAIN_MAX_HANDLERS 8
+
+// Snapshot of the enabled handlers of one syscall, sorted by priority.
+// Replaced as a whole on every change. The dispatcher only holds SRCU to pin
+// it with a reference, so a task blocking in the original syscall never holds
+// up a grace period. The last reference frees it after an SRCU grace period.
+struct ksu_syscall_chain {
+    struct rcu_head rcu;
+    // one for syscall_chains[], one per dispatcher running it
+    refcount_t ref;
+    int count;
+    struct ksu_syscall_handler *handlers[KSU_CHAIN_MAX_HANDLERS];
+};
+
+DEFINE_STATIC_SRCU(syscall_chain_srcu);
+static struct ksu_syscall_chain __rcu *syscall_chains[__NR_syscalls];
+
+// Protected by hook_chain_lock
+static LIST_HEAD(registered_handlers);
+static bool consumer_active[KSU_HOOK_CONSUMER_MAX];
+static DEFINE_MUTEX(hook_chain_lock);
+// woken whenever a chain is freed, see ksu_unregister_syscall_handler()
+static DECLARE_WAIT_QUEUE_HEAD(chain_release_wq);
+
+static DEFINE_STATIC_KEY_FALSE(hook_latency_key);
+
+static __always_inline void record_latency(struct ksu_syscall_handler *handler, u64 ns)
+{
+    int bucket = ns ? min_t(int, ilog2(ns), KSU_HOOK_LATENCY_BUCKETS - 1) : 0;
+
+    this_cpu_inc(handler->stats->latency[bucket]);
+}
+
+static void free_syscall_chain(struct rcu_head *rcu)
+{
+    struct ksu_syscall_chain *chain = container_of(rcu, struct ksu_syscall_chain, rcu);
+    int i;
+
+    for (i = 0; i < chain->count; i++)
+        atomic_dec(&chain->handlers[i]->chains);
+    kfree(chain);
+    wake_up_all(&chain_release_wq);
+}
+
+// Readers may still be between srcu_dereference() and taking their
+// reference, so the final free waits for an SRCU grace period.
+static void put_syscall_chain(struct ksu_syscall_chain *chain)
+{
+    if (refcount_dec_and_test(&chain->ref))
+        call_srcu(&syscall_chain_srcu, &chain->rcu, free_syscall_chain);
+}
+
+static long __nocfi ksu_syscall_chain_dispatch(int orig_nr, const struct pt_regs *regs)
+{
+    struct ksu_syscall_chain *chain;
+    struct ksu_syscall_handler *handler;
+    void *data[KSU_CHAIN_MAX_HANDLERS];
+    u64 cost[KSU_CHAIN_MAX_HANDLERS];
+    u64 start = 0;
+    int i, ran = 0, idx;
+    bool timed = static_branch_unlikely(&hook_latency_key);
+    bool handled = false;
+    long ret = 0;
+
+    idx = srcu_read_lock(&syscall_chain_srcu);
+    chain = srcu_dereference(syscall_chains[orig_nr], &syscall_chain_srcu);
+    if (chain && !refcount_inc_not_zero(&chain->ref))
+        chain = NULL;
+    srcu_read_unlock(&syscall_chain_srcu, idx);
+    if (unlikely(!chain)) {
+        // Unhooked while this syscall was being redirected
+        return ksu_syscall_table[orig_nr](regs);
+    }
+
+    for (i = 0; i < chain->count && !handled; i++) {
+        handler = chain->handlers[i];
+        data[i] = NULL;
+        cost[i] = 0;
+        ran++;
+        this_cpu_inc(handler->stats->calls);
+        if (!handler->pre)
+            continue;
+        if (timed)
+            start = ktime_get_ns();
+        if (handler->pre(orig_nr, (struct pt_regs *)regs, &ret, &data[i]) == KSU_HOOK_HANDLED) {
+            this_cpu_inc(handler->stats->handled);
+            handled = true;
+        }
+        if (timed)
+            cost[i] = ktime_get_ns() - start;
+    }
+
+    if (!handled)
+        ret = ksu_syscall_table[orig_nr](regs);
+
+    for (i = ran - 1; i >= 0; i--) {
+        handler = chain->handlers[i];
+        if (handler->post) {
+            if (timed)
+                start = ktime_get_ns();
+            handler->post(orig_nr, regs, ret, data[i]);
+            if (timed)
+                cost[i] += ktime_get_ns() - start;
+        }
+        if (timed)
+            record_latency(handler, cost[i]);
+    }
+    put_syscall_chain(chain);
+
+    return ret;
+}
+
+// Publish a new snapshot for @nr and route the syscall through the
+// dispatcher only while the snapshot is not empty.
+static int rebuild_syscall_chain(int nr, gfp_t gfp)
+{
+    struct ksu_syscall_chain *chain = NULL, *old;
+    struct ksu_syscall_handler *handler;
+    int i;
+
+    list_for_each_entry (handler, &registered_handlers, list) {
+        if (handler->nr != nr || !handler->enabled)
+            continue;
+        if (!chain) {
+            chain = kzalloc(sizeof(*chain), gfp);
+            if (!chain)
+                return -ENOMEM;
+            refcount_set(&chain->ref, 1);
+        }
+        // insertion sort, equal priorities keep registration order
+        for (i = chain->count; i > 0 && chain->handlers[i - 1]->priority > handler->priority; i--)
+            chain->handlers[i] = chain->handlers[i - 1];
+        chain->handlers[i] = handler;
+        chain->count++;
+    }
+
+    for (i = 0; chain && i < chain->count; i++)
+        atomic_inc(&chain->handlers[i]->chains);
+
+    old = rcu_dereference_protected(syscall_chains[nr], lockdep_is_held(&hook_chain_lock));
+    rcu_assign_pointer(syscall_chains[nr], chain);
+
+    // The dispatcher falls back to the original syscall when the chain
+    // is gone, so syscalls redirected just before this are still served.
+    if (chain && !old)
+        ksu_register_syscall_hook(nr, ksu_syscall_chain_dispatch);
+    else if (!chain && old)
+        ksu_unregister_syscall_hook(nr);
+
+    if (old)
+        put_syscall_chain(old);
+    return 0;
+}
+
+static void set_handler_enabled_locked(struct ksu_syscall_handler *handler, bool enabled)
+{
+    struct ksu_syscall_handler_stats stats;
+    int ret;
+
+    if (handler->enabled == enabled)
+        return;
+
+    handler->enabled = enabled;
+    if (enabled && handler->key)
+        static_key_enable(handler->key);
+
+    // Dropping a handler must not fail: unregister waits for every chain
+    // holding it to go away, and the snapshot is only a few pointers.
+    ret = rebuild_syscall_chain(handler->nr, enabled ? GFP_KERNEL : GFP_KERNEL | __GFP_NOFAIL);
+    if (ret) {
+        pr_err("hook_manager: enable handler %s for syscall %d failed: %d\n", handler->name, handler->nr, ret);
+        handler->enabled = false;
+        if (handler->key)
+            static_key_disable(handler->key);
+        return;
+    }
+
+    if (!enabled && handler->key)
+        static_key_disable(handler->key);
+
+    if (enabled) {
+        pr_info("hook_manager: handler %s for syscall %d enabled\n", handler->name, handler->nr);
+    } else {
+        ksu_get_syscall_handler_stats(handler, &stats);
+        pr_info("hook_manager: handler %s for syscall %d disabled, calls: %llu, handled: %llu\n", handler->name,
+                handler->nr, stats.calls, stats.handled);
+    }
+}
+
+int ksu_register_syscall_handler(struct ksu_syscall_handler *handler)
+{
+    struct ksu_syscall_handler *pos;
+    int count = 0;
+    int ret = 0;
+
+    if (!handler || handler->nr < 0 || handler->nr >= __NR_syscalls || handler->consumer >= KSU_HOOK_CONSUMER_MAX)
+        return -EINVAL;
+
+    mutex_lock(&hook_chain_lock);
+    list_for_each_entry (pos, &registered_handlers, list) {
+        if (pos == handler) {
+            ret = -EEXIST;
+            goto out;
+        }
+        if (pos->nr == handler->nr)
+            count++;
+    }
+    if (count >= KSU_CHAIN_MAX_HANDLERS) {
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    handler->stats = alloc_percpu(struct ksu_syscall_handler_stats);
+    if (!handler->stats) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    handler->enabled = false;
+    list_add_tail(&handler->list, &registered_handlers);
+
+    if (consumer_active[handler->consumer])
+        set_handler_enabled_locked(handler, true);
+
+out:
+    mutex_unlock(&hook_chain_lock);
+    return ret;
+}
+
+void ksu_unregister_syscall_handler(struct ksu_syscall_handler *handler)
+{
+    mutex_lock(&hook_chain_lock);
+    if (!handler->stats) {
+        mutex_unlock(&hook_chain_lock);
+        return;
+    }
+    set_handler_enabled_locked(handler, false);
+    list_del(&handler->list);
+    mutex_unlock(&hook_chain_lock);
+
+    // wait for dispatchers still running a chain that holds the handler,
+    // dispatchers of other chains and other syscalls don't matter
+    wait_event(chain_release_wq, !atomic_read(&handler->chains));
+    free_percpu(handler->stats);
+    handler->stats = NULL;
+}
+
+void ksu_set_syscall_handler_enabled(struct ksu_syscall_handler *handler, bool enabled)
+{
+    mutex_lock(&hook_chain_lock);
+    if (handler->stats)
+        set_handler_enabled_locked(handler, enabled);
+    mutex_unlock(&hook_chain_lock);
+}
+
+void ksu_get_syscall_handler_stats(struct ksu_syscall_handler *handler, struct ksu_syscall_handler_stats *out)
+{
+    struct ksu_syscall_handler_stats *pcpu;
+    int cpu, i;
+
+    memset(out, 0, sizeof(*out));
+    if (!handler->stats)
+        return;
+
+    for_each_possible_cpu (cpu) {
+        pcpu = per_cpu_ptr(handler->stats, cpu);
+        out->calls += READ_ONCE(pcpu->calls);
+        out->handled += READ_ONCE(pcpu->handled);
+        for (i = 0; i < KSU_HOOK_LATENCY_BUCKETS; i++)
+            out->latency[i] += READ_ONCE(pcpu->latency[i]);
+    }
+}
+
+void ksu_set_syscall_latency_enabled(bool enabled)
+{
+    if (enabled)
+        static_branch_enable(&hook_latency_key);
+    else
+        static_branch_disable(&hook_latency_key);
+    pr_info("hook_manager: latency collection %s\n", enabled ? "enabled" : "disabled");
+}
+
+bool ksu_syscall_latency_enabled(void)
+{
+    return static_key_enabled(&hook_latency_key);
+}
+
+void ksu_reset_syscall_handler_stats(void)
+{
+    struct ksu_syscall_handler *handler;
+    int cpu;
+
+    // Racing increments may survive, good enough for debugging
+    mutex_lock(&hook_chain_lock);
+    list_for_each_entry (handler, &registered_handlers, list) {
+        for_each_possible_cpu (cpu)
+            memset(per_cpu_ptr(handler->stats, cpu), 0, sizeof(struct ksu_syscall_handler_stats));
+    }
+    mutex_unlock(&hook_chain_lock);
+}
+
+u32 ksu_collect_syscall_handler_stats(struct ksu_hook_stat_entry *entries, u32 max)
+{
+    struct ksu_syscall_handler *handler;
+    struct ksu_syscall_handler_stats stats;
+    struct ksu_hook_stat_entry *entry;
+    u32 total = 0;
+
+    mutex_lock(&hook_chain_lock);
+    list_for_each_entry (handler, &registered_handlers, list) {
+        if (total < max) {
+            entry = &entries[total];
+            memset(entry, 0, sizeof(*entry));
+            strscpy(entry->name, handler->name, sizeof(entry->name));
+            entry->nr = handler->nr;
+            entry->priority = handler->priority;
+            entry->enabled = handler->enabled;
+            ksu_get_syscall_handler_stats(handler, &stats);
+            entry->calls = stats.calls;
+            entry->handled = stats.handled;
+            memcpy(entry->latency, stats.latency, sizeof(entry->latency));
+        }
+        total++;
+    }
+    mutex_unlock(&hook_chain_lock);
+
+    return total;
+}
+
+void ksu_set_hook_consumer(enum ksu_hook_consumer consumer, bool active)
+{
+    struct ksu_syscall_handler *handler;
+
+    if (consumer >= KSU_HOOK_CONSUMER_MAX)
+        return;
+
+    mutex_lock(&hook_chain_lock);
+    if (consumer_active[consumer] == active)
+        goto out;
+
+    consumer_active[consumer] = active;
+    list_for_each_entry (handler, &registered_handlers, list) {
+        if (handler->consumer == consumer)
+            set_handler_enabled_locked(handler, active);
+    }
+    pr_info("hook_manager: consumer %d %s\n", consumer, active ? "active" : "inactive");
+
+out:
+    mutex_unlock(&hook_chain_lock);
+}
+
+static void ksu_reset_syscall_handlers(void)
+{
+    struct ksu_syscall_handler *handler;
+
+    mutex_lock(&hook_chain_lock);
+    memset(consumer_active, 0, sizeof(consumer_active));
+    mutex_unlock(&hook_chain_lock);
+
+    for (;;) {
+        mutex_lock(&hook_chain_lock);
+        handler = list_first_entry_or_null(&registered_handlers, struct ksu_syscall_handler, list);
+        mutex_unlock(&hook_chain_lock);
+        if (!handler)
+            break;
+        ksu_unregister_syscall_handler(handler);
+    }
+
+    // pending snapshot frees
+    srcu_barrier(&syscall_chain_srcu);
+}
 
 #ifdef CONFIG_KRETPROBES
 
@@ -60,8 +439,9 @@ static int syscall_regfunc_handler(struct kretprobe_instance *ri, struct pt_regs
     unsigned long flags;
     ksu_tp_marker_lock(&flags);
     if (ksu_tp_marker_reg_count() < 1) {
-        // while install our tracepoint, mark our processes
-        ksu_mark_running_process_locked();
+        // while install our tracepoint, the kernel marks every task;
+        // unmark the ones we don't care about later
+        ksu_mark_running_process();
     } else if (ksu_tp_marker_reg_count() == 1) {
         // while other tracepoint first added, mark all processes
         ksu_mark_all_process();
@@ -81,7 +461,7 @@ static int syscall_unregfunc_handler(struct kretprobe_instance *ri, struct pt_re
         ksu_unmark_all_process();
     } else if (ksu_tp_marker_reg_count() == 1) {
         // while just our tracepoint left, unmark disallowed processes
-        ksu_mark_running_process_locked();
+        ksu_mark_running_process();
     }
     ksu_tp_marker_unlock(&flags);
     return 0;
@@ -131,17 +511,18 @@ void __init ksu_syscall_hook_manager_init(void)
     syscall_unregfunc_rp = init_kretprobe("syscall_unregfunc", syscall_unregfunc_handler);
 #endif
 
-    // Register syscall hooks via dispatcher
-    ksu_register_syscall_hook(__NR_setresuid, ksu_hook_setresuid);
-    ksu_register_syscall_hook(__NR_execve, ksu_hook_execve);
-    ksu_register_syscall_hook(__NR_execveat, ksu_hook_execveat);
-    ksu_register_syscall_hook(__NR_newfstatat, ksu_hook_newfstatat);
-    ksu_register_syscall_hook(__NR_faccessat, ksu_hook_faccessat);
+    // Register syscall handlers. A syscall is routed via the dispatcher only
+    // while one of its handlers is enabled; feature-owned handlers follow
+    // their consumer, which the feature handlers toggle.
+    ksu_set_hook_consumer(KSU_HOOK_CONSUMER_CORE, true);
+    if (!ksu_late_loaded)
+        ksu_set_hook_consumer(KSU_HOOK_CONSUMER_KSUD, true);
+    ksu_syscall_event_bridge_init();
 
 #ifdef CONFIG_HAVE_SYSCALL_TRACEPOINTS
     ret = register_trace_prio_sys_enter(ksu_sys_enter_handler, NULL, INT_MIN);
 #ifndef CONFIG_KRETPROBES
-    ksu_mark_running_process_locked();
+    ksu_mark_running_process();
 #endif
     if (ret) {
         pr_err("hook_manager: failed to register sys_enter tracepoint: %d\n", ret);
@@ -157,6 +538,9 @@ void __init ksu_syscall_hook_manager_init(void)
 void __exit ksu_syscall_hook_manager_exit(void)
 {
     pr_info("hook_manager: ksu_hook_manager_exit called\n");
+    // no mark pass may run or be queued once teardown starts
+    ksu_tp_marker_exit();
+
 #ifdef CONFIG_HAVE_SYSCALL_TRACEPOINTS
     unregister_trace_sys_enter(ksu_sys_enter_handler, NULL);
     tracepoint_synchronize_unregister();
@@ -168,11 +552,7 @@ void __exit ksu_syscall_hook_manager_exit(void)
     destroy_kretprobe(&syscall_unregfunc_rp);
 #endif
 
-    ksu_unregister_syscall_hook(__NR_setresuid);
-    ksu_unregister_syscall_hook(__NR_execve);
-    ksu_unregister_syscall_hook(__NR_execveat);
-    ksu_unregister_syscall_hook(__NR_newfstatat);
-    ksu_unregister_syscall_hook(__NR_faccessat);
+    ksu_reset_syscall_handlers();
 
     ksu_syscall_hook_exit();
 
@@ -2,6 +2,88 @@
 #define __KSU_H_HOOK_MANAGER
 
 #include <asm/ptrace.h>
+#include <linux/jump_label.h>
+#include <linux/list.h>
+#include <linux/types.h>
+#include "uapi/supercall.h"
+
+// Consumers of the dispatcher-routed syscall hooks.
+// Every syscall handler belongs to one consumer and is enabled while its
+// consumer is active; a syscall is routed through the dispatcher only while
+// at least one of its handlers is enabled.
+enum ksu_hook_consumer {
+    KSU_HOOK_CONSUMER_CORE = 0, // setresuid: manager fd, allowlist marking, umount; execve: init child unmark
+    KSU_HOOK_CONSUMER_KSUD, // execve, read, fstat: boot stages, init.rc injection, off after boot
+    KSU_HOOK_CONSUMER_SU_COMPAT, // execve, faccessat, newfstatat
+    KSU_HOOK_CONSUMER_ADB_ROOT, // execve
+    KSU_HOOK_CONSUMER_SULOG, // execve
+
+    KSU_HOOK_CONSUMER_MAX
+};
+
+// Return values of ksu_syscall_handler.pre
+enum ksu_hook_verdict {
+    KSU_HOOK_CONTINUE = 0, // run the rest of the chain and the original syscall
+    KSU_HOOK_HANDLED, // the handler served the syscall, *ret holds its result
+};
+
+// Handlers for one syscall form a chain ordered by ascending priority.
+// pre handlers run in order until one returns KSU_HOOK_HANDLED, then the
+// original syscall runs unless it was handled, then post handlers of every
+// pre that ran are called in reverse order with the final result.
+// @data is a per-call slot shared by the pre and post of the same handler.
+typedef int (*ksu_syscall_pre_fn)(int orig_nr, struct pt_regs *regs, long *ret, void **data);
+typedef void (*ksu_syscall_post_fn)(int orig_nr, const struct pt_regs *regs, long ret, void *data);
+
+struct ksu_syscall_handler_stats {
+    u64 calls;
+    u64 handled;
+    // log2 ns buckets of pre + post time, only while latency collection is on
+    u64 latency[KSU_HOOK_LATENCY_BUCKETS];
+};
+
+struct ksu_syscall_handler {
+    const char *name;
+    int nr;
+    int priority;
+    enum ksu_hook_consumer consumer;
+    ksu_syscall_pre_fn pre;
+    ksu_syscall_post_fn post;
+    // Optional static key following the enable bit, for branch sites in
+    // code shared with other paths.
+    struct static_key *key;
+
+    // private, managed by the hook manager
+    bool enabled;
+    // number of chain snapshots, published or still running, holding it
+    atomic_t chains;
+    struct ksu_syscall_handler_stats __percpu *stats;
+    struct list_head list;
+};
+
+// Add @handler to the chain of handler->nr. It starts enabled if its
+// consumer is active. Returns 0 on success, -ENOSPC if the chain is full.
+int ksu_register_syscall_handler(struct ksu_syscall_handler *handler);
+void ksu_unregister_syscall_handler(struct ksu_syscall_handler *handler);
+
+// Enable or disable a single handler regardless of its consumer.
+void ksu_set_syscall_handler_enabled(struct ksu_syscall_handler *handler, bool enabled);
+
+// Sum the per-CPU counters of @handler.
+void ksu_get_syscall_handler_stats(struct ksu_syscall_handler *handler, struct ksu_syscall_handler_stats *out);
+
+// Toggle latency collection of all handlers, off by default.
+void ksu_set_syscall_latency_enabled(bool enabled);
+bool ksu_syscall_latency_enabled(void);
+
+// Clear the counters and histograms of all handlers.
+void ksu_reset_syscall_handler_stats(void);
+
+// Fill up to @max entries and return the number of registered handlers.
+u32 ksu_collect_syscall_handler_stats(struct ksu_hook_stat_entry *entries, u32 max);
+
+// Activate or deactivate @consumer, enabling or disabling all its handlers.
+void ksu_set_hook_consumer(enum ksu_hook_consumer consumer, bool active);
 
 // Hook manager initialization and cleanup
 void ksu_syscall_hook_manager_init(void);
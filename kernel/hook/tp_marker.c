@@ -1,10 +1,14 @@
 #include "hook/tp_marker.h"
 
 #include "linux/cred.h"
+#include <linux/atomic.h>
+#include <linux/pid.h>
+#include <linux/pid_namespace.h>
 #include <linux/spinlock.h>
 #include <linux/version.h>
 #include <linux/sched/signal.h>
 #include <linux/sched/task.h>
+#include <linux/workqueue.h>
 
 #include "policy/allowlist.h"
 #include "klog.h" // IWYU pragma: keep
@@ -14,6 +18,8 @@
 // == 1: just us
 // >  1: someone else is also using syscall tracepoint e.g. ftrace
 static int tracepoint_reg_count = 0;
+// set once every syscall tracepoint user, us included, went away
+static bool tracepoint_dropped = false;
 static DEFINE_SPINLOCK(tracepoint_reg_lock);
 
 int ksu_tp_marker_reg_count(void)
@@ -34,11 +40,13 @@ void ksu_tp_marker_unlock(unsigned long *flags)
 void ksu_tp_marker_inc_reg_count(void)
 {
     tracepoint_reg_count++;
+    tracepoint_dropped = false;
 }
 
 void ksu_tp_marker_dec_reg_count(void)
 {
-    tracepoint_reg_count--;
+    if (--tracepoint_reg_count <= 0)
+        tracepoint_dropped = true;
 }
 
 void ksu_clear_task_tracepoint_flag_if_needed(struct task_struct *t)
@@ -51,79 +59,254 @@ void ksu_clear_task_tracepoint_flag_if_needed(struct task_struct *t)
     spin_unlock_irqrestore(&tracepoint_reg_lock, flags);
 }
 
-// Process marking management
-static void handle_process_mark(bool mark)
+// Marks normally follow tasks incrementally: children inherit the flag on
+// fork, init's children drop it on exec, and setresuid sets or clears it
+// for app processes. Full passes are only needed when the policy itself
+// changes (allowlist, tracepoint registration) or on request. They may be
+// asked for from kretprobe handlers in atomic context, so every pass runs
+// deferred in bounded batches and tasklist/RCU hold times stay short.
+#define KSU_MARK_BATCH 256
+#define KSU_MARK_ALL_UIDS ((uid_t)-1)
+
+enum ksu_mark_pass {
+    KSU_PASS_NONE = 0,
+    KSU_PASS_MARK_ALL,
+    KSU_PASS_UNMARK_ALL,
+    // follow should_mark_task()
+    KSU_PASS_RECONCILE,
+};
+
+struct ksu_mark_stats {
+    unsigned int scanned;
+    unsigned int marked;
+    unsigned int unmarked;
+};
+
+static void reconcile_work_fn(struct work_struct *work);
+static DECLARE_WORK(reconcile_work, reconcile_work_fn);
+static DEFINE_SPINLOCK(reconcile_lock);
+// Protected by reconcile_lock. A pending mark/unmark-all pass runs before a
+// pending reconcile, the latest of mark/unmark-all wins.
+static enum ksu_mark_pass pending_full = KSU_PASS_NONE;
+static uid_t reconcile_uid = KSU_MARK_ALL_UIDS;
+static bool reconcile_pending = false;
+static bool marker_stopping = false;
+// marked task count of the last full pass, reported for pid 0
+static atomic_t last_marked_count = ATOMIC_INIT(0);
+
+// Must be called with rcu_read_lock held
+static bool should_mark_task(struct task_struct *t)
 {
-    struct task_struct *p, *t;
-    read_lock(&tasklist_lock);
-    for_each_process_thread (p, t) {
-        if (mark)
-            ksu_set_task_tracepoint_flag(t);
-        else
-            ksu_clear_task_tracepoint_flag(t);
+    const struct cred *cred = __task_cred(t);
+    uid_t uid = cred->uid.val;
+
+    // before boot completed, we shall mark init for marking zygote
+    if (t->pid == 1)
+        return true;
+    if (uid == 0 && is_task_ksu_domain(cred))
+        return true;
+    if (is_zygote(cred))
+        return true;
+    if (uid == 2000)
+        return true;
+    return ksu_is_allow_uid(uid);
+}
+
+// Must be called with rcu_read_lock held
+static void apply_task_mark(struct task_struct *t, enum ksu_mark_pass pass, struct ksu_mark_stats *stats)
+{
+    bool mark;
+
+    if (pass == KSU_PASS_RECONCILE) {
+        if (t->pid != 1 && !t->mm) {
+            // skip kernel threads, but always allow pid 1
+            return;
+        }
+        mark = should_mark_task(t);
+    } else {
+        mark = pass == KSU_PASS_MARK_ALL;
+    }
+
+    stats->scanned++;
+    if (mark) {
+        ksu_set_task_tracepoint_flag(t);
+        stats->marked++;
+    } else {
+        ksu_clear_task_tracepoint_flag(t);
+        stats->unmarked++;
     }
-    read_unlock(&tasklist_lock);
 }
 
-void ksu_mark_all_process(void)
+// Walk at most KSU_MARK_BATCH threads starting from tid *cursor.
+// Returns true once every thread has been visited.
+// Must be called with rcu_read_lock held
+static bool mark_batch(int *cursor, enum ksu_mark_pass pass, uid_t uid, struct ksu_mark_stats *stats)
 {
-    handle_process_mark(true);
-    pr_info("tp_marker: mark all user process done!\n");
+    struct pid *pid;
+    struct task_struct *t;
+    int n;
+
+    for (n = 0; n < KSU_MARK_BATCH; n++) {
+        pid = find_ge_pid(*cursor, &init_pid_ns);
+        if (!pid)
+            return true;
+        *cursor = pid_nr(pid) + 1;
+
+        t = pid_task(pid, PIDTYPE_PID);
+        if (!t)
+            continue;
+        if (uid != KSU_MARK_ALL_UIDS && __task_cred(t)->uid.val != uid)
+            continue;
+        apply_task_mark(t, pass, stats);
+    }
+
+    return false;
 }
 
-void ksu_unmark_all_process(void)
+// Caller holds tracepoint_reg_lock. Re-checked per batch, so a pass never
+// outlives the state it was started for.
+static bool mark_pass_allowed(enum ksu_mark_pass pass)
 {
-    handle_process_mark(false);
-    pr_info("tp_marker: unmark all user process done!\n");
+    if (READ_ONCE(marker_stopping))
+        return false;
+    if (pass != KSU_PASS_RECONCILE)
+        return true;
+    // once someone else uses the syscall tracepoint every task must stay marked
+    if (tracepoint_reg_count > 1)
+        return false;
+    // our tracepoint is gone, marks were dropped with it
+    return !tracepoint_dropped;
 }
 
-void ksu_mark_running_process_locked(void)
+static void run_mark_pass(enum ksu_mark_pass pass, uid_t uid)
 {
-    struct task_struct *p, *t;
-    read_lock(&tasklist_lock);
-    for_each_process_thread (p, t) {
-        if (t->pid != 1 && !t->mm) {
-            // skip kernel threads, but always allow pid 1
-            continue;
-        }
-        int uid = task_uid(t).val;
-        const struct cred *cred = get_task_cred(t);
-        bool ksu_root_process = uid == 0 && is_task_ksu_domain(cred);
-        bool is_zygote_process = is_zygote(cred);
-        bool is_shell = uid == 2000;
-        // before boot completed, we shall mark init for marking zygote
-        bool is_init = t->pid == 1;
-        if (ksu_root_process || is_zygote_process || is_shell || is_init || ksu_is_allow_uid(uid)) {
-            ksu_set_task_tracepoint_flag(t);
-            pr_info("tp_marker: mark process: pid:%d, uid: %d, comm:%s\n", t->pid, uid, t->comm);
-        } else {
-            ksu_clear_task_tracepoint_flag(t);
-            pr_info("tp_marker: unmark process: pid:%d, uid: %d, comm:%s\n", t->pid, uid, t->comm);
+    struct ksu_mark_stats stats = { 0 };
+    unsigned long flags;
+    int cursor = 1;
+    bool done = false;
+
+    while (!done) {
+        spin_lock_irqsave(&tracepoint_reg_lock, flags);
+        if (!mark_pass_allowed(pass)) {
+            spin_unlock_irqrestore(&tracepoint_reg_lock, flags);
+            pr_info("tp_marker: pass %d aborted after %u tasks, reg count: %d\n", pass, stats.scanned,
+                    tracepoint_reg_count);
+            return;
         }
-        put_cred(cred);
+        rcu_read_lock();
+        done = mark_batch(&cursor, pass, uid, &stats);
+        rcu_read_unlock();
+        spin_unlock_irqrestore(&tracepoint_reg_lock, flags);
+
+        cond_resched();
+    }
+
+    if (pass == KSU_PASS_MARK_ALL) {
+        pr_info("tp_marker: mark all user process done!\n");
+    } else if (pass == KSU_PASS_UNMARK_ALL) {
+        pr_info("tp_marker: unmark all user process done!\n");
+    } else if (uid == KSU_MARK_ALL_UIDS) {
+        atomic_set(&last_marked_count, stats.marked);
+        pr_info("tp_marker: reconciled %u tasks: %u marked, %u unmarked\n", stats.scanned, stats.marked,
+                stats.unmarked);
+    } else {
+        pr_info("tp_marker: reconciled %u tasks of uid %d: %u marked, %u unmarked\n", stats.scanned, uid,
+                stats.marked, stats.unmarked);
     }
-    read_unlock(&tasklist_lock);
 }
 
-void ksu_mark_running_process(void)
+static void reconcile_work_fn(struct work_struct *work)
 {
+    enum ksu_mark_pass full;
     unsigned long flags;
-    spin_lock_irqsave(&tracepoint_reg_lock, flags);
-    if (tracepoint_reg_count <= 1) {
-        ksu_mark_running_process_locked();
+    bool reconcile;
+    uid_t uid;
+
+    spin_lock_irqsave(&reconcile_lock, flags);
+    full = pending_full;
+    pending_full = KSU_PASS_NONE;
+    reconcile = reconcile_pending;
+    uid = reconcile_uid;
+    reconcile_uid = KSU_MARK_ALL_UIDS;
+    reconcile_pending = false;
+    spin_unlock_irqrestore(&reconcile_lock, flags);
+
+    if (full != KSU_PASS_NONE)
+        run_mark_pass(full, KSU_MARK_ALL_UIDS);
+    if (reconcile)
+        run_mark_pass(KSU_PASS_RECONCILE, uid);
+}
+
+static void request_pass(enum ksu_mark_pass pass, uid_t uid)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&reconcile_lock, flags);
+    if (marker_stopping) {
+        spin_unlock_irqrestore(&reconcile_lock, flags);
+        return;
+    }
+    if (pass != KSU_PASS_RECONCILE) {
+        pending_full = pass;
     } else {
-        pr_info("tp_marker: not mark running process since syscall tracepoint is in use\n");
+        if (!reconcile_pending)
+            reconcile_uid = uid;
+        else if (reconcile_uid != uid)
+            reconcile_uid = KSU_MARK_ALL_UIDS;
+        reconcile_pending = true;
     }
-    spin_unlock_irqrestore(&tracepoint_reg_lock, flags);
+    spin_unlock_irqrestore(&reconcile_lock, flags);
+
+    schedule_work(&reconcile_work);
+}
+
+void ksu_mark_all_process(void)
+{
+    request_pass(KSU_PASS_MARK_ALL, KSU_MARK_ALL_UIDS);
+}
+
+void ksu_unmark_all_process(void)
+{
+    request_pass(KSU_PASS_UNMARK_ALL, KSU_MARK_ALL_UIDS);
+}
+
+void ksu_mark_running_process(void)
+{
+    request_pass(KSU_PASS_RECONCILE, KSU_MARK_ALL_UIDS);
+}
+
+void ksu_mark_uid_process(uid_t uid)
+{
+    request_pass(KSU_PASS_RECONCILE, uid);
+}
+
+// Stop accepting passes and wait for the running one. Must run before the
+// kretprobes that request passes are destroyed; once syscall tracepoint users
+// are gone the kernel clears the marks itself.
+void ksu_tp_marker_exit(void)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&reconcile_lock, flags);
+    WRITE_ONCE(marker_stopping, true);
+    pending_full = KSU_PASS_NONE;
+    reconcile_pending = false;
+    spin_unlock_irqrestore(&reconcile_lock, flags);
+
+    cancel_work_sync(&reconcile_work);
 }
 
 // Get task mark status
 // Returns: 1 if marked, 0 if not marked, -ESRCH if task not found
+// For pid 0, returns the number of tasks marked by the last full pass
 int ksu_get_task_mark(pid_t pid)
 {
     struct task_struct *task;
     int marked = -ESRCH;
 
+    if (pid == 0)
+        return atomic_read(&last_marked_count);
+
     rcu_read_lock();
     task = find_task_by_vpid(pid);
     if (task) {
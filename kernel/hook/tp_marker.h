@@ -5,10 +5,15 @@
 #include <linux/sched.h>
 #include <linux/thread_info.h>
 
-// Process marking for tracepoint
+// Process marking for tracepoint. Every pass is deferred to a worker and
+// safe to call from atomic context.
 void ksu_mark_all_process(void);
 void ksu_unmark_all_process(void);
+// Re-evaluate marks of all (or one uid's) running tasks against the current
+// policy.
 void ksu_mark_running_process(void);
+void ksu_mark_uid_process(uid_t uid);
+void ksu_tp_marker_exit(void);
 
 // Per-task mark operations
 int ksu_get_task_mark(pid_t pid);
@@ -34,9 +39,6 @@ static inline void ksu_clear_task_tracepoint_flag(struct task_struct *t)
 
 void ksu_clear_task_tracepoint_flag_if_needed(struct task_struct *t);
 
-// Used by syscall_hook_manager kretprobe handlers
-void ksu_mark_running_process_locked(void);
-
 // Tracepoint registration count management (for kretprobe handlers)
 int ksu_tp_marker_reg_count(void);
 void ksu_tp_marker_lock(unsigned long *flags);
@@ -3,7 +3,9 @@
 #include "../syscall_hook.h"
 
 #include <linux/kallsyms.h>
+#include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
 #include <linux/nospec.h>
 #include <asm/cacheflush.h>
 #include "infra/symbol_resolver.h"
@@ -14,9 +16,19 @@
 sys_call_ptr_t *ksu_syscall_table = NULL;
 int ksu_dispatcher_nr = -1;
 
-#ifndef __NR_syscalls
-#define __NR_syscalls (__NR_syscall_max + 1)
+static struct ksu_symbol_request syscall_hook_symbol_reqs[] = {
+    { "sys_call_table", KSU_SYMBOL_FUNCTABLE },
+    { "__x64_sys_ni_syscall", KSU_SYMBOL_FUNCTABLE },
+#ifdef CONFIG_KSU_X86_PATCH_SYSCALL_DISPATCHER
+    { "x64_sys_call", KSU_SYMBOL_EXACT },
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+    { "do_syscall_64", KSU_SYMBOL_EXACT },
+    { "syscall_enter_from_user_mode", KSU_SYMBOL_EXACT },
+    { "syscall_exit_to_user_mode", KSU_SYMBOL_EXACT },
 #endif
+#endif
+};
+struct ksu_symbol_table ksu_syscall_hook_symbols = KSU_SYMBOL_TABLE(syscall_hook_symbol_reqs);
 
 // Hook registration table — read with READ_ONCE from tracepoint/dispatcher
 // context, written with WRITE_ONCE from init/exit context.
@@ -25,13 +37,13 @@ static ksu_syscall_hook_fn syscall_hooks[__NR_syscalls];
 // Track all hooked syscall entries for restoration.
 // Protected by hooked_entries_lock.
 struct syscall_hook_entry {
+    struct list_head list;
     int nr;
     sys_call_ptr_t orig;
 };
 
 static DEFINE_MUTEX(hooked_entries_lock);
-static struct syscall_hook_entry hooked_entries[16];
-static int hooked_count = 0;
+static LIST_HEAD(hooked_entries);
 
 static int patch_syscall_table(int nr, sys_call_ptr_t fn)
 {
@@ -69,22 +81,24 @@ void ksu_syscall_table_hook(int nr, sys_call_ptr_t fn, sys_call_ptr_t *old)
         *old = orig;
 
     // Record for later restoration
-    int i;
+    struct syscall_hook_entry *entry;
     bool found = false;
-    for (i = 0; i < hooked_count; i++) {
-        if (hooked_entries[i].nr == nr) {
+    list_for_each_entry (entry, &hooked_entries, list) {
+        if (entry->nr == nr) {
             found = true;
             break;
         }
     }
     if (!found) {
-        if (hooked_count < ARRAY_SIZE(hooked_entries)) {
-            hooked_entries[hooked_count].nr = nr;
-            hooked_entries[hooked_count].orig = orig;
-            hooked_count++;
-        } else {
-            pr_warn("hooked_entries full, cannot track syscall %d for restoration\n", nr);
+        entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+        if (!entry) {
+            pr_err("no memory to track syscall %d for restoration\n", nr);
+            mutex_unlock(&hooked_entries_lock);
+            return;
         }
+        entry->nr = nr;
+        entry->orig = orig;
+        list_add_tail(&entry->list, &hooked_entries);
     }
 
     patch_syscall_table(nr, fn);
@@ -95,7 +109,7 @@ void ksu_syscall_table_hook(int nr, sys_call_ptr_t fn, sys_call_ptr_t *old)
 // Restore syscall_table[nr] to its original value and remove from tracking list.
 void ksu_syscall_table_unhook(int nr)
 {
-    int i;
+    struct syscall_hook_entry *entry;
 
     if (ksu_syscall_table == NULL)
         return;
@@ -104,11 +118,11 @@ void ksu_syscall_table_unhook(int nr)
 
     mutex_lock(&hooked_entries_lock);
 
-    for (i = 0; i < hooked_count; i++) {
-        if (hooked_entries[i].nr == nr) {
-            patch_syscall_table(nr, hooked_entries[i].orig);
-            // Remove entry by swapping with last
-            hooked_entries[i] = hooked_entries[--hooked_count];
+    list_for_each_entry (entry, &hooked_entries, list) {
+        if (entry->nr == nr) {
+            patch_syscall_table(nr, entry->orig);
+            list_del(&entry->list);
+            kfree(entry);
             mutex_unlock(&hooked_entries_lock);
             pr_info("unhooked syscall %d\n", nr);
             return;
@@ -166,6 +180,9 @@ static long __nocfi ksu_syscall_dispatcher(const struct pt_regs *regs)
         ksu_syscall_hook_fn fn = READ_ONCE(syscall_hooks[orig_nr]);
         if (likely(fn))
             return fn(orig_nr, regs);
+        // The hook was removed after sys_enter redirected this syscall,
+        // serve it with the original handler.
+        return ksu_syscall_table[orig_nr](regs);
     }
 
     return -ENOSYS;
@@ -330,7 +347,11 @@ void __init __nocfi ksu_syscall_hook_init(void)
 
 void __exit ksu_syscall_hook_exit(void)
 {
-    int i;
+    struct syscall_hook_entry *entry, *tmp;
+    struct ksu_patch_batch batch;
+    int batch_ret = 0;
+
+    ksu_patch_batch_init(&batch);
 
 #ifdef CONFIG_KSU_X86_PATCH_SYSCALL_DISPATCHER
     int ret;
@@ -358,17 +379,26 @@ void __exit ksu_syscall_hook_exit(void)
 
     // First, restore all patched syscall table entries while the dispatcher
     // and hook table are still intact, so in-flight syscalls see valid state.
+    // All entries are restored under one stop_machine, one by one if that fails.
     mutex_lock(&hooked_entries_lock);
-    for (i = 0; i < hooked_count; i++) {
-        int nr = hooked_entries[i].nr;
-        sys_call_ptr_t orig = hooked_entries[i].orig;
+    list_for_each_entry (entry, &hooked_entries, list) {
+        pr_info("restore syscall %d to 0x%lx\n", entry->nr, (unsigned long)entry->orig);
+        if (!batch_ret)
+            batch_ret = ksu_patch_batch_add(&batch, &ksu_syscall_table[entry->nr], &entry->orig, sizeof(entry->orig),
+                                            KSU_PATCH_TEXT_FLUSH_DCACHE);
+    }
+    batch_ret = batch_ret ?: ksu_patch_batch_apply(&batch);
+    ksu_patch_batch_release(&batch);
+    list_for_each_entry_safe (entry, tmp, &hooked_entries, list) {
+        int nr = entry->nr;
+        sys_call_ptr_t orig = entry->orig;
 
-        pr_info("restore syscall %d to 0x%lx\n", nr, (unsigned long)orig);
-        if (ksu_patch_text(&ksu_syscall_table[nr], &orig, sizeof(orig), KSU_PATCH_TEXT_FLUSH_DCACHE)) {
+        if (batch_ret && ksu_patch_text(&ksu_syscall_table[nr], &orig, sizeof(orig), KSU_PATCH_TEXT_FLUSH_DCACHE)) {
             pr_err("restore syscall %d failed\n", nr);
         }
+        list_del(&entry->list);
+        kfree(entry);
     }
-    hooked_count = 0;
     mutex_unlock(&hooked_entries_lock);
 
 clear_state:
@@ -7,11 +7,14 @@
 #include <linux/err.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/refcount.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
 #include <linux/mount.h>
+#include <linux/spinlock.h>
 
 #include "objsec.h"
 
@@ -20,11 +23,25 @@
 
 #include "infra/file_wrapper.h"
 
+// One wrapper table per distinct original f_op, shared by every wrapped file using it.
+// The key stays valid while referenced because each wrapped file pins its original file.
+struct ksu_wrapper_ops {
+    struct hlist_node node;
+    const struct file_operations *orig_fops;
+    refcount_t ref;
+    struct file_operations ops;
+};
+
 struct ksu_file_wrapper {
     struct file *orig;
-    struct file_operations ops;
+    struct ksu_wrapper_ops *wops;
 };
 
+#define WRAPPER_OPS_HASH_BITS 4
+
+static DEFINE_HASHTABLE(wrapper_ops_table, WRAPPER_OPS_HASH_BITS);
+static DEFINE_SPINLOCK(wrapper_ops_lock);
+
 static struct ksu_file_wrapper *ksu_create_file_wrapper(struct file *fp);
 
 static int ksu_wrapper_open(struct inode *ino, struct file *fp)
@@ -40,7 +57,7 @@ static int ksu_wrapper_open(struct inode *ino, struct file *fp)
         return PTR_ERR(wrapper);
     }
     fp->private_data = wrapper;
-    const struct file_operations *new_fops = fops_get(&wrapper->ops);
+    const struct file_operations *new_fops = fops_get(&wrapper->wops->ops);
     replace_fops(fp, new_fops);
     return 0;
 }
@@ -344,65 +361,127 @@ static int ksu_wrapper_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-static struct ksu_file_wrapper *ksu_create_file_wrapper(struct file *fp)
+static void ksu_fill_wrapper_ops(struct file_operations *p, const struct file_operations *fops)
 {
-    struct ksu_file_wrapper *p = kcalloc(1, sizeof(struct ksu_file_wrapper), GFP_KERNEL);
-    if (!p) {
-        return ERR_PTR(-ENOMEM);
-    }
-
-    get_file(fp);
-
-    p->orig = fp;
-    p->ops.owner = THIS_MODULE;
-    p->ops.llseek = fp->f_op->llseek ? ksu_wrapper_llseek : NULL;
-    p->ops.read = fp->f_op->read ? ksu_wrapper_read : NULL;
-    p->ops.write = fp->f_op->write ? ksu_wrapper_write : NULL;
-    p->ops.read_iter = fp->f_op->read_iter ? ksu_wrapper_read_iter : NULL;
-    p->ops.write_iter = fp->f_op->write_iter ? ksu_wrapper_write_iter : NULL;
-    p->ops.iopoll = fp->f_op->iopoll ? ksu_wrapper_iopoll : NULL;
+    p->owner = THIS_MODULE;
+    p->llseek = fops->llseek ? ksu_wrapper_llseek : NULL;
+    p->read = fops->read ? ksu_wrapper_read : NULL;
+    p->write = fops->write ? ksu_wrapper_write : NULL;
+    p->read_iter = fops->read_iter ? ksu_wrapper_read_iter : NULL;
+    p->write_iter = fops->write_iter ? ksu_wrapper_write_iter : NULL;
+    p->iopoll = fops->iopoll ? ksu_wrapper_iopoll : NULL;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
-    p->ops.iterate = fp->f_op->iterate ? ksu_wrapper_iterate : NULL;
+    p->iterate = fops->iterate ? ksu_wrapper_iterate : NULL;
 #endif
-    p->ops.iterate_shared = fp->f_op->iterate_shared ? ksu_wrapper_iterate_shared : NULL;
-    p->ops.poll = fp->f_op->poll ? ksu_wrapper_poll : NULL;
-    p->ops.unlocked_ioctl = fp->f_op->unlocked_ioctl ? ksu_wrapper_unlocked_ioctl : NULL;
-    p->ops.compat_ioctl = fp->f_op->compat_ioctl ? ksu_wrapper_compat_ioctl : NULL;
-    p->ops.mmap = fp->f_op->mmap ? ksu_wrapper_mmap : NULL;
+    p->iterate_shared = fops->iterate_shared ? ksu_wrapper_iterate_shared : NULL;
+    p->poll = fops->poll ? ksu_wrapper_poll : NULL;
+    p->unlocked_ioctl = fops->unlocked_ioctl ? ksu_wrapper_unlocked_ioctl : NULL;
+    p->compat_ioctl = fops->compat_ioctl ? ksu_wrapper_compat_ioctl : NULL;
+    p->mmap = fops->mmap ? ksu_wrapper_mmap : NULL;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
-    p->ops.fop_flags = fp->f_op->fop_flags;
+    p->fop_flags = fops->fop_flags;
 #else
-    p->ops.mmap_supported_flags = fp->f_op->mmap_supported_flags;
+    p->mmap_supported_flags = fops->mmap_supported_flags;
 #endif
-    p->ops.flush = fp->f_op->flush ? ksu_wrapper_flush : NULL;
-    p->ops.release = ksu_wrapper_release;
-    p->ops.fsync = fp->f_op->fsync ? ksu_wrapper_fsync : NULL;
-    p->ops.fasync = fp->f_op->fasync ? ksu_wrapper_fasync : NULL;
-    p->ops.lock = fp->f_op->lock ? ksu_wrapper_lock : NULL;
+    p->flush = fops->flush ? ksu_wrapper_flush : NULL;
+    p->release = ksu_wrapper_release;
+    p->fsync = fops->fsync ? ksu_wrapper_fsync : NULL;
+    p->fasync = fops->fasync ? ksu_wrapper_fasync : NULL;
+    p->lock = fops->lock ? ksu_wrapper_lock : NULL;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
-    p->ops.sendpage = fp->f_op->sendpage ? ksu_wrapper_sendpage : NULL;
+    p->sendpage = fops->sendpage ? ksu_wrapper_sendpage : NULL;
 #endif
-    p->ops.get_unmapped_area = fp->f_op->get_unmapped_area ? ksu_wrapper_get_unmapped_area : NULL;
-    p->ops.check_flags = fp->f_op->check_flags;
-    p->ops.flock = fp->f_op->flock ? ksu_wrapper_flock : NULL;
-    p->ops.splice_write = fp->f_op->splice_write ? ksu_wrapper_splice_write : NULL;
-    p->ops.splice_read = fp->f_op->splice_read ? ksu_wrapper_splice_read : NULL;
-    p->ops.setlease = fp->f_op->setlease ? ksu_wrapper_setlease : NULL;
-    p->ops.fallocate = fp->f_op->fallocate ? ksu_wrapper_fallocate : NULL;
-    p->ops.show_fdinfo = fp->f_op->show_fdinfo ? ksu_wrapper_show_fdinfo : NULL;
-    p->ops.copy_file_range = fp->f_op->copy_file_range ? ksu_wrapper_copy_file_range : NULL;
-    p->ops.remap_file_range = fp->f_op->remap_file_range ? ksu_wrapper_remap_file_range : NULL;
-    p->ops.fadvise = fp->f_op->fadvise ? ksu_wrapper_fadvise : NULL;
+    p->get_unmapped_area = fops->get_unmapped_area ? ksu_wrapper_get_unmapped_area : NULL;
+    p->check_flags = fops->check_flags;
+    p->flock = fops->flock ? ksu_wrapper_flock : NULL;
+    p->splice_write = fops->splice_write ? ksu_wrapper_splice_write : NULL;
+    p->splice_read = fops->splice_read ? ksu_wrapper_splice_read : NULL;
+    p->setlease = fops->setlease ? ksu_wrapper_setlease : NULL;
+    p->fallocate = fops->fallocate ? ksu_wrapper_fallocate : NULL;
+    p->show_fdinfo = fops->show_fdinfo ? ksu_wrapper_show_fdinfo : NULL;
+    p->copy_file_range = fops->copy_file_range ? ksu_wrapper_copy_file_range : NULL;
+    p->remap_file_range = fops->remap_file_range ? ksu_wrapper_remap_file_range : NULL;
+    p->fadvise = fops->fadvise ? ksu_wrapper_fadvise : NULL;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
-    p->ops.splice_eof = fp->f_op->splice_eof ? ksu_wrapper_splice_eof : NULL;
+    p->splice_eof = fops->splice_eof ? ksu_wrapper_splice_eof : NULL;
 #endif
+}
+
+static struct ksu_wrapper_ops *ksu_find_wrapper_ops(const struct file_operations *fops)
+{
+    struct ksu_wrapper_ops *wops;
+
+    hash_for_each_possible (wrapper_ops_table, wops, node, (unsigned long)fops) {
+        if (wops->orig_fops == fops && refcount_inc_not_zero(&wops->ref))
+            return wops;
+    }
+    return NULL;
+}
+
+static struct ksu_wrapper_ops *ksu_get_wrapper_ops(const struct file_operations *fops)
+{
+    struct ksu_wrapper_ops *wops, *found;
+
+    spin_lock(&wrapper_ops_lock);
+    wops = ksu_find_wrapper_ops(fops);
+    spin_unlock(&wrapper_ops_lock);
+    if (wops)
+        return wops;
+
+    wops = kzalloc(sizeof(*wops), GFP_KERNEL);
+    if (!wops)
+        return NULL;
+    wops->orig_fops = fops;
+    refcount_set(&wops->ref, 1);
+    ksu_fill_wrapper_ops(&wops->ops, fops);
+
+    // someone else may have interned the same f_op while we were filling ours
+    spin_lock(&wrapper_ops_lock);
+    found = ksu_find_wrapper_ops(fops);
+    if (!found)
+        hash_add(wrapper_ops_table, &wops->node, (unsigned long)fops);
+    spin_unlock(&wrapper_ops_lock);
+
+    if (found) {
+        kfree(wops);
+        return found;
+    }
+    return wops;
+}
+
+static void ksu_put_wrapper_ops(struct ksu_wrapper_ops *wops)
+{
+    if (!refcount_dec_and_lock(&wops->ref, &wrapper_ops_lock))
+        return;
+    hash_del(&wops->node);
+    spin_unlock(&wrapper_ops_lock);
+    kfree(wops);
+}
+
+static struct ksu_file_wrapper *ksu_create_file_wrapper(struct file *fp)
+{
+    struct ksu_file_wrapper *p = kmalloc(sizeof(struct ksu_file_wrapper), GFP_KERNEL);
+    if (!p) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    p->wops = ksu_get_wrapper_ops(fp->f_op);
+    if (!p->wops) {
+        kfree(p);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    get_file(fp);
+    p->orig = fp;
 
     return p;
 }
 
 static void ksu_release_file_wrapper(struct ksu_file_wrapper *data)
 {
+    // drop the table first, the original file keeps its f_op alive until fput
+    ksu_put_wrapper_ops(data->wops);
     fput((struct file *)data->orig);
     kfree(data);
 }
@@ -509,7 +588,7 @@ int ksu_install_file_wrapper(int fd)
         goto out_put_fd;
     }
 
-    struct file *wrapper_file = ksu_anon_inode_create_getfile_compat("[ksu_fdwrapper]", &file_wrapper_data->ops,
+    struct file *wrapper_file = ksu_anon_inode_create_getfile_compat("[ksu_fdwrapper]", &file_wrapper_data->wops->ops,
                                                                      file_wrapper_data, orig_file->f_flags, NULL);
     if (IS_ERR(wrapper_file)) {
         pr_err("ksu_fdwrapper: getfile failed: %ld\n", PTR_ERR(wrapper_file));
@@ -1,6 +1,9 @@
+#include <linux/hash.h>
 #include <linux/kallsyms.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/stringhash.h>
 #include <linux/version.h>
 
 #include "infra/symbol_resolver.h"
@@ -54,9 +57,38 @@ struct ksu_lookup_symbol_ctx {
     void *match;
 };
 
-unsigned long __nocfi find_kernel_symbol_exact(const char *symbol_name)
+// Tables handed in by ksu_init_symbol_resolver(), later lookups of their
+// names are answered from the batched results
+static struct ksu_symbol_table *const *prefetched;
+static size_t prefetched_count;
+static bool prefetch_ready;
+
+static bool lookup_prefetched(const char *symbol_name, enum ksu_symbol_rule rule, unsigned long *addr)
+{
+    struct ksu_symbol_table *table;
+    size_t i, j;
+
+    if (!prefetch_ready)
+        return false;
+
+    for (i = 0; i < prefetched_count; i++) {
+        table = prefetched[i];
+        for (j = 0; j < table->count; j++) {
+            if (table->reqs[j].rule == rule && !strcmp(table->reqs[j].name, symbol_name)) {
+                *addr = table->reqs[j].addr;
+                return true;
+            }
+        }
+    }
+    // the consumer lookup no longer matches its table entry
+    pr_warn("symbol_resolver: %s is in no symbol table, looking it up alone\n", symbol_name);
+    return false;
+}
+
+static unsigned long __nocfi lookup_symbol_exact(const char *symbol_name)
 {
     unsigned long addr = 0;
+
 #if HAVE_ON_EACH_MATCH_SYMBOL
     if (likely(kallsyms_on_each_match_symbol_fn)) {
         kallsyms_on_each_match_symbol_fn(find_kernel_symbol_exact_cb, symbol_name, &addr);
@@ -76,6 +108,15 @@ unsigned long __nocfi find_kernel_symbol_exact(const char *symbol_name)
     return addr;
 }
 
+unsigned long find_kernel_symbol_exact(const char *symbol_name)
+{
+    unsigned long addr;
+
+    if (lookup_prefetched(symbol_name, KSU_SYMBOL_EXACT, &addr))
+        return addr;
+    return lookup_symbol_exact(symbol_name);
+}
+
 static inline bool ksu_symbol_has_suffix(const char *name, size_t name_len, const char *suffix, size_t suffix_len)
 {
     return name_len >= suffix_len && strcmp(name + name_len - suffix_len, suffix) == 0;
@@ -138,23 +179,20 @@ static __nocfi void *resolve_symbol_variant(const char *symbol_name, size_t symb
     return ctx.match;
 }
 
-void *ksu_resolve_symbol_for_functable_hook(const char *symbol_name)
+static void *resolve_symbol_for_functable_hook(const char *symbol_name)
 {
     void *addr;
     size_t symbol_len;
 
-    if (!symbol_name || !symbol_name[0])
-        return NULL;
-
     symbol_len = strlen(symbol_name);
 
-    // Prefer find_kernel_symbol_exact since it uses binary search in higher kernel version
+    // Prefer lookup_symbol_exact since it uses binary search in higher kernel version
 
 #if !USE_KCFI
     // Try .cfi_jt suffix first
     char cfi_name[KSYM_NAME_LEN];
     snprintf(cfi_name, sizeof(cfi_name), "%s.cfi_jt", symbol_name);
-    addr = (void *)find_kernel_symbol_exact(cfi_name);
+    addr = (void *)lookup_symbol_exact(cfi_name);
     if (addr)
         return addr;
 
@@ -162,9 +200,9 @@ void *ksu_resolve_symbol_for_functable_hook(const char *symbol_name)
     if (addr)
         return addr;
 
-    return (void *)find_kernel_symbol_exact(symbol_name);
+    return (void *)lookup_symbol_exact(symbol_name);
 #else
-    addr = (void *)find_kernel_symbol_exact(symbol_name);
+    addr = (void *)lookup_symbol_exact(symbol_name);
     if (addr)
         return addr;
 
@@ -172,8 +210,198 @@ void *ksu_resolve_symbol_for_functable_hook(const char *symbol_name)
 #endif
 }
 
-void __init ksu_init_symbol_resolver()
+void *ksu_resolve_symbol_for_functable_hook(const char *symbol_name)
+{
+    unsigned long addr;
+
+    if (!symbol_name || !symbol_name[0])
+        return NULL;
+
+    if (lookup_prefetched(symbol_name, KSU_SYMBOL_FUNCTABLE, &addr))
+        return (void *)addr;
+    return resolve_symbol_for_functable_hook(symbol_name);
+}
+
+#define BATCH_HASH_BITS 5
+
+// Per request candidates collected during the pass
+struct batch_entry {
+    struct hlist_node node;
+    struct ksu_symbol_request *req;
+    unsigned int hash;
+    size_t len;
+    bool batched;
+    // an exact name matched more than once; the single lookups decide which one wins
+    bool ambiguous;
+    unsigned long exact;
+    unsigned long first_variant;
+    unsigned long cfi_exact;
+    unsigned long cfi_variant;
+};
+
+struct symbol_batch {
+    struct hlist_head heads[1 << BATCH_HASH_BITS];
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static int batch_symbol_cb(void *data, const char *name, unsigned long addr)
+#else
+static int batch_symbol_cb(void *data, const char *name, struct module *mod, unsigned long addr)
+#endif
 {
+    struct symbol_batch *batch = data;
+    struct batch_entry *e;
+    unsigned int hash;
+    size_t base_len;
+    bool in_kernel = true;
+
+    if (!name || !addr)
+        return 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
+    in_kernel = !mod;
+#endif
+
+    // variants are the name followed by '.' or '$', so they share the prefix
+    base_len = strcspn(name, ".$");
+    hash = full_name_hash(NULL, name, base_len);
+    hlist_for_each_entry (e, &batch->heads[hash_32(hash, BATCH_HASH_BITS)], node) {
+        if (e->hash != hash || e->len != base_len || strncmp(name, e->req->name, base_len))
+            continue;
+
+        if (!name[base_len] && in_kernel) {
+            if (e->exact)
+                e->ambiguous = true;
+            else
+                e->exact = addr;
+        }
+        if (e->req->rule != KSU_SYMBOL_FUNCTABLE)
+            continue;
+
+        if (!e->first_variant)
+            e->first_variant = addr;
+#if !USE_KCFI
+        if (ksu_symbol_has_suffix(name, strlen(name), cfi_suffix, cfi_suffix_len)) {
+            if (!strcmp(name + base_len, cfi_suffix)) {
+                if (in_kernel && e->cfi_exact)
+                    e->ambiguous = true;
+                else if (in_kernel)
+                    e->cfi_exact = addr;
+            } else if (!e->cfi_variant) {
+                e->cfi_variant = addr;
+            }
+        }
+#endif
+    }
+    return 0;
+}
+
+// Same preference order as the single symbol lookups
+static unsigned long batch_result(struct batch_entry *e)
+{
+    if (e->req->rule == KSU_SYMBOL_EXACT)
+        return e->exact;
+#if !USE_KCFI
+    if (e->cfi_exact)
+        return e->cfi_exact;
+    if (e->cfi_variant)
+        return e->cfi_variant;
+    return e->first_variant ?: e->exact;
+#else
+    return e->exact ?: e->first_variant;
+#endif
+}
+
+static unsigned long resolve_one(struct ksu_symbol_request *req)
+{
+    if (req->rule == KSU_SYMBOL_FUNCTABLE)
+        return (unsigned long)resolve_symbol_for_functable_hook(req->name);
+    return lookup_symbol_exact(req->name);
+}
+
+static int __nocfi resolve_symbol_tables(struct ksu_symbol_table *const *tables, size_t table_count)
+{
+    struct symbol_batch *batch;
+    struct batch_entry *entries;
+    struct ksu_symbol_request *req;
+    size_t count = 0;
+    int resolved = 0;
+    size_t i, j, n;
+
+    for (i = 0; i < table_count; i++)
+        count += tables[i]->count;
+
+#if !ALWAYS_HAVE_ON_EACH_SYMBOL
+    if (!kallsyms_on_each_symbol_fn)
+        goto one_by_one;
+#endif
+
+    batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+    entries = kcalloc(count, sizeof(*entries), GFP_KERNEL);
+    if (!batch || !entries) {
+        kfree(batch);
+        kfree(entries);
+        goto one_by_one;
+    }
+
+    for (i = 0, n = 0; i < table_count; i++) {
+        for (j = 0; j < tables[i]->count; j++, n++) {
+            struct batch_entry *e = &entries[n];
+
+            req = &tables[i]->reqs[j];
+            e->req = req;
+            e->len = strlen(req->name);
+            // a name with a variant separator of its own cannot share the pass
+            if (e->len != strcspn(req->name, ".$"))
+                continue;
+            e->hash = full_name_hash(NULL, req->name, e->len);
+            e->batched = true;
+            hlist_add_head(&e->node, &batch->heads[hash_32(e->hash, BATCH_HASH_BITS)]);
+        }
+    }
+
+#if !ALWAYS_HAVE_ON_EACH_SYMBOL
+    kallsyms_on_each_symbol_fn(batch_symbol_cb, batch);
+#else
+    kallsyms_on_each_symbol(batch_symbol_cb, batch);
+#endif
+
+    for (n = 0; n < count; n++) {
+        struct batch_entry *e = &entries[n];
+
+        req = e->req;
+        req->addr = e->batched && !e->ambiguous ? batch_result(e) : resolve_one(req);
+        if (req->addr)
+            resolved++;
+    }
+    kfree(entries);
+    kfree(batch);
+    return resolved;
+
+one_by_one:
+    for (i = 0; i < table_count; i++) {
+        for (j = 0; j < tables[i]->count; j++) {
+            req = &tables[i]->reqs[j];
+            req->addr = resolve_one(req);
+            if (req->addr)
+                resolved++;
+        }
+    }
+    return resolved;
+}
+
+int ksu_resolve_symbols(struct ksu_symbol_request *reqs, size_t count)
+{
+    struct ksu_symbol_table table = { .reqs = reqs, .count = count };
+    struct ksu_symbol_table *tables[] = { &table };
+
+    return resolve_symbol_tables(tables, 1);
+}
+
+void __init ksu_init_symbol_resolver(struct ksu_symbol_table *const *tables, size_t count)
+{
+    size_t total = 0;
+    size_t i;
+
 #if !ALWAYS_HAVE_ON_EACH_SYMBOL
     kallsyms_on_each_symbol_fn = find_kernel_symbol_exact("kallsyms_on_each_symbol");
     if (!kallsyms_on_each_symbol_fn) {
@@ -186,4 +414,12 @@ void __init ksu_init_symbol_resolver()
         pr_warn("kallsyms_on_each_match_symbol not found!\n");
     }
 #endif
+
+    for (i = 0; i < count; i++)
+        total += tables[i]->count;
+    int resolved = resolve_symbol_tables(tables, count);
+    prefetched = tables;
+    prefetched_count = count;
+    prefetch_ready = true;
+    pr_info("symbol_resolver: prefetched %d of %zu symbols\n", resolved, total);
 }
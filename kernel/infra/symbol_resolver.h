@@ -1,8 +1,35 @@
 #ifndef __KSU_SYMBOL_RESOLVER_H
 #define __KSU_SYMBOL_RESOLVER_H
 
+#include <linux/kernel.h>
+#include <linux/types.h>
+
+enum ksu_symbol_rule {
+    KSU_SYMBOL_EXACT, // as find_kernel_symbol_exact()
+    KSU_SYMBOL_FUNCTABLE, // as ksu_resolve_symbol_for_functable_hook()
+};
+
+struct ksu_symbol_request {
+    const char *name;
+    enum ksu_symbol_rule rule;
+    unsigned long addr; // 0 if not found
+};
+
+// Symbols a module looks up during init, defined next to the module and
+// passed to ksu_init_symbol_resolver() so they are all resolved in one pass
+struct ksu_symbol_table {
+    struct ksu_symbol_request *reqs;
+    size_t count;
+};
+
+#define KSU_SYMBOL_TABLE(requests) { .reqs = (requests), .count = ARRAY_SIZE(requests) }
+
 void *ksu_resolve_symbol_for_functable_hook(const char *symbol_name);
 unsigned long find_kernel_symbol_exact(const char *symbol_name);
-void ksu_init_symbol_resolver();
+// Resolve @tables together, later lookups of their names use the results
+void ksu_init_symbol_resolver(struct ksu_symbol_table *const *tables, size_t count);
+
+// Resolve all of @reqs in a single kallsyms pass, returns how many were found
+int ksu_resolve_symbols(struct ksu_symbol_request *reqs, size_t count);
 
 #endif
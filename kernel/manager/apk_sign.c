@@ -3,6 +3,7 @@
 #include <linux/gfp.h>
 #include <linux/kernel.h>
 #include <linux/limits.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/version.h>
 #ifdef CONFIG_KSU_DEBUG
@@ -19,99 +20,103 @@
 #endif
 
 #include "manager/apk_sign.h"
+#include "manager/apk_verdict.h"
 #include "uapi/app_profile.h"
 #include "klog.h" // IWYU pragma: keep
 
-struct sdesc {
-    struct shash_desc shash;
-    char ctx[];
-};
+// APK Signing Block: size, pairs, size, magic. A real one is a few pages.
+#define SIGNING_BLOCK_MAX (16 << 20)
+#define SIGNING_BLOCK_FOOTER 0x18
+#define EOCD_SIZE 22
+#define ZIP64_LOCATOR_SIZE 20
+// the EOCD, a comment of at most 0xffff bytes and a ZIP64 locator before it
+#define TAIL_MAX (ZIP64_LOCATOR_SIZE + EOCD_SIZE + 0xffff)
 
-static struct sdesc *init_sdesc(struct crypto_shash *alg)
-{
-    struct sdesc *sdesc;
-    int size;
-
-    size = sizeof(struct shash_desc) + crypto_shash_descsize(alg);
-    sdesc = kzalloc(size, GFP_KERNEL);
-    if (!sdesc)
-        return ERR_PTR(-ENOMEM);
-    sdesc->shash.tfm = alg;
-    return sdesc;
-}
+// shash transforms are reentrant, all state lives in the descriptor
+static struct crypto_shash *sha256_tfm;
 
-static int calc_hash(struct crypto_shash *alg, const unsigned char *data, unsigned int datalen, unsigned char *digest)
+static struct crypto_shash *get_sha256(void)
 {
-    struct sdesc *sdesc;
-    int ret;
+    struct crypto_shash *alg = READ_ONCE(sha256_tfm);
 
-    sdesc = init_sdesc(alg);
-    if (IS_ERR(sdesc)) {
-        pr_info("can't alloc sdesc\n");
-        return PTR_ERR(sdesc);
-    }
+    if (alg)
+        return alg;
 
-    ret = crypto_shash_digest(&sdesc->shash, data, datalen, digest);
-    kfree(sdesc);
-    return ret;
+    alg = crypto_alloc_shash("sha256", 0, 0);
+    if (IS_ERR(alg)) {
+        pr_info("can't alloc alg sha256\n");
+        return alg;
+    }
+    if (cmpxchg(&sha256_tfm, NULL, alg)) {
+        crypto_free_shash(alg);
+        alg = sha256_tfm;
+    }
+    return alg;
 }
 
 static int ksu_sha256(const unsigned char *data, unsigned int datalen, unsigned char *digest)
 {
-    struct crypto_shash *alg;
-    char *hash_alg_name = "sha256";
+    struct crypto_shash *alg = get_sha256();
     int ret;
 
-    alg = crypto_alloc_shash(hash_alg_name, 0, 0);
-    if (IS_ERR(alg)) {
-        pr_info("can't alloc alg %s\n", hash_alg_name);
+    if (IS_ERR(alg))
         return PTR_ERR(alg);
-    }
-    ret = calc_hash(alg, data, datalen, digest);
-    crypto_free_shash(alg);
+
+    SHASH_DESC_ON_STACK(desc, alg);
+    desc->tfm = alg;
+    ret = crypto_shash_digest(desc, data, datalen, digest);
+    shash_desc_zero(desc);
     return ret;
 }
 
-static bool read_exact(struct file *fp, void *buffer, size_t size, loff_t *pos, loff_t end)
+static bool read_region(struct file *fp, void *buffer, size_t size, loff_t pos)
+{
+    return kernel_read(fp, buffer, size, &pos) == (ssize_t)size;
+}
+
+// Parsing below works on regions read in one go, offsets are into @buf
+static bool take(const u8 *buf, size_t *pos, size_t end, void *out, size_t size)
 {
-    if (*pos < 0 || *pos > end || size > (size_t)(end - *pos))
+    if (*pos > end || size > end - *pos)
         return false;
 
-    return kernel_read(fp, buffer, size, pos) == (ssize_t)size;
+    memcpy(out, buf + *pos, size);
+    *pos += size;
+    return true;
 }
 
-static bool read_length_prefixed_end(struct file *fp, loff_t *pos, loff_t container_end, loff_t *value_end)
+static bool take_length_prefixed_end(const u8 *buf, size_t *pos, size_t container_end, size_t *value_end)
 {
     u32 length;
 
-    if (!read_exact(fp, &length, sizeof(length), pos, container_end))
+    if (!take(buf, pos, container_end, &length, sizeof(length)))
         return false;
-    if (length > INT_MAX || length > (u64)(container_end - *pos))
+    if (length > INT_MAX || length > container_end - *pos)
         return false;
 
     *value_end = *pos + length;
     return true;
 }
 
-static bool check_block(struct file *fp, loff_t *pos, loff_t block_end, unsigned expected_size,
+static bool check_block(const u8 *buf, size_t *pos, size_t block_end, unsigned expected_size,
                         const char *expected_sha256)
 {
-    loff_t signers_end, signer_end, signed_data_end, digests_end, certificates_end;
+    size_t signers_end, signer_end, signed_data_end, digests_end, certificates_end;
     u32 certificate_size;
 
     // v2 block: signers sequence -> first signer -> signed data -> digests
-    if (!read_length_prefixed_end(fp, pos, block_end, &signers_end) ||
-        !read_length_prefixed_end(fp, pos, signers_end, &signer_end) ||
-        !read_length_prefixed_end(fp, pos, signer_end, &signed_data_end) ||
-        !read_length_prefixed_end(fp, pos, signed_data_end, &digests_end))
+    if (!take_length_prefixed_end(buf, pos, block_end, &signers_end) ||
+        !take_length_prefixed_end(buf, pos, signers_end, &signer_end) ||
+        !take_length_prefixed_end(buf, pos, signer_end, &signed_data_end) ||
+        !take_length_prefixed_end(buf, pos, signed_data_end, &digests_end))
         return false;
 
     *pos = digests_end;
-    if (!read_length_prefixed_end(fp, pos, signed_data_end, &certificates_end) ||
-        !read_exact(fp, &certificate_size, sizeof(certificate_size), pos, certificates_end))
+    if (!take_length_prefixed_end(buf, pos, signed_data_end, &certificates_end) ||
+        !take(buf, pos, certificates_end, &certificate_size, sizeof(certificate_size)))
         return false;
 
-    if (certificate_size > INT_MAX || certificate_size > (u64)(certificates_end - *pos))
+    if (certificate_size > INT_MAX || certificate_size > certificates_end - *pos)
         return false;
 
 #define CERT_MAX_LENGTH 1024
@@ -123,15 +128,12 @@ static bool check_block(struct file *fp, loff_t *pos, loff_t block_end, unsigned
         return false;
     }
 
-    char cert[CERT_MAX_LENGTH];
-    if (!read_exact(fp, cert, certificate_size, pos, certificates_end))
-        return false;
-
     unsigned char digest[SHA256_DIGEST_SIZE];
-    if (ksu_sha256(cert, certificate_size, digest)) {
+    if (ksu_sha256(buf + *pos, certificate_size, digest)) {
         pr_info("sha256 error\n");
         return false;
     }
+    *pos += certificate_size;
 
     char hash_str[SHA256_DIGEST_SIZE * 2 + 1];
     hash_str[SHA256_DIGEST_SIZE * 2] = '\0';
@@ -141,14 +143,16 @@ static bool check_block(struct file *fp, loff_t *pos, loff_t block_end, unsigned
     return strcmp(expected_sha256, hash_str) == 0;
 }
 
-static __always_inline bool check_v2_signature(char *path, unsigned expected_size, const char *expected_sha256)
+static __always_inline bool check_v2_signature(struct file *fp, unsigned expected_size, const char *expected_sha256)
 {
-    unsigned char buffer[0x10] = { 0 };
+    unsigned char footer[SIGNING_BLOCK_FOOTER];
     u32 cd_offset, cd_size;
     u32 zip64_locator_magic;
     u64 size_of_block, size_of_block_at_head;
 
-    loff_t pos, pairs_end, file_size, eocd_offset;
+    loff_t file_size, tail_offset, eocd_offset;
+    size_t tail_len, eocd, pos, pairs_end;
+    u8 *tail = NULL, *block = NULL;
 
     bool v2_signing_valid = false;
     int v2_signing_blocks = 0;
@@ -156,32 +160,34 @@ static __always_inline bool check_v2_signature(char *path, unsigned expected_siz
     bool v3_1_signing_exist = false;
 
     int i;
-    struct file *fp = filp_open(path, O_RDONLY, 0);
-    if (IS_ERR(fp)) {
-        pr_err("open %s error.\n", path);
-        return false;
-    }
-
-    // disable inotify for this file
-    fp->f_mode |= FMODE_NONOTIFY;
 
     file_size = generic_file_llseek(fp, 0, SEEK_END);
     if (file_size < 0)
         goto clean;
 
+    // every EOCD candidate and the ZIP64 locator come from one read of the tail
+    tail_len = min_t(loff_t, file_size, TAIL_MAX);
+    tail_offset = file_size - tail_len;
+    tail = kvmalloc(tail_len ?: 1, GFP_KERNEL);
+    if (!tail || !read_region(fp, tail, tail_len, tail_offset))
+        goto clean;
+
     // https://en.wikipedia.org/wiki/Zip_(file_format)#End_of_central_directory_record_(EOCD)
     for (i = 0;; ++i) {
         unsigned short comment_size;
         u32 magic;
-        pos = file_size - i - 2;
-        if (!read_exact(fp, &comment_size, sizeof(comment_size), &pos, file_size))
+
+        if (tail_len < (size_t)i + 2)
             goto clean;
+        pos = tail_len - i - 2;
+        memcpy(&comment_size, tail + pos, sizeof(comment_size));
         if (comment_size == i) {
-            pos -= 22;
-            if (!read_exact(fp, &magic, sizeof(magic), &pos, file_size))
+            if (tail_len < (size_t)i + EOCD_SIZE)
                 goto clean;
+            eocd = tail_len - i - EOCD_SIZE;
+            memcpy(&magic, tail + eocd, sizeof(magic));
             if (magic == 0x06054b50) {
-                eocd_offset = pos - sizeof(magic);
+                eocd_offset = tail_offset + eocd;
                 break;
             }
         }
@@ -192,65 +198,65 @@ static __always_inline bool check_v2_signature(char *path, unsigned expected_siz
     }
 
     // reject ZIP64 before looking for a signing block
-    if (eocd_offset >= 20) {
-        pos = eocd_offset - 20;
-        if (!read_exact(fp, &zip64_locator_magic, sizeof(zip64_locator_magic), &pos, file_size))
-            goto clean;
+    if (eocd_offset >= ZIP64_LOCATOR_SIZE) {
+        memcpy(&zip64_locator_magic, tail + eocd - ZIP64_LOCATOR_SIZE, sizeof(zip64_locator_magic));
         if (zip64_locator_magic == 0x07064b50)
             goto clean;
     }
 
-    pos = eocd_offset + 12;
-    // size of central directory
-    if (!read_exact(fp, &cd_size, sizeof(cd_size), &pos, file_size))
-        goto clean;
-    // offset of central directory
-    if (!read_exact(fp, &cd_offset, sizeof(cd_offset), &pos, file_size))
-        goto clean;
+    // size and offset of central directory
+    memcpy(&cd_size, tail + eocd + 12, sizeof(cd_size));
+    memcpy(&cd_offset, tail + eocd + 16, sizeof(cd_offset));
     if ((u64)cd_offset > (u64)eocd_offset || (u64)cd_size != (u64)eocd_offset - cd_offset)
         goto clean;
-    if (cd_offset < 0x20)
+    if (cd_offset < SIGNING_BLOCK_FOOTER + 0x8)
         goto clean;
 
-    pairs_end = (loff_t)cd_offset - 0x18;
-    pos = pairs_end;
-
-    if (!read_exact(fp, &size_of_block, sizeof(size_of_block), &pos, cd_offset))
-        goto clean;
-    if (!read_exact(fp, buffer, sizeof(buffer), &pos, cd_offset))
+    if (!read_region(fp, footer, sizeof(footer), (loff_t)cd_offset - SIGNING_BLOCK_FOOTER))
         goto clean;
-    if (memcmp((char *)buffer, "APK Sig Block 42", sizeof(buffer)))
+    memcpy(&size_of_block, footer, sizeof(size_of_block));
+    if (memcmp(footer + sizeof(size_of_block), "APK Sig Block 42", 16))
         goto clean;
 
-    if (size_of_block < 0x18 || size_of_block > INT_MAX - 0x8 || size_of_block > (u64)cd_offset - 0x8)
+    if (size_of_block < SIGNING_BLOCK_FOOTER || size_of_block > INT_MAX - 0x8 ||
+        size_of_block > (u64)cd_offset - 0x8)
+        goto clean;
+    if (size_of_block > SIGNING_BLOCK_MAX - 0x8) {
+        pr_info("signing block too large: %llu\n", size_of_block);
         goto clean;
+    }
 
-    pos = (loff_t)cd_offset - (loff_t)size_of_block - 0x8;
-    if (!read_exact(fp, &size_of_block_at_head, sizeof(size_of_block_at_head), &pos, pairs_end))
+    // the whole block, both sizes included, in one read
+    block = kvmalloc(size_of_block + 0x8, GFP_KERNEL);
+    if (!block || !read_region(fp, block, size_of_block + 0x8, (loff_t)cd_offset - (loff_t)size_of_block - 0x8))
         goto clean;
+    memcpy(&size_of_block_at_head, block, sizeof(size_of_block_at_head));
     if (size_of_block_at_head != size_of_block)
         goto clean;
 
+    pos = sizeof(size_of_block_at_head);
+    pairs_end = size_of_block + 0x8 - SIGNING_BLOCK_FOOTER;
+
     // Scan every length-prefixed pair, matching AOSP's signing block parser
     // Each valid pair consumes an 8-byte length plus at least a 4-byte ID, so
     // malformed entries fail below instead of spinning in place.
     while (pos < pairs_end) {
         uint32_t id;
         u64 size_of_pair;
-        loff_t pair_end;
+        size_t pair_end;
 
-        if (!read_exact(fp, &size_of_pair, sizeof(size_of_pair), &pos, pairs_end))
+        if (!take(block, &pos, pairs_end, &size_of_pair, sizeof(size_of_pair)))
             goto invalid;
         if (size_of_pair < sizeof(id) || size_of_pair > INT_MAX || size_of_pair > (u64)(pairs_end - pos))
             goto invalid;
 
-        pair_end = pos + (loff_t)size_of_pair;
-        if (!read_exact(fp, &id, sizeof(id), &pos, pair_end))
+        pair_end = pos + (size_t)size_of_pair;
+        if (!take(block, &pos, pair_end, &id, sizeof(id)))
             goto invalid;
 
         if (id == 0x7109871au) {
             v2_signing_blocks++;
-            v2_signing_valid = check_block(fp, &pos, pair_end, expected_size, expected_sha256);
+            v2_signing_valid = check_block(block, &pos, pair_end, expected_size, expected_sha256);
         } else if (id == 0xf05368c0u) {
             // http://aospxref.com/android-14.0.0_r2/xref/frameworks/base/core/java/android/util/apk/ApkSignatureSchemeV3Verifier.java#73
             v3_signing_exist = true;
@@ -277,7 +283,8 @@ static __always_inline bool check_v2_signature(char *path, unsigned expected_siz
 invalid:
     v2_signing_valid = false;
 clean:
-    filp_close(fp, 0);
+    kvfree(block);
+    kvfree(tail);
 
     if (v2_signing_valid && (v3_signing_exist || v3_1_signing_exist)) {
         pr_err("Unexpected v3 signature scheme found!\n");
@@ -363,12 +370,43 @@ bool is_manager_apk(char *path)
         return false;
     }
 #endif
-    if (check_v2_signature(path, EXPECTED_SIZE, EXPECTED_HASH)) {
-        return true;
+    struct apk_verdict_key key, key_after;
+    bool verdict;
+
+    // the key and the signature come from the same open file, so the path
+    // can't be swapped to another inode in between
+    struct file *fp = filp_open(path, O_RDONLY, 0);
+    if (IS_ERR(fp)) {
+        pr_err("open %s error.\n", path);
+        return false;
     }
+
+    // disable inotify for this file
+    fp->f_mode |= FMODE_NONOTIFY;
+
+    ksu_apk_verdict_key(file_inode(fp), &key);
+    if (ksu_apk_verdict_get(&key, &verdict))
+        goto out;
+
+    verdict = check_v2_signature(fp, EXPECTED_SIZE, EXPECTED_HASH);
 #ifdef EXPECTED_SIZE2
-    return check_v2_signature(path, EXPECTED_SIZE2, EXPECTED_HASH2);
-#else
-    return false;
+    if (!verdict)
+        verdict = check_v2_signature(fp, EXPECTED_SIZE2, EXPECTED_HASH2);
 #endif
+    // a file written while it was verified is not remembered
+    ksu_apk_verdict_key(file_inode(fp), &key_after);
+    if (!memcmp(&key, &key_after, sizeof(key)))
+        ksu_apk_verdict_put(&key, verdict);
+
+out:
+    filp_close(fp, 0);
+    return verdict;
+}
+
+void ksu_apk_sign_exit(void)
+{
+    if (sha256_tfm) {
+        crypto_free_shash(sha256_tfm);
+        sha256_tfm = NULL;
+    }
 }
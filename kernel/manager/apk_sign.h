@@ -6,4 +6,6 @@
 bool is_manager_apk(char *path);
 int get_pkg_from_apk_path(char *pkg, const char *path);
 
+void ksu_apk_sign_exit(void);
+
 #endif
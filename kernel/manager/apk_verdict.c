@@ -0,0 +1,364 @@
+#include <linux/atomic.h>
+#include <linux/cred.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/mount.h>
+#include <linux/mutex.h>
+#include <linux/namei.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/version.h>
+
+#include "klog.h" // IWYU pragma: keep
+#include "ksu.h"
+#include "manager/apk_verdict.h"
+
+#define KERNEL_SU_WORK_DIR "/data/adb/ksu"
+#define VERDICT_FILE_NAME ".apk_verdicts"
+#define VERDICT_TMP_NAME ".apk_verdicts.tmp"
+#define KERNEL_SU_APK_VERDICTS KERNEL_SU_WORK_DIR "/" VERDICT_FILE_NAME
+#define KERNEL_SU_APK_VERDICTS_TMP KERNEL_SU_WORK_DIR "/" VERDICT_TMP_NAME
+#define VERDICT_FILE_MAGIC 0x7f4b5356
+#define VERDICT_FILE_VERSION 1
+#define VERDICT_HASH_BITS 6
+// least recently used verdicts beyond this are dropped
+#define VERDICT_MAX 256
+
+struct verdict_file_header {
+    u32 magic;
+    u32 version;
+    u32 fingerprint;
+    u32 count;
+};
+
+struct verdict_record {
+    struct apk_verdict_key key;
+    u32 verdict;
+    u32 __pad;
+};
+
+struct verdict_entry {
+    struct hlist_node node;
+    struct verdict_record record;
+    u64 last_used;
+};
+
+static DEFINE_HASHTABLE(verdicts, VERDICT_HASH_BITS);
+static DEFINE_MUTEX(verdict_lock);
+static u32 verdict_count;
+static u64 verdict_clock;
+static bool loaded;
+static bool dirty;
+static atomic_t hits = ATOMIC_INIT(0);
+static atomic_t misses = ATOMIC_INIT(0);
+
+// Verdicts are only valid for the signatures this kernel was built to accept
+static u32 fingerprint(void)
+{
+    u32 hash = jhash(EXPECTED_HASH, sizeof(EXPECTED_HASH), EXPECTED_SIZE);
+
+#ifdef EXPECTED_SIZE2
+    hash = jhash(EXPECTED_HASH2, sizeof(EXPECTED_HASH2), hash ^ EXPECTED_SIZE2);
+#endif
+    return hash;
+}
+
+static u32 key_hash(const struct apk_verdict_key *key)
+{
+    return jhash2((const u32 *)key, sizeof(*key) / sizeof(u32), 0);
+}
+
+static struct verdict_entry *find_entry(const struct apk_verdict_key *key)
+{
+    struct verdict_entry *e;
+
+    hash_for_each_possible (verdicts, e, node, key_hash(key)) {
+        if (!memcmp(&e->record.key, key, sizeof(*key)))
+            return e;
+    }
+    return NULL;
+}
+
+static void evict_oldest(void)
+{
+    struct verdict_entry *e, *oldest = NULL;
+    int bkt;
+
+    hash_for_each (verdicts, bkt, e, node) {
+        if (!oldest || e->last_used < oldest->last_used)
+            oldest = e;
+    }
+    if (!oldest)
+        return;
+    hash_del(&oldest->node);
+    kfree(oldest);
+    verdict_count--;
+}
+
+static void insert_record(const struct verdict_record *record)
+{
+    struct verdict_entry *e = find_entry(&record->key);
+
+    if (!e) {
+        if (verdict_count >= VERDICT_MAX)
+            evict_oldest();
+        e = kzalloc(sizeof(*e), GFP_KERNEL);
+        if (!e)
+            return;
+        hash_add(verdicts, &e->node, key_hash(&record->key));
+        verdict_count++;
+    }
+    e->record = *record;
+    e->last_used = ++verdict_clock;
+}
+
+static void load_verdicts(void)
+{
+    struct verdict_file_header header;
+    struct verdict_record record;
+    loff_t off = 0;
+    u32 i;
+
+    loaded = true;
+
+    struct file *fp = filp_open(KERNEL_SU_APK_VERDICTS, O_RDONLY, 0);
+    if (IS_ERR(fp)) {
+        pr_info("apk verdicts: none saved: %ld\n", PTR_ERR(fp));
+        return;
+    }
+
+    if (kernel_read(fp, &header, sizeof(header), &off) != sizeof(header) || header.magic != VERDICT_FILE_MAGIC ||
+        header.version != VERDICT_FILE_VERSION) {
+        pr_warn("apk verdicts: invalid file, ignored\n");
+        goto close_file;
+    }
+    if (header.fingerprint != fingerprint()) {
+        pr_info("apk verdicts: saved for another signature, ignored\n");
+        dirty = true;
+        goto close_file;
+    }
+
+    for (i = 0; i < header.count && i < VERDICT_MAX; i++) {
+        if (kernel_read(fp, &record, sizeof(record), &off) != sizeof(record))
+            break;
+        insert_record(&record);
+    }
+    pr_info("apk verdicts: loaded %u\n", verdict_count);
+
+close_file:
+    filp_close(fp, 0);
+}
+
+// Caller holds the directory lock
+static struct dentry *lookup_in_dir(struct dentry *dir, const char *name)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+    struct qstr qname = QSTR_INIT(name, strlen(name));
+
+    return lookup_noperm(&qname, dir);
+#else
+    return lookup_one_len(name, dir, strlen(name));
+#endif
+}
+
+// Atomically replace the verdict file with the fully written temp file
+static int publish_verdict_file(void)
+{
+    struct dentry *old_dentry, *new_dentry;
+    struct inode *dir_inode;
+    struct path dir;
+    int ret;
+
+    ret = kern_path(KERNEL_SU_WORK_DIR, LOOKUP_DIRECTORY, &dir);
+    if (ret)
+        return ret;
+    ret = mnt_want_write(dir.mnt);
+    if (ret)
+        goto put_dir;
+
+    dir_inode = d_inode(dir.dentry);
+    // both names live in one directory, which is what lock_rename() takes then
+    inode_lock_nested(dir_inode, I_MUTEX_PARENT);
+    old_dentry = lookup_in_dir(dir.dentry, VERDICT_TMP_NAME);
+    if (IS_ERR(old_dentry)) {
+        ret = PTR_ERR(old_dentry);
+        goto unlock;
+    }
+    new_dentry = lookup_in_dir(dir.dentry, VERDICT_FILE_NAME);
+    if (IS_ERR(new_dentry)) {
+        ret = PTR_ERR(new_dentry);
+        goto put_old;
+    }
+    if (d_is_negative(old_dentry)) {
+        ret = -ENOENT;
+        goto put_new;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+    struct renamedata rd = {
+        .mnt_idmap = mnt_idmap(dir.mnt),
+        .old_parent = dir.dentry,
+        .old_dentry = old_dentry,
+        .new_parent = dir.dentry,
+        .new_dentry = new_dentry,
+    };
+    ret = vfs_rename(&rd);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    struct renamedata rd = {
+        .old_mnt_idmap = mnt_idmap(dir.mnt),
+        .old_dir = dir_inode,
+        .old_dentry = old_dentry,
+        .new_mnt_idmap = mnt_idmap(dir.mnt),
+        .new_dir = dir_inode,
+        .new_dentry = new_dentry,
+    };
+    ret = vfs_rename(&rd);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+    struct renamedata rd = {
+        .old_mnt_userns = mnt_user_ns(dir.mnt),
+        .old_dir = dir_inode,
+        .old_dentry = old_dentry,
+        .new_mnt_userns = mnt_user_ns(dir.mnt),
+        .new_dir = dir_inode,
+        .new_dentry = new_dentry,
+    };
+    ret = vfs_rename(&rd);
+#else
+    ret = vfs_rename(dir_inode, old_dentry, dir_inode, new_dentry, NULL, 0);
+#endif
+
+put_new:
+    dput(new_dentry);
+put_old:
+    dput(old_dentry);
+unlock:
+    inode_unlock(dir_inode);
+    mnt_drop_write(dir.mnt);
+put_dir:
+    path_put(&dir);
+    return ret;
+}
+
+static void save_verdicts(void)
+{
+    struct verdict_file_header header = {
+        .magic = VERDICT_FILE_MAGIC,
+        .version = VERDICT_FILE_VERSION,
+        .fingerprint = fingerprint(),
+        .count = verdict_count,
+    };
+    struct verdict_entry *e;
+    loff_t off = 0;
+    int bkt, ret;
+
+    // the ksu domain may write the working directory, the caller might not
+    if (!ksu_cred)
+        return;
+
+    // written aside and renamed over the old file, a torn write is never read back
+    const struct cred *saved = override_creds(ksu_cred);
+    struct file *fp = filp_open(KERNEL_SU_APK_VERDICTS_TMP, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (IS_ERR(fp)) {
+        pr_err("apk verdicts: create file failed: %ld\n", PTR_ERR(fp));
+        goto out;
+    }
+
+    if (kernel_write(fp, &header, sizeof(header), &off) != sizeof(header)) {
+        pr_err("apk verdicts: write header failed\n");
+        goto close_file;
+    }
+    hash_for_each (verdicts, bkt, e, node) {
+        if (kernel_write(fp, &e->record, sizeof(e->record), &off) != sizeof(e->record)) {
+            pr_err("apk verdicts: write record failed\n");
+            goto close_file;
+        }
+    }
+    if (vfs_fsync(fp, 0)) {
+        pr_err("apk verdicts: sync failed\n");
+        goto close_file;
+    }
+    filp_close(fp, 0);
+
+    ret = publish_verdict_file();
+    if (ret)
+        pr_err("apk verdicts: rename failed: %d\n", ret);
+    else
+        dirty = false;
+    goto out;
+
+close_file:
+    filp_close(fp, 0);
+out:
+    revert_creds(saved);
+}
+
+void ksu_apk_verdict_key(struct inode *inode, struct apk_verdict_key *key)
+{
+    memset(key, 0, sizeof(*key));
+    key->ino = inode->i_ino;
+    key->dev = inode->i_sb->s_dev;
+    key->generation = inode->i_generation;
+    key->size = i_size_read(inode);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    key->mtime_sec = inode_get_mtime_sec(inode);
+    key->mtime_nsec = inode_get_mtime_nsec(inode);
+#else
+    key->mtime_sec = inode->i_mtime.tv_sec;
+    key->mtime_nsec = inode->i_mtime.tv_nsec;
+#endif
+}
+
+bool ksu_apk_verdict_get(const struct apk_verdict_key *key, bool *verdict)
+{
+    struct verdict_entry *e;
+
+    mutex_lock(&verdict_lock);
+    if (!loaded)
+        load_verdicts();
+    e = find_entry(key);
+    if (e) {
+        e->last_used = ++verdict_clock;
+        *verdict = e->record.verdict;
+    }
+    mutex_unlock(&verdict_lock);
+
+    atomic_inc(e ? &hits : &misses);
+    return e != NULL;
+}
+
+void ksu_apk_verdict_put(const struct apk_verdict_key *key, bool verdict)
+{
+    struct verdict_record record = { .key = *key, .verdict = verdict };
+
+    mutex_lock(&verdict_lock);
+    insert_record(&record);
+    dirty = true;
+    mutex_unlock(&verdict_lock);
+}
+
+void ksu_apk_verdict_sync(void)
+{
+    mutex_lock(&verdict_lock);
+    if (dirty)
+        save_verdicts();
+    mutex_unlock(&verdict_lock);
+
+    pr_info("apk verdicts: %d hits, %d misses\n", atomic_read(&hits), atomic_read(&misses));
+}
+
+void ksu_apk_verdict_exit(void)
+{
+    struct verdict_entry *e;
+    struct hlist_node *tmp;
+    int bkt;
+
+    mutex_lock(&verdict_lock);
+    hash_for_each_safe (verdicts, bkt, tmp, e, node) {
+        hash_del(&e->node);
+        kfree(e);
+    }
+    verdict_count = 0;
+    mutex_unlock(&verdict_lock);
+}
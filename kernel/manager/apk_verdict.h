@@ -0,0 +1,31 @@
+#ifndef __KSU_H_APK_VERDICT
+#define __KSU_H_APK_VERDICT
+
+#include <linux/fs.h>
+#include <linux/types.h>
+
+// Identity of an APK file, equal keys mean unchanged content
+struct apk_verdict_key {
+    u64 ino;
+    s64 size;
+    s64 mtime_sec;
+    u32 mtime_nsec;
+    u32 dev;
+    u32 generation;
+    u32 __pad;
+};
+
+// Take the key from the inode of the file that is actually verified
+void ksu_apk_verdict_key(struct inode *inode, struct apk_verdict_key *key);
+
+// Signature verdicts of is_manager_apk(), loaded from the working directory
+// on first use. Returns false on a miss.
+bool ksu_apk_verdict_get(const struct apk_verdict_key *key, bool *verdict);
+void ksu_apk_verdict_put(const struct apk_verdict_key *key, bool verdict);
+
+// Persist the verdicts if they changed and log the hit and miss counters
+void ksu_apk_verdict_sync(void);
+
+void ksu_apk_verdict_exit(void);
+
+#endif
@@ -1,28 +1,132 @@
+#include <linux/atomic.h>
+#include <linux/bsearch.h>
+#include <linux/cred.h>
 #include <linux/err.h>
 #include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/string.h>
+#include <linux/stringhash.h>
 #include <linux/types.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 
 #include "policy/allowlist.h"
 #include "manager/apk_sign.h"
+#include "manager/apk_verdict.h"
 #include "klog.h" // IWYU pragma: keep
+#include "ksu.h"
 #include "manager/manager_identity.h"
 #include "manager/throne_tracker.h"
 
 uid_t ksu_manager_appid = KSU_INVALID_APPID;
 
 #define SYSTEM_PACKAGES_LIST_PATH "/data/system/packages.list"
+// packages.list is read in blocks of this size into a buffer kept across runs
+#define PACKAGES_LIST_CHUNK (16 * 1024)
+// packages.list events closer than this are handled by a single run
+#define TRACK_DEBOUNCE_MS 500
+#define APK_VERIFY_WORKERS 4
 
 struct uid_data {
-    struct list_head list;
+    struct hlist_node node;
     u32 uid;
+    u32 hash; // of the whole line, catches updates that keep the uid
     char package[KSU_MAX_PACKAGE_NAME];
 };
 
-static void crown_manager(const char *apk, struct list_head *uid_data)
+// One parse of packages.list, sorted by package and indexed by uid
+struct uid_snapshot {
+    struct uid_data *entries;
+    size_t count;
+    size_t cap;
+    struct hlist_head *index;
+    u32 index_bits;
+};
+
+struct snapshot_diff {
+    u32 added;
+    u32 removed;
+    u32 changed;
+};
+
+static DEFINE_MUTEX(throne_lock);
+// the previous parse, later parses are diffed against it
+static struct uid_snapshot last_snapshot;
+static bool has_snapshot;
+static char *read_buf;
+// package of the last crowned manager, verified first by the next search
+static char last_manager_pkg[KSU_MAX_PACKAGE_NAME];
+
+static struct workqueue_struct *throne_wq;
+// verifies manager candidates, at most APK_VERIFY_WORKERS at a time
+static struct workqueue_struct *apk_wq;
+static void track_throne_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(track_work, track_throne_fn);
+// bumped by every queued event, a run started before the latest bump is stale
+static atomic_t track_gen = ATOMIC_INIT(0);
+// generation of the running queued run, 0 for a synchronous one
+static int run_gen;
+
+static bool run_stale(void)
+{
+    return run_gen && atomic_read(&track_gen) != run_gen;
+}
+
+static void free_snapshot(struct uid_snapshot *snapshot)
+{
+    kvfree(snapshot->entries);
+    kvfree(snapshot->index);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+static int cmp_package(const void *a, const void *b)
+{
+    return strcmp(((const struct uid_data *)a)->package, ((const struct uid_data *)b)->package);
+}
+
+static int cmp_package_key(const void *key, const void *elt)
+{
+    return strcmp(key, ((const struct uid_data *)elt)->package);
+}
+
+static struct uid_data *find_package(struct uid_snapshot *snapshot, const char *package)
+{
+    return bsearch(package, snapshot->entries, snapshot->count, sizeof(*snapshot->entries), cmp_package_key);
+}
+
+// Index the entries by uid, once they no longer move
+static int index_snapshot(struct uid_snapshot *snapshot)
+{
+    u32 bits = ilog2(roundup_pow_of_two(max_t(size_t, snapshot->count, 16)));
+    size_t i;
+
+    snapshot->index = kvmalloc_array(1U << bits, sizeof(*snapshot->index), GFP_KERNEL);
+    if (!snapshot->index)
+        return -ENOMEM;
+    snapshot->index_bits = bits;
+    for (i = 0; i < (1U << bits); i++)
+        INIT_HLIST_HEAD(&snapshot->index[i]);
+    for (i = 0; i < snapshot->count; i++) {
+        struct uid_data *np = &snapshot->entries[i];
+
+        hlist_add_head(&np->node, &snapshot->index[hash_32(np->uid, bits)]);
+    }
+    return 0;
+}
+
+#define for_each_uid_data(snapshot, np, uid)                                                                           \
+    hlist_for_each_entry (np, &(snapshot)->index[hash_32(uid, (snapshot)->index_bits)], node)                          \
+        if (np->uid == (uid))
+
+static void crown_manager(const char *apk, struct uid_snapshot *snapshot)
 {
     char pkg[KSU_MAX_PACKAGE_NAME];
     if (get_pkg_from_apk_path(pkg, apk) < 0) {
@@ -31,16 +135,12 @@ static void crown_manager(const char *apk, struct list_head *uid_data)
     }
 
     pr_info("manager pkg: %s\n", pkg);
+    strscpy(last_manager_pkg, pkg, sizeof(last_manager_pkg));
 
-    struct list_head *list = (struct list_head *)uid_data;
-    struct uid_data *np;
-
-    list_for_each_entry (np, list, list) {
-        if (strncmp(np->package, pkg, KSU_MAX_PACKAGE_NAME) == 0) {
-            pr_info("Crowning manager: %s(uid=%d)\n", pkg, np->uid);
-            ksu_set_manager_appid(np->uid);
-            break;
-        }
+    struct uid_data *np = find_package(snapshot, pkg);
+    if (np) {
+        pr_info("Crowning manager: %s(uid=%d)\n", pkg, np->uid);
+        ksu_set_manager_appid(np->uid);
     }
 }
 
@@ -52,13 +152,61 @@ struct data_path {
     struct list_head list;
 };
 
+// base.apk paths known not to be the manager, dropped when no longer found
 struct apk_path_hash {
+    struct hlist_node node;
     unsigned int hash;
     bool exists;
+};
+
+static DEFINE_HASHTABLE(apk_path_hashes, 8);
+
+struct manager_search {
+    struct uid_snapshot *snapshot;
+    struct list_head candidates;
+    const struct cred *cred;
+    atomic_t found;
+    u32 dirs;
+    u32 apks;
+    u32 skipped;
+    atomic_t verified;
+};
+
+// A base.apk not seen before, verified on apk_wq
+struct apk_candidate {
     struct list_head list;
+    struct work_struct work;
+    struct manager_search *search;
+    unsigned int hash;
+    bool checked;
+    bool is_manager;
+    char path[DATA_PATH_LEN];
 };
 
-static struct list_head apk_path_hash_list = LIST_HEAD_INIT(apk_path_hash_list);
+static struct apk_path_hash *find_apk_path(unsigned int hash)
+{
+    struct apk_path_hash *pos;
+
+    hash_for_each_possible (apk_path_hashes, pos, node, hash) {
+        if (pos->hash == hash)
+            return pos;
+    }
+    return NULL;
+}
+
+static void clear_apk_paths(bool stale_only)
+{
+    struct apk_path_hash *pos;
+    struct hlist_node *tmp;
+    int bkt;
+
+    hash_for_each_safe (apk_path_hashes, bkt, tmp, pos, node) {
+        if (stale_only && pos->exists)
+            continue;
+        hash_del(&pos->node);
+        kfree(pos);
+    }
+}
 
 struct my_dir_context {
     struct dir_context ctx;
@@ -80,6 +228,40 @@ struct my_dir_context {
 #define FILLDIR_ACTOR_STOP -EINVAL
 #endif
 extern bool is_manager_apk(char *path);
+
+static void add_candidate(struct manager_search *search, const char *dirpath)
+{
+    char pkg[KSU_MAX_PACKAGE_NAME];
+    unsigned int hash = full_name_hash(NULL, dirpath, strlen(dirpath));
+    struct apk_path_hash *known = find_apk_path(hash);
+    struct apk_candidate *candidate;
+
+    search->apks++;
+    if (known) {
+        known->exists = true;
+        return;
+    }
+
+    // a package missing from packages.list could not be crowned anyway
+    if (get_pkg_from_apk_path(pkg, dirpath) < 0 || !find_package(search->snapshot, pkg)) {
+        search->skipped++;
+        return;
+    }
+
+    candidate = kzalloc(sizeof(*candidate), GFP_KERNEL);
+    if (!candidate) {
+        pr_err("Failed to allocate candidate for %s\n", dirpath);
+        return;
+    }
+    candidate->search = search;
+    candidate->hash = hash;
+    strscpy(candidate->path, dirpath, DATA_PATH_LEN);
+    if (last_manager_pkg[0] && !strcmp(pkg, last_manager_pkg))
+        list_add(&candidate->list, &search->candidates);
+    else
+        list_add_tail(&candidate->list, &search->candidates);
+}
+
 FILLDIR_RETURN_TYPE my_actor(struct dir_context *ctx, const char *name, int namelen, loff_t off, u64 ino,
                              unsigned int d_type)
 {
@@ -94,6 +276,11 @@ FILLDIR_RETURN_TYPE my_actor(struct dir_context *ctx, const char *name, int name
         pr_info("Stop searching\n");
         return FILLDIR_ACTOR_STOP;
     }
+    if (run_stale()) {
+        pr_info("Stop searching, packages.list changed again\n");
+        *my_ctx->stop = 1;
+        return FILLDIR_ACTOR_STOP;
+    }
 
     if (!strncmp(name, "..", namelen) || !strncmp(name, ".", namelen))
         return FILLDIR_ACTOR_CONTINUE; // Skip "." and ".."
@@ -119,55 +306,65 @@ FILLDIR_RETURN_TYPE my_actor(struct dir_context *ctx, const char *name, int name
         strscpy(data->dirpath, dirpath, DATA_PATH_LEN);
         data->depth = my_ctx->depth - 1;
         list_add_tail(&data->list, my_ctx->data_path_list);
-    } else {
-        if ((namelen == 8) && (strncmp(name, "base.apk", namelen) == 0)) {
-            struct apk_path_hash *pos, *n;
-            unsigned int hash = full_name_hash(NULL, dirpath, strlen(dirpath));
-            list_for_each_entry (pos, &apk_path_hash_list, list) {
-                if (hash == pos->hash) {
-                    pos->exists = true;
-                    return FILLDIR_ACTOR_CONTINUE;
-                }
-            }
-
-            bool is_manager = is_manager_apk(dirpath);
-            pr_info("Found new base.apk at path: %s, is_manager: %d\n", dirpath, is_manager);
-            if (is_manager) {
-                crown_manager(dirpath, my_ctx->private_data);
-                *my_ctx->stop = 1;
-
-                // Manager found, clear APK cache list
-                list_for_each_entry_safe (pos, n, &apk_path_hash_list, list) {
-                    list_del(&pos->list);
-                    kfree(pos);
-                }
-            } else {
-                struct apk_path_hash *apk_data = kzalloc(sizeof(struct apk_path_hash), GFP_KERNEL);
-                if (!apk_data) {
-                    pr_err("Failed to allocate apk_path_hash for %s\n", dirpath);
-                    return FILLDIR_ACTOR_CONTINUE;
-                }
-                apk_data->hash = hash;
-                apk_data->exists = true;
-                list_add_tail(&apk_data->list, &apk_path_hash_list);
-            }
-        }
+    } else if ((namelen == 8) && (strncmp(name, "base.apk", namelen) == 0)) {
+        add_candidate(my_ctx->private_data, dirpath);
     }
 
     return FILLDIR_ACTOR_CONTINUE;
 }
 
-void search_manager(const char *path, int depth, struct list_head *uid_data)
+static void verify_candidate_fn(struct work_struct *work)
+{
+    struct apk_candidate *candidate = container_of(work, struct apk_candidate, work);
+    struct manager_search *search = candidate->search;
+
+    // a manager was found or packages.list changed, the rest is moot
+    if (atomic_read(&search->found) || run_stale())
+        return;
+
+    const struct cred *saved = override_creds(search->cred);
+    candidate->is_manager = is_manager_apk(candidate->path);
+    revert_creds(saved);
+    candidate->checked = true;
+    atomic_inc(&search->verified);
+    if (candidate->is_manager)
+        atomic_set(&search->found, 1);
+}
+
+static void verify_candidates(struct manager_search *search)
+{
+    struct apk_candidate *candidate;
+
+    list_for_each_entry (candidate, &search->candidates, list) {
+        INIT_WORK(&candidate->work, verify_candidate_fn);
+        if (apk_wq)
+            queue_work(apk_wq, &candidate->work);
+        else
+            verify_candidate_fn(&candidate->work);
+    }
+    if (apk_wq)
+        flush_workqueue(apk_wq);
+}
+
+void search_manager(const char *path, int depth, struct uid_snapshot *uid_data)
 {
     int i, stop = 0;
     struct list_head data_path_list;
     INIT_LIST_HEAD(&data_path_list);
     unsigned long data_app_magic = 0;
-
-    // Initialize APK cache list
-    struct apk_path_hash *pos, *n;
-    list_for_each_entry (pos, &apk_path_hash_list, list) {
-        pos->exists = false;
+    struct manager_search search = { .snapshot = uid_data };
+    struct apk_candidate *candidate, *tmp;
+    struct apk_path_hash *known;
+    const char *manager = NULL;
+    ktime_t start = ktime_get();
+    int bkt;
+
+    INIT_LIST_HEAD(&search.candidates);
+    search.cred = get_current_cred();
+
+    // Initialize APK cache
+    hash_for_each (apk_path_hashes, bkt, known, node) {
+        known->exists = false;
     }
 
     // First depth
@@ -183,7 +380,7 @@ void search_manager(const char *path, int depth, struct list_head *uid_data)
             struct my_dir_context ctx = { .ctx.actor = my_actor,
                                           .data_path_list = &data_path_list,
                                           .parent_dir = pos->dirpath,
-                                          .private_data = uid_data,
+                                          .private_data = &search,
                                           .depth = pos->depth,
                                           .stop = &stop };
             struct file *file;
@@ -213,6 +410,7 @@ void search_manager(const char *path, int depth, struct list_head *uid_data)
                     goto skip_iterate;
                 }
 
+                search.dirs++;
                 iterate_dir(file, &ctx.ctx);
                 filp_close(file, NULL);
             }
@@ -223,102 +421,217 @@ void search_manager(const char *path, int depth, struct list_head *uid_data)
         }
     }
 
-    // Remove stale cached APK entries
-    list_for_each_entry_safe (pos, n, &apk_path_hash_list, list) {
-        if (!pos->exists) {
-            list_del(&pos->list);
-            kfree(pos);
+    if (!stop)
+        verify_candidates(&search);
+
+    list_for_each_entry (candidate, &search.candidates, list) {
+        if (candidate->is_manager) {
+            manager = candidate->path;
+            break;
+        }
+    }
+
+    if (manager) {
+        crown_manager(manager, uid_data);
+        // Manager found, clear APK cache
+        clear_apk_paths(false);
+    } else {
+        list_for_each_entry (candidate, &search.candidates, list) {
+            if (!candidate->checked)
+                continue;
+            known = kzalloc(sizeof(*known), GFP_KERNEL);
+            if (!known) {
+                pr_err("Failed to allocate apk_path_hash for %s\n", candidate->path);
+                continue;
+            }
+            known->hash = candidate->hash;
+            known->exists = true;
+            hash_add(apk_path_hashes, &known->node, known->hash);
         }
+        // Remove stale cached APK entries
+        clear_apk_paths(true);
+    }
+
+    pr_info("search_manager: %u dirs, %u apks, %u skipped, %u verified, manager: %s, %lld ms\n", search.dirs,
+            search.apks, search.skipped, atomic_read(&search.verified), manager ?: "none",
+            ktime_ms_delta(ktime_get(), start));
+
+    list_for_each_entry_safe (candidate, tmp, &search.candidates, list) {
+        list_del(&candidate->list);
+        kfree(candidate);
     }
+    put_cred(search.cred);
+
+    ksu_apk_verdict_sync();
 }
 
 static bool is_uid_exist(uid_t uid, char *package, void *data)
 {
-    struct list_head *list = (struct list_head *)data;
+    struct uid_snapshot *snapshot = data;
     struct uid_data *np;
 
-    bool exist = false;
-    list_for_each_entry (np, list, list) {
-        if (np->uid == uid % PER_USER_RANGE && strncmp(np->package, package, KSU_MAX_PACKAGE_NAME) == 0) {
-            exist = true;
-            break;
-        }
+    for_each_uid_data(snapshot, np, uid % PER_USER_RANGE)
+    {
+        if (strncmp(np->package, package, KSU_MAX_PACKAGE_NAME) == 0)
+            return true;
     }
-    return exist;
+    return false;
 }
 
-void track_throne(bool prune_only)
+// Parse "<package> <uid> ..." at @line, @line[len] is its '\n'
+static int parse_line(struct uid_snapshot *snapshot, char *line, size_t len)
 {
-    struct file *fp = filp_open(SYSTEM_PACKAGES_LIST_PATH, O_RDONLY, 0);
-    if (IS_ERR(fp)) {
-        pr_err("%s: open " SYSTEM_PACKAGES_LIST_PATH " failed: %ld\n", __func__, PTR_ERR(fp));
-        return;
+    u32 hash = full_name_hash(NULL, line, len);
+    struct uid_data *data;
+    char *tmp = line;
+    char *package, *uid;
+    u32 res;
+
+    line[len] = '\0';
+    package = strsep(&tmp, " ");
+    uid = strsep(&tmp, " ");
+    if (!uid || !package) {
+        pr_err("update_uid: package or uid is NULL!\n");
+        return -EINVAL;
+    }
+    if (kstrtou32(uid, 10, &res)) {
+        pr_err("update_uid: uid parse err\n");
+        return -EINVAL;
+    }
+
+    if (snapshot->count == snapshot->cap) {
+        size_t cap = snapshot->cap ? snapshot->cap * 2 : 256;
+        struct uid_data *entries = kvmalloc_array(cap, sizeof(*entries), GFP_KERNEL);
+
+        if (!entries)
+            return -ENOMEM;
+        if (snapshot->count)
+            memcpy(entries, snapshot->entries, snapshot->count * sizeof(*entries));
+        kvfree(snapshot->entries);
+        snapshot->entries = entries;
+        snapshot->cap = cap;
     }
 
-    struct list_head uid_list;
-    INIT_LIST_HEAD(&uid_list);
+    data = &snapshot->entries[snapshot->count++];
+    data->uid = res;
+    data->hash = hash;
+    strscpy(data->package, package, sizeof(data->package));
+    return 0;
+}
 
-    char chr = 0;
+static int read_packages_list(struct uid_snapshot *snapshot)
+{
+    bool skipping = false;
+    char *start, *end, *nl;
+    size_t fill = 0;
     loff_t pos = 0;
-    loff_t line_start = 0;
-    char buf[KSU_MAX_PACKAGE_NAME];
-    for (;;) {
-        ssize_t count = kernel_read(fp, &chr, sizeof(chr), &pos);
-        if (count != sizeof(chr))
-            break;
-        if (chr != '\n')
-            continue;
+    ssize_t count;
+    int ret = 0;
 
-        count = kernel_read(fp, buf, sizeof(buf) - 1, &line_start);
-        if (count <= 0) {
-            break;
-        }
-        buf[count] = '\0';
+    if (!read_buf) {
+        read_buf = kvmalloc(PACKAGES_LIST_CHUNK, GFP_KERNEL);
+        if (!read_buf)
+            return -ENOMEM;
+    }
 
-        struct uid_data *data = kzalloc(sizeof(struct uid_data), GFP_KERNEL);
-        if (!data) {
-            filp_close(fp, 0);
-            goto out;
-        }
+    struct file *fp = filp_open(SYSTEM_PACKAGES_LIST_PATH, O_RDONLY, 0);
+    if (IS_ERR(fp)) {
+        pr_err("%s: open " SYSTEM_PACKAGES_LIST_PATH " failed: %ld\n", __func__, PTR_ERR(fp));
+        return PTR_ERR(fp);
+    }
 
-        char *tmp = buf;
-        const char *delim = " ";
-        char *package = strsep(&tmp, delim);
-        char *uid = strsep(&tmp, delim);
-        if (!uid || !package) {
-            kfree(data);
-            pr_err("update_uid: package or uid is NULL!\n");
+    for (;;) {
+        count = kernel_read(fp, read_buf + fill, PACKAGES_LIST_CHUNK - fill, &pos);
+        if (count < 0)
+            ret = count;
+        // an unterminated last line is still being written, skip it
+        if (count <= 0)
             break;
+        fill += count;
+
+        start = read_buf;
+        end = read_buf + fill;
+        while ((nl = memchr(start, '\n', end - start))) {
+            if (!skipping) {
+                ret = parse_line(snapshot, start, nl - start);
+                if (ret)
+                    goto out;
+            }
+            skipping = false;
+            start = nl + 1;
         }
 
-        u32 res;
-        if (kstrtou32(uid, 10, &res)) {
-            kfree(data);
-            pr_err("update_uid: uid parse err\n");
-            break;
+        fill = end - start;
+        if (fill == PACKAGES_LIST_CHUNK) {
+            pr_warn("%s: skip line longer than %d bytes\n", __func__, PACKAGES_LIST_CHUNK);
+            skipping = true;
+            fill = 0;
+        } else {
+            memmove(read_buf, start, fill);
         }
-        data->uid = res;
-        strscpy(data->package, package, sizeof(data->package));
-        list_add_tail(&data->list, &uid_list);
-        // reset line start
-        line_start = pos;
     }
+out:
     filp_close(fp, 0);
+    return ret;
+}
 
-    // now update uid list
-    struct uid_data *np;
-    struct uid_data *n;
+static void diff_snapshots(const struct uid_snapshot *old, const struct uid_snapshot *new, struct snapshot_diff *diff)
+{
+    size_t i = 0, j = 0;
+    int cmp;
+
+    while (i < old->count || j < new->count) {
+        if (i == old->count)
+            cmp = 1;
+        else if (j == new->count)
+            cmp = -1;
+        else
+            cmp = strcmp(old->entries[i].package, new->entries[j].package);
+
+        if (cmp < 0) {
+            diff->removed++;
+            i++;
+        } else if (cmp > 0) {
+            diff->added++;
+            j++;
+        } else {
+            if (old->entries[i].uid != new->entries[j].uid || old->entries[i].hash != new->entries[j].hash)
+                diff->changed++;
+            i++;
+            j++;
+        }
+    }
+}
+
+static void __track_throne(bool prune_only)
+{
+    struct uid_snapshot snapshot = {};
+    struct snapshot_diff diff = {};
+    bool first;
+
+    // a partly parsed list would prune live packages from the allowlist
+    if (read_packages_list(&snapshot))
+        goto out;
+
+    sort(snapshot.entries, snapshot.count, sizeof(*snapshot.entries), cmp_package, NULL);
+    if (index_snapshot(&snapshot))
+        goto out;
+    first = !has_snapshot;
+    if (!first)
+        diff_snapshots(&last_snapshot, &snapshot, &diff);
+    pr_info("packages.list: %zu packages, added: %u, removed: %u, changed: %u%s\n", snapshot.count, diff.added,
+            diff.removed, diff.changed, first ? " (first parse)" : "");
 
     if (prune_only)
         goto prune;
 
     // first, check if manager_uid exist!
     bool manager_exist = false;
-    list_for_each_entry (np, &uid_list, list) {
-        if (np->uid == ksu_get_manager_appid()) {
-            manager_exist = true;
-            break;
-        }
+    struct uid_data *np;
+    for_each_uid_data(&snapshot, np, ksu_get_manager_appid())
+    {
+        manager_exist = true;
+        break;
     }
 
     if (!manager_exist) {
@@ -327,33 +640,94 @@ void track_throne(bool prune_only)
             ksu_invalidate_manager_uid();
             goto prune;
         }
-        pr_info("Searching manager...\n");
-        search_manager("/data/app", 2, &uid_list);
-        pr_info("Search manager finished\n");
+        // only a new or updated package can be a manager we have not seen
+        if (first || diff.added || diff.changed) {
+            pr_info("Searching manager...\n");
+            search_manager("/data/app", 2, &snapshot);
+            pr_info("Search manager finished\n");
+        }
+    }
+
+    // a newer run is queued, keep the old snapshot so that it redoes the search
+    if (run_stale()) {
+        pr_info("packages.list changed during tracking, deferring\n");
+        goto out;
     }
 
+    // nothing left the list, the allowlist is still consistent with it
+    if (!first && !diff.removed && !diff.changed)
+        goto keep;
+
 prune:
     // then prune the allowlist
-    ksu_prune_allowlist(is_uid_exist, &uid_list);
+    ksu_prune_allowlist(is_uid_exist, &snapshot);
+keep:
+    free_snapshot(&last_snapshot);
+    last_snapshot = snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    has_snapshot = true;
 out:
-    // free uid_list
-    list_for_each_entry_safe (np, n, &uid_list, list) {
-        list_del(&np->list);
-        kfree(np);
-    }
+    free_snapshot(&snapshot);
+}
+
+void track_throne(bool prune_only)
+{
+    mutex_lock(&throne_lock);
+    __track_throne(prune_only);
+    mutex_unlock(&throne_lock);
+}
+
+static void track_throne_fn(struct work_struct *work)
+{
+    // a kworker's kernel creds may not read packages.list or /data/app,
+    // the ksu domain may; the manager search inherits them
+    const struct cred *saved = override_creds(ksu_cred);
+
+    mutex_lock(&throne_lock);
+    run_gen = atomic_read(&track_gen);
+    __track_throne(false);
+    run_gen = 0;
+    mutex_unlock(&throne_lock);
+
+    revert_creds(saved);
+}
+
+void ksu_queue_track_throne(void)
+{
+    // never 0, which marks a synchronous run
+    if (!atomic_inc_return(&track_gen))
+        atomic_inc(&track_gen);
+
+    // restarts the window, a burst of events ends in one run
+    mod_delayed_work(throne_wq ?: system_unbound_wq, &track_work, msecs_to_jiffies(TRACK_DEBOUNCE_MS));
 }
 
 void __init ksu_throne_tracker_init()
 {
-    // nothing to do
+    // ordered, runs never overlap and a stale one only delays the next
+    throne_wq = alloc_ordered_workqueue("ksu_throne", 0);
+    if (!throne_wq)
+        pr_err("failed to allocate throne workqueue\n");
+    apk_wq = alloc_workqueue("ksu_apk_verify", WQ_UNBOUND, APK_VERIFY_WORKERS);
+    if (!apk_wq)
+        pr_warn("failed to allocate apk workqueue, verifying serially\n");
 }
 
 void __exit ksu_throne_tracker_exit()
 {
-    struct apk_path_hash *pos, *n;
-
-    list_for_each_entry_safe (pos, n, &apk_path_hash_list, list) {
-        list_del(&pos->list);
-        kfree(pos);
+    cancel_delayed_work_sync(&track_work);
+    if (throne_wq) {
+        destroy_workqueue(throne_wq);
+        throne_wq = NULL;
     }
+    if (apk_wq) {
+        destroy_workqueue(apk_wq);
+        apk_wq = NULL;
+    }
+
+    free_snapshot(&last_snapshot);
+    kvfree(read_buf);
+    ksu_apk_verdict_exit();
+    ksu_apk_sign_exit();
+    clear_apk_paths(false);
 }
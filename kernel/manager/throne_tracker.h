@@ -15,12 +15,19 @@ static inline void track_throne(bool prune_only)
 {
     (void)prune_only;
 }
+
+static inline void ksu_queue_track_throne(void)
+{
+}
 #else
 void ksu_throne_tracker_init();
 
 void ksu_throne_tracker_exit();
 
 void track_throne(bool prune_only);
+
+// Track from a workqueue after packages.list settles, never blocks the caller
+void ksu_queue_track_throne(void);
 #endif
 
 #endif
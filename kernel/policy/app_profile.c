@@ -77,6 +77,14 @@ void seccomp_filter_release(struct task_struct *tsk);
 static bool has_call_to_spin_lock = false;
 #endif
 
+static struct ksu_symbol_request app_profile_symbol_reqs[] = {
+#if NEED_BACKPORT_COMPAT
+    { "_raw_spin_lock_irq", KSU_SYMBOL_EXACT },
+    { "seccomp_filter_release", KSU_SYMBOL_EXACT },
+#endif
+};
+struct ksu_symbol_table ksu_app_profile_symbols = KSU_SYMBOL_TABLE(app_profile_symbol_reqs);
+
 static void disable_seccomp(void)
 {
     struct task_struct *fake;
@@ -11,6 +11,9 @@ int escape_with_root_profile(void);
 
 void escape_to_root_for_init(void);
 
+// Symbols ksu_app_profile_init() looks up, see ksu_init_symbol_resolver()
+extern struct ksu_symbol_table ksu_app_profile_symbols;
+
 void __init ksu_app_profile_init(void);
 
 #endif
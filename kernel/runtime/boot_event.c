@@ -5,6 +5,7 @@
 #include <linux/printk.h>
 
 #include "policy/allowlist.h"
+#include "hook/syscall_hook_manager.h"
 #include "klog.h" // IWYU pragma: keep
 #include "runtime/ksud_boot.h"
 #include "runtime/ksud.h"
@@ -68,4 +69,7 @@ void on_boot_completed(void)
     pr_info("on_boot_completed!\n");
     track_throne(true);
     ksu_selinux_hide_drop_backup_if_unused();
+    // init no longer spawns ksud stages after boot completed, the core
+    // consumer keeps unmarking init's children on exec
+    ksu_set_hook_consumer(KSU_HOOK_CONSUMER_KSUD, false);
 }
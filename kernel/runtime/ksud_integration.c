@@ -9,6 +9,9 @@
 #include <linux/err.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/kref.h>
+#include <linux/overflow.h>
+#include <linux/spinlock.h>
 #include <linux/version.h>
 #include <linux/input-event-codes.h>
 #include <linux/kprobes.h>
@@ -27,6 +30,7 @@
 #include "runtime/ksud_boot.h"
 #include "selinux/selinux.h"
 #include "hook/syscall_hook.h"
+#include "hook/syscall_hook_manager.h"
 #include "hook/syscall_event_bridge.h"
 
 // clang-format off
@@ -182,15 +186,26 @@ void ksu_handle_execveat_ksud(const char *path, struct user_arg_ptr *argv)
 static ssize_t (*orig_read)(struct file *, char __user *, size_t, loff_t *);
 static ssize_t (*orig_read_iter)(struct kiocb *, struct iov_iter *);
 static struct file_operations fops_proxy;
-static ssize_t ksu_rc_pos = 0;
 const size_t ksu_rc_len = sizeof(KERNEL_SU_RC) - 1;
 
 // Prefer /metadata/watchdog/ when present, else /metadata.
 #define MODULE_RC_PATH_WATCHDOG "/metadata/watchdog/ksu/modules.rc"
 #define MODULE_RC_PATH_DEFAULT "/metadata/ksu/modules.rc"
-static char *module_rc_buf;
+
+// modules.rc content, kept in individual pages so a large file never needs a
+// contiguous allocation. Readers hold a reference while copying out of it.
+struct module_rc {
+    struct kref ref;
+    size_t len;
+    unsigned int nr_pages;
+    struct page *pages[];
+};
+
+static struct module_rc *module_rc;
+static DEFINE_SPINLOCK(module_rc_lock);
 static size_t module_rc_len;
-static ssize_t module_rc_pos;
+// position in the injected tail: KERNEL_SU_RC followed by modules.rc
+static loff_t rc_tail_pos;
 
 static struct file *open_module_rc(const char **chosen_path)
 {
@@ -208,13 +223,78 @@ static struct file *open_module_rc(const char **chosen_path)
     return f;
 }
 
+static void release_module_rc(struct kref *ref)
+{
+    struct module_rc *rc = container_of(ref, struct module_rc, ref);
+    unsigned int i;
+
+    for (i = 0; i < rc->nr_pages; i++)
+        __free_page(rc->pages[i]);
+    kvfree(rc);
+}
+
+static struct module_rc *get_module_rc(void)
+{
+    struct module_rc *rc;
+
+    spin_lock(&module_rc_lock);
+    rc = module_rc;
+    if (rc)
+        kref_get(&rc->ref);
+    spin_unlock(&module_rc_lock);
+    return rc;
+}
+
+static void put_module_rc(struct module_rc *rc)
+{
+    if (rc)
+        kref_put(&rc->ref, release_module_rc);
+}
+
+static struct module_rc *read_module_rc(struct file *f, size_t fsize)
+{
+    unsigned int nr_pages = DIV_ROUND_UP(fsize, PAGE_SIZE);
+    struct module_rc *rc;
+    loff_t pos = 0;
+    ssize_t r = 0;
+    unsigned int i;
+
+    rc = kvzalloc(struct_size(rc, pages, nr_pages), GFP_KERNEL);
+    if (!rc)
+        return ERR_PTR(-ENOMEM);
+    kref_init(&rc->ref);
+
+    for (i = 0; i < nr_pages; i++) {
+        size_t want = min_t(size_t, fsize - rc->len, PAGE_SIZE);
+
+        rc->pages[i] = alloc_page(GFP_KERNEL);
+        if (!rc->pages[i]) {
+            r = -ENOMEM;
+            break;
+        }
+        rc->nr_pages++;
+
+        r = kernel_read(f, page_address(rc->pages[i]), want, &pos);
+        if (r <= 0)
+            break;
+        rc->len += r;
+        if (r < want)
+            break;
+    }
+
+    if (r < 0 || !rc->len) {
+        put_module_rc(rc);
+        return ERR_PTR(r < 0 ? r : -ENODATA);
+    }
+    return rc;
+}
+
 static void load_module_rc_once(void)
 {
     static bool loaded = false;
+    struct module_rc *rc;
     struct file *f;
     const char *path = NULL;
-    loff_t pos = 0;
-    ssize_t r;
     size_t fsize;
     const struct cred *old_cred;
 
@@ -245,23 +325,17 @@ static void load_module_rc_once(void)
         goto out_close_file;
     }
 
-    module_rc_buf = kvmalloc(fsize, GFP_KERNEL);
-    if (!module_rc_buf) {
-        pr_err("module rc: alloc %zu failed\n", fsize);
+    rc = read_module_rc(f, fsize);
+    if (IS_ERR(rc)) {
+        pr_err("module rc: read failed: %ld\n", PTR_ERR(rc));
         goto out_close_file;
     }
 
-    r = kernel_read(f, module_rc_buf, fsize, &pos);
-
-    if (r <= 0) {
-        pr_err("module rc: read failed: %zd\n", r);
-        kvfree(module_rc_buf);
-        module_rc_buf = NULL;
-        goto out_close_file;
-    }
-
-    module_rc_len = r;
-    pr_info("module rc: loaded %zu bytes from %s\n", module_rc_len, path);
+    spin_lock(&module_rc_lock);
+    module_rc = rc;
+    module_rc_len = rc->len;
+    spin_unlock(&module_rc_lock);
+    pr_info("module rc: loaded %zu bytes in %u pages from %s\n", rc->len, rc->nr_pages, path);
 
 out_close_file:
     filp_close(f, NULL);
@@ -272,122 +346,118 @@ out_revert_creds:
 
 static void free_module_rc(void)
 {
-    kvfree(module_rc_buf);
-    module_rc_buf = NULL;
-    module_rc_len = 0;
+    struct module_rc *rc;
+
+    spin_lock(&module_rc_lock);
+    rc = module_rc;
+    module_rc = NULL;
+    spin_unlock(&module_rc_lock);
+    put_module_rc(rc);
+}
+
+static bool rc_tail_done(void)
+{
+    return rc_tail_pos >= ksu_rc_len + module_rc_len;
+}
+
+// Returns the contiguous run of the tail starting at pos, or NULL at its end.
+static const char *rc_tail_chunk(struct module_rc *rc, loff_t pos, size_t *len)
+{
+    if (pos < ksu_rc_len) {
+        *len = ksu_rc_len - pos;
+        return KERNEL_SU_RC + pos;
+    }
+    pos -= ksu_rc_len;
+    if (!rc || pos >= rc->len)
+        return NULL;
+    *len = min_t(size_t, PAGE_SIZE - offset_in_page(pos), rc->len - pos);
+    return (const char *)page_address(rc->pages[pos >> PAGE_SHIFT]) + offset_in_page(pos);
+}
+
+static void rc_tail_advance(const char *who, size_t count)
+{
+    rc_tail_pos += count;
+    pr_info("%s: append %zu\n", who, count);
+    if (rc_tail_done()) {
+        pr_info("%s: append done\n", who);
+        free_module_rc();
+    }
 }
 
 // https://cs.android.com/android/platform/superproject/main/+/main:system/core/init/parser.cpp;l=144;drc=61197364367c9e404c7da6900658f1b16c42d0da
 // https://cs.android.com/android/platform/superproject/main/+/main:system/libbase/file.cpp;l=241-243;drc=61197364367c9e404c7da6900658f1b16c42d0da
 // The system will read init.rc file until EOF, whenever read() returns 0,
 // so we begin append ksu rc when we meet EOF.
+// The original content is always read straight from the file, only the tail
+// is copied out of our buffers.
 
 static ssize_t read_proxy(struct file *file, char __user *buf, size_t count, loff_t *pos)
 {
-    ssize_t ret = 0;
-    size_t append_count;
-    if (ksu_rc_pos && ksu_rc_pos < ksu_rc_len)
-        goto append_ksu_rc;
-    if (ksu_rc_pos >= ksu_rc_len && module_rc_pos < module_rc_len)
-        goto append_module_rc;
+    struct module_rc *rc;
+    size_t copied = 0;
 
-    ret = orig_read(file, buf, count, pos);
-    if (ret != 0) {
-        return ret;
-    }
-    if (ksu_rc_pos >= ksu_rc_len && module_rc_pos >= module_rc_len) {
-        return ret;
+    if (!rc_tail_pos || rc_tail_done()) {
+        ssize_t ret = orig_read(file, buf, count, pos);
+        if (ret != 0 || rc_tail_done()) {
+            return ret;
+        }
+        pr_info("read_proxy: orig read finished, start append rc\n");
     }
-    pr_info("read_proxy: orig read finished, start append rc\n");
 
-append_ksu_rc:
-    if (ksu_rc_pos < ksu_rc_len) {
-        append_count = ksu_rc_len - ksu_rc_pos;
-        if (append_count > count - ret)
-            append_count = count - ret;
+    rc = get_module_rc();
+    while (copied < count) {
+        size_t len;
+        const char *chunk = rc_tail_chunk(rc, rc_tail_pos + copied, &len);
+        if (!chunk)
+            break;
+        len = min(len, count - copied);
         // copy_to_user returns the number of bytes that could not be copied
-        if (copy_to_user(buf + ret, KERNEL_SU_RC + ksu_rc_pos, append_count)) {
-            pr_info("read_proxy: append error, totally appended %ld\n", ksu_rc_pos);
-            return ret;
-        }
-        pr_info("read_proxy: append static %zu\n", append_count);
-        ksu_rc_pos += append_count;
-        ret += append_count;
-        if (ksu_rc_pos == ksu_rc_len)
-            pr_info("read_proxy: static append done\n");
-    }
-
-append_module_rc:
-    if (module_rc_pos < module_rc_len && (size_t)ret < count) {
-        append_count = module_rc_len - module_rc_pos;
-        if (append_count > count - ret)
-            append_count = count - ret;
-        if (copy_to_user(buf + ret, module_rc_buf + module_rc_pos, append_count)) {
-            pr_info("read_proxy: module append error, totally appended %zd\n", module_rc_pos);
-            return ret;
-        }
-        pr_info("read_proxy: append module %zu\n", append_count);
-        module_rc_pos += append_count;
-        ret += append_count;
-        if (module_rc_pos == (ssize_t)module_rc_len) {
-            pr_info("read_proxy: module append done\n");
-            free_module_rc();
+        if (copy_to_user(buf + copied, chunk, len)) {
+            pr_info("read_proxy: append error, totally appended %lld\n", rc_tail_pos + copied);
+            break;
         }
+        copied += len;
     }
+    put_module_rc(rc);
 
-    return ret;
+    if (copied)
+        rc_tail_advance("read_proxy", copied);
+    return copied;
 }
 
 static ssize_t read_iter_proxy(struct kiocb *iocb, struct iov_iter *to)
 {
-    ssize_t ret = 0;
-    size_t append_count;
-    if (ksu_rc_pos && ksu_rc_pos < ksu_rc_len)
-        goto append_ksu_rc;
-    if (ksu_rc_pos >= ksu_rc_len && module_rc_pos < module_rc_len)
-        goto append_module_rc;
+    struct module_rc *rc;
+    size_t copied = 0;
 
-    ret = orig_read_iter(iocb, to);
-    if (ret != 0) {
-        return ret;
-    }
-    if (ksu_rc_pos >= ksu_rc_len && module_rc_pos >= module_rc_len) {
-        return ret;
-    }
-    pr_info("read_iter_proxy: orig read finished, start append rc\n");
-
-append_ksu_rc:
-    if (ksu_rc_pos < ksu_rc_len) {
-        // copy_to_iter returns the number of bytes successfully copied
-        append_count = copy_to_iter(KERNEL_SU_RC + ksu_rc_pos, ksu_rc_len - ksu_rc_pos, to);
-        if (!append_count) {
-            pr_info("read_iter_proxy: append error, totally appended %ld\n", ksu_rc_pos);
+    if (!rc_tail_pos || rc_tail_done()) {
+        ssize_t ret = orig_read_iter(iocb, to);
+        if (ret != 0 || rc_tail_done()) {
             return ret;
         }
-        pr_info("read_iter_proxy: append static %zu\n", append_count);
-        ksu_rc_pos += append_count;
-        ret += append_count;
-        if (ksu_rc_pos == ksu_rc_len) {
-            pr_info("read_iter_proxy: static append done\n");
-        }
+        pr_info("read_iter_proxy: orig read finished, start append rc\n");
     }
 
-append_module_rc:
-    if (module_rc_pos < module_rc_len) {
-        append_count = copy_to_iter(module_rc_buf + module_rc_pos, module_rc_len - module_rc_pos, to);
-        if (!append_count) {
-            pr_info("read_iter_proxy: module append error, appended %zd\n", module_rc_pos);
-            return ret;
-        }
-        pr_info("read_iter_proxy: append module %zu\n", append_count);
-        module_rc_pos += append_count;
-        ret += append_count;
-        if (module_rc_pos == (ssize_t)module_rc_len) {
-            pr_info("read_iter_proxy: module append done\n");
-            free_module_rc();
+    rc = get_module_rc();
+    while (iov_iter_count(to)) {
+        size_t len, n;
+        const char *chunk = rc_tail_chunk(rc, rc_tail_pos + copied, &len);
+        if (!chunk)
+            break;
+        // copy_to_iter returns the number of bytes successfully copied
+        n = copy_to_iter(chunk, len, to);
+        copied += n;
+        if (n < len) {
+            if (!n)
+                pr_info("read_iter_proxy: append error, totally appended %lld\n", rc_tail_pos + copied);
+            break;
         }
     }
-    return ret;
+    put_module_rc(rc);
+
+    if (copied)
+        rc_tail_advance("read_iter_proxy", copied);
+    return copied;
 }
 
 static bool is_init_rc(struct file *fp)
@@ -559,57 +629,81 @@ void ksu_execveat_hook_ksud(const struct pt_regs *regs)
     ksu_execve_hook_ksud_common(filename_user, argv_user);
 }
 
-static long (*orig_sys_read)(const struct pt_regs *regs);
-static long ksu_sys_read(const struct pt_regs *regs)
+// read/fstat are routed through the dispatcher rather than patched into the
+// syscall table, so only marked tasks get here. Anything but init goes
+// straight on to the original syscall.
+static int ksu_sys_read_pre(int orig_nr, struct pt_regs *regs, long *ret, void **data)
 {
     unsigned int fd = PT_REGS_PARM1(regs);
     char __user **buf_ptr = (char __user **)&PT_REGS_PARM2(regs);
     size_t *count_ptr = (size_t *)&PT_REGS_PARM3(regs);
 
-    ksu_handle_sys_read(fd, buf_ptr, count_ptr);
-    return orig_sys_read(regs);
+    if (current->pid == 1)
+        ksu_handle_sys_read(fd, buf_ptr, count_ptr);
+    return KSU_HOOK_CONTINUE;
 }
 
-static long (*orig_sys_fstat)(const struct pt_regs *regs);
-static long ksu_sys_fstat(const struct pt_regs *regs)
+// Passed from the fstat pre handler to the post handler when the fd is init.rc
+static const char init_rc_stat_found;
+
+static int ksu_sys_fstat_pre(int orig_nr, struct pt_regs *regs, long *ret, void **data)
 {
     unsigned int fd = PT_REGS_PARM1(regs);
-    void __user *statbuf = (void __user *)PT_REGS_PARM2(regs);
-    bool is_rc = false;
-    long ret;
+
+    if (current->pid != 1)
+        return KSU_HOOK_CONTINUE;
 
     struct file *file = fget(fd);
     if (file) {
         if (is_init_rc(file)) {
             pr_info("stat init.rc");
-            is_rc = true;
+            // tell the post handler to fix up st_size
+            *data = (void *)&init_rc_stat_found;
             load_module_rc_once();
         }
         fput(file);
     }
+    return KSU_HOOK_CONTINUE;
+}
 
-    ret = orig_sys_fstat(regs);
+static void ksu_sys_fstat_post(int orig_nr, const struct pt_regs *regs, long ret, void *data)
+{
+    void __user *statbuf = (void __user *)PT_REGS_PARM2(regs);
 
-    if (is_rc) {
-        void __user *st_size_ptr = statbuf + offsetof(struct stat, st_size);
-        long size, new_size;
-        size_t extra = ksu_rc_len + module_rc_len;
-        if (!copy_from_user_nofault(&size, st_size_ptr, sizeof(long))) {
-            new_size = size + extra;
-            pr_info("adding rc len: %ld -> %ld (static=%zu module=%zu)", size, new_size, ksu_rc_len, module_rc_len);
-            if (!copy_to_user_nofault(st_size_ptr, &new_size, sizeof(long))) {
-                pr_info("added rc len");
-            } else {
-                pr_err("add rc len failed: statbuf 0x%lx", (unsigned long)st_size_ptr);
-            }
+    if (data != &init_rc_stat_found)
+        return;
+
+    void __user *st_size_ptr = statbuf + offsetof(struct stat, st_size);
+    long size, new_size;
+    size_t extra = ksu_rc_len + module_rc_len;
+    if (!copy_from_user_nofault(&size, st_size_ptr, sizeof(long))) {
+        new_size = size + extra;
+        pr_info("adding rc len: %ld -> %ld (static=%zu module=%zu)", size, new_size, ksu_rc_len, module_rc_len);
+        if (!copy_to_user_nofault(st_size_ptr, &new_size, sizeof(long))) {
+            pr_info("added rc len");
         } else {
-            pr_err("read statbuf 0x%lx failed", (unsigned long)st_size_ptr);
+            pr_err("add rc len failed: statbuf 0x%lx", (unsigned long)st_size_ptr);
         }
+    } else {
+        pr_err("read statbuf 0x%lx failed", (unsigned long)st_size_ptr);
     }
-
-    return ret;
 }
 
+static struct ksu_syscall_handler init_rc_read_handler = {
+    .name = "init_rc",
+    .nr = __NR_read,
+    .consumer = KSU_HOOK_CONSUMER_KSUD,
+    .pre = ksu_sys_read_pre,
+};
+
+static struct ksu_syscall_handler init_rc_fstat_handler = {
+    .name = "init_rc",
+    .nr = __NR_fstat,
+    .consumer = KSU_HOOK_CONSUMER_KSUD,
+    .pre = ksu_sys_fstat_pre,
+    .post = ksu_sys_fstat_post,
+};
+
 static int input_handle_event_handler_pre(struct kprobe *p, struct pt_regs *regs)
 {
     unsigned int *type = (unsigned int *)&PT_REGS_PARM2(regs);
@@ -630,8 +724,8 @@ static void do_stop_input_hook(struct work_struct *work)
 
 static void stop_init_rc_hook()
 {
-    ksu_syscall_table_unhook(__NR_read);
-    ksu_syscall_table_unhook(__NR_fstat);
+    ksu_set_syscall_handler_enabled(&init_rc_read_handler, false);
+    ksu_set_syscall_handler_enabled(&init_rc_fstat_handler, false);
     pr_info("unregister init_rc syscall hook\n");
 }
 
@@ -651,8 +745,13 @@ void __init ksu_ksud_init()
 {
     int ret;
 
-    ksu_syscall_table_hook(__NR_read, ksu_sys_read, &orig_sys_read);
-    ksu_syscall_table_hook(__NR_fstat, ksu_sys_fstat, &orig_sys_fstat);
+    // init is marked from the start, see should_mark_task() in tp_marker.c
+    ret = ksu_register_syscall_handler(&init_rc_read_handler);
+    if (ret)
+        pr_err("ksud: register init_rc read handler failed: %d\n", ret);
+    ret = ksu_register_syscall_handler(&init_rc_fstat_handler);
+    if (ret)
+        pr_err("ksud: register init_rc fstat handler failed: %d\n", ret);
 
     ret = register_kprobe(&input_event_kp);
     pr_info("ksud: input_event_kp: %d\n", ret);
@@ -667,7 +766,5 @@ void __exit ksu_ksud_exit()
     // stop_init_rc_hook();
     unregister_kprobe(&input_event_kp);
 
-    if (module_rc_buf) {
-        free_module_rc();
-    }
+    free_module_rc();
 }
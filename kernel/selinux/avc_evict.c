@@ -0,0 +1,184 @@
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/rculist.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+// security/selinux/include
+#include "avc.h"
+#include "security.h"
+#include "ss/sidtab.h"
+
+#include "klog.h" // IWYU pragma: keep
+#include "infra/symbol_resolver.h"
+#include "selinux/avc_evict.h"
+
+// Mirrors of the private structures of security/selinux/avc.c
+#define AVC_CACHE_SLOTS 512
+
+struct ksu_avc_entry {
+    u32 ssid;
+    u32 tsid;
+    u16 tclass;
+    struct av_decision avd;
+    void *xp_node;
+};
+
+struct ksu_avc_node {
+    struct ksu_avc_entry ae;
+    struct hlist_node list;
+    struct rcu_head rhead;
+};
+
+struct ksu_avc_cache {
+    struct hlist_head slots[AVC_CACHE_SLOTS];
+    spinlock_t slots_lock[AVC_CACHE_SLOTS];
+    atomic_t lru_hint;
+    atomic_t active_nodes;
+    u32 latest_notif;
+};
+
+struct ksu_selinux_avc {
+    unsigned int avc_cache_threshold;
+    struct ksu_avc_cache avc_cache;
+};
+
+static struct ksu_symbol_request avc_evict_symbol_reqs[] = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    { "selinux_avc", KSU_SYMBOL_EXACT },
+#endif
+    { "avc_node_free", KSU_SYMBOL_FUNCTABLE },
+};
+struct ksu_symbol_table ksu_avc_evict_symbols = KSU_SYMBOL_TABLE(avc_evict_symbol_reqs);
+
+static struct ksu_selinux_avc *avc;
+static rcu_callback_t avc_node_free_fn;
+static bool avc_resolved;
+
+static bool resolve_avc(void)
+{
+    if (avc_resolved)
+        return avc && avc_node_free_fn;
+    avc_resolved = true;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    avc = (struct ksu_selinux_avc *)find_kernel_symbol_exact("selinux_avc");
+#else
+    avc = (struct ksu_selinux_avc *)selinux_state.avc;
+#endif
+    avc_node_free_fn = (rcu_callback_t)ksu_resolve_symbol_for_functable_hook("avc_node_free");
+    if (!avc || !avc_node_free_fn) {
+        pr_warn("avc: selinux_avc: %px, avc_node_free: %px, targeted eviction disabled\n", avc, avc_node_free_fn);
+        return false;
+    }
+    return true;
+}
+
+static bool sid_touched(struct selinux_policy *pol, struct ebitmap *types, u32 sid)
+{
+    struct context *ctx = sidtab_search(pol->sidtab, sid);
+
+    // unknown or unmapped contexts are evicted to be safe
+    if (!ctx || !ctx->type)
+        return true;
+    return ebitmap_get_bit(types, ctx->type - 1);
+}
+
+int ksu_avc_evict_types(struct selinux_policy *pol, struct ebitmap *types)
+{
+    struct ksu_avc_node *node;
+    struct hlist_head *head;
+    spinlock_t *lock;
+    unsigned long flags;
+    int evicted = 0;
+    int i;
+
+    if (!resolve_avc())
+        return -ENOSYS;
+
+    for (i = 0; i < AVC_CACHE_SLOTS; i++) {
+        head = &avc->avc_cache.slots[i];
+        lock = &avc->avc_cache.slots_lock[i];
+
+        spin_lock_irqsave(lock, flags);
+        // same as avc_flush(), hlist_del_rcu() keeps ->next valid
+        rcu_read_lock();
+        hlist_for_each_entry (node, head, list) {
+            if (!sid_touched(pol, types, node->ae.ssid) && !sid_touched(pol, types, node->ae.tsid))
+                continue;
+            hlist_del_rcu(&node->list);
+            call_rcu(&node->rhead, avc_node_free_fn);
+            atomic_dec(&avc->avc_cache.active_nodes);
+            evicted++;
+        }
+        rcu_read_unlock();
+        spin_unlock_irqrestore(lock, flags);
+    }
+
+    return evicted;
+}
+
+#ifdef CONFIG_SECURITY_SELINUX_AVC_STATS
+static void avc_miss_probe_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(probe_work, avc_miss_probe_fn);
+
+static struct {
+    atomic_t busy;
+    bool targeted;
+    int evicted;
+    int stage;
+    u64 misses[3];
+} probe;
+
+static u64 avc_misses(void)
+{
+    u64 misses = 0;
+    int cpu;
+
+    for_each_possible_cpu (cpu)
+        misses += per_cpu(avc_cache_stats, cpu).misses;
+    return misses;
+}
+
+static void avc_miss_probe_fn(struct work_struct *work)
+{
+    probe.misses[++probe.stage] = avc_misses();
+    if (probe.stage < 2) {
+        schedule_delayed_work(&probe_work, HZ);
+        return;
+    }
+
+    pr_info("avc: %s invalidation evicted %d, misses: %llu in 1s after, %llu in the next 1s\n",
+            probe.targeted ? "targeted" : "full", probe.evicted, probe.misses[1] - probe.misses[0],
+            probe.misses[2] - probe.misses[1]);
+    atomic_set(&probe.busy, 0);
+}
+
+void ksu_avc_probe_misses(bool targeted, int evicted)
+{
+    // one probe at a time, later invalidations during it are not sampled
+    if (atomic_cmpxchg(&probe.busy, 0, 1))
+        return;
+
+    probe.targeted = targeted;
+    probe.evicted = evicted;
+    probe.stage = 0;
+    probe.misses[0] = avc_misses();
+    schedule_delayed_work(&probe_work, HZ);
+}
+
+void __exit ksu_avc_evict_exit(void)
+{
+    cancel_delayed_work_sync(&probe_work);
+}
+#else
+void ksu_avc_probe_misses(bool targeted, int evicted)
+{
+    pr_info("avc: %s invalidation evicted %d\n", targeted ? "targeted" : "full", evicted);
+}
+
+void __exit ksu_avc_evict_exit(void)
+{
+}
+#endif
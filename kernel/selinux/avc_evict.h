@@ -0,0 +1,23 @@
+#ifndef __KSU_H_AVC_EVICT
+#define __KSU_H_AVC_EVICT
+
+#include <linux/types.h>
+
+#include "ss/ebitmap.h"
+#include "ss/services.h"
+
+// Evict the AVC entries whose source or target type is in @types (values - 1).
+// Caller holds policy_mutex with @pol live. Returns the number of evicted
+// entries, or a negative errno if targeted eviction is unavailable and the
+// caller must flush the whole AVC.
+int ksu_avc_evict_types(struct selinux_policy *pol, struct ebitmap *types);
+
+// Log the AVC misses of the two seconds following an invalidation
+void ksu_avc_probe_misses(bool targeted, int evicted);
+
+void ksu_avc_evict_exit(void);
+
+// Symbols resolved for targeted eviction, see ksu_init_symbol_resolver()
+extern struct ksu_symbol_table ksu_avc_evict_symbols;
+
+#endif
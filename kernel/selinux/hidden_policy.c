@@ -0,0 +1,212 @@
+#include <linux/bitmap.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+// security/selinux/include
+#include "security.h"
+
+#include "klog.h" // IWYU pragma: keep
+#include "selinux/hidden_policy.h"
+
+enum hidden_kind {
+    HIDDEN_AV = 1, // source, target, class, specified
+    HIDDEN_ATTR, // type, attribute
+    HIDDEN_PERMISSIVE, // type
+    HIDDEN_NAMES, // class, constraint, expression, type
+};
+
+#define HIDDEN_KEY_WORDS 5
+#define HIDDEN_HASH_BITS 10
+#define HIDDEN_AV_SOURCES 1024
+
+struct hidden_entry {
+    struct hlist_node node;
+    u32 key[HIDDEN_KEY_WORDS];
+    bool present; // the stock bit or whether the stock AV key existed
+    u32 data;
+};
+
+static DEFINE_HASHTABLE(hidden_entries, HIDDEN_HASH_BITS);
+static DECLARE_BITMAP(hidden_av_sources, HIDDEN_AV_SOURCES);
+// p_types.nprim of the stock policy, 0 while nothing is recorded
+static u32 base_types;
+static u32 stock_seqno;
+static u32 entry_count;
+static bool dropped;
+
+static struct hidden_entry *find_entry(const u32 *key, u32 hash)
+{
+    struct hidden_entry *e;
+
+    hash_for_each_possible_rcu (hidden_entries, e, node, hash) {
+        if (!memcmp(e->key, key, sizeof(e->key)))
+            return e;
+    }
+    return NULL;
+}
+
+static void record(const u32 *key, bool present, u32 data)
+{
+    u32 hash = jhash2(key, HIDDEN_KEY_WORDS, 0);
+    struct hidden_entry *e;
+
+    rcu_read_lock();
+    e = find_entry(key, hash);
+    rcu_read_unlock();
+    if (e)
+        return;
+
+    e = kmalloc(sizeof(*e), GFP_KERNEL);
+    if (!e) {
+        pr_err_ratelimited("hidden policy: failed to record kind %u\n", key[0]);
+        return;
+    }
+    memcpy(e->key, key, sizeof(e->key));
+    e->present = present;
+    e->data = data;
+    hash_add_rcu(hidden_entries, &e->node, hash);
+    entry_count++;
+}
+
+static struct hidden_entry *lookup(const u32 *key)
+{
+    return find_entry(key, jhash2(key, HIDDEN_KEY_WORDS, 0));
+}
+
+void ksu_hidden_policy_init(struct selinux_policy *pol)
+{
+    if (base_types || dropped)
+        return;
+
+    stock_seqno = pol->latest_granting;
+    WRITE_ONCE(base_types, pol->policydb.p_types.nprim);
+    pr_info("hidden policy: recording from %u types, latest_granting=%u\n", base_types, stock_seqno);
+}
+
+void ksu_hidden_policy_drop(void)
+{
+    struct hidden_entry *e;
+    struct hlist_node *tmp;
+    int bkt;
+
+    mutex_lock(&selinux_state.policy_mutex);
+    if (!base_types) {
+        mutex_unlock(&selinux_state.policy_mutex);
+        return;
+    }
+    WRITE_ONCE(base_types, 0);
+    dropped = true;
+    mutex_unlock(&selinux_state.policy_mutex);
+
+    synchronize_rcu();
+    hash_for_each_safe (hidden_entries, bkt, tmp, e, node) {
+        hash_del(&e->node);
+        kfree(e);
+    }
+    bitmap_zero(hidden_av_sources, HIDDEN_AV_SOURCES);
+    pr_info("hidden policy: dropped %u records\n", entry_count);
+    entry_count = 0;
+}
+
+bool ksu_hidden_policy_available(void)
+{
+    return READ_ONCE(base_types) != 0;
+}
+
+void ksu_hidden_record_av(struct policydb *db, struct avtab_key *key)
+{
+    u32 k[HIDDEN_KEY_WORDS] = { HIDDEN_AV, key->source_type, key->target_type, key->target_class, key->specified };
+    struct avtab_node *node;
+
+    // only AV decisions are answered from the hidden policy
+    if (!base_types || !(key->specified & AVTAB_AV))
+        return;
+    if (ksu_hidden_type(key->source_type) || ksu_hidden_type(key->target_type))
+        return;
+
+    set_bit(key->source_type % HIDDEN_AV_SOURCES, hidden_av_sources);
+    node = avtab_search_node(&db->te_avtab, key);
+    record(k, node != NULL, node ? node->datum.u.data : 0);
+}
+
+void ksu_hidden_record_attr(struct policydb *db, u32 type, u32 attr)
+{
+    u32 k[HIDDEN_KEY_WORDS] = { HIDDEN_ATTR, type, attr };
+
+    if (!base_types || ksu_hidden_type(type) || ksu_hidden_type(attr))
+        return;
+    if (ebitmap_get_bit(&db->type_attr_map_array[type - 1], attr - 1))
+        return;
+    record(k, true, 0);
+}
+
+void ksu_hidden_record_permissive(struct policydb *db, u32 type)
+{
+    u32 k[HIDDEN_KEY_WORDS] = { HIDDEN_PERMISSIVE, type };
+
+    if (!base_types || ksu_hidden_type(type))
+        return;
+    record(k, ebitmap_get_bit(&db->permissive_map, type), 0);
+}
+
+void ksu_hidden_record_names(u32 tclass, u32 constraint, u32 expr, u32 type)
+{
+    u32 k[HIDDEN_KEY_WORDS] = { HIDDEN_NAMES, tclass, constraint, expr, type };
+
+    if (!base_types || ksu_hidden_type(type))
+        return;
+    record(k, true, 0);
+}
+
+bool ksu_hidden_type(u32 type)
+{
+    return type > READ_ONCE(base_types);
+}
+
+u32 ksu_hidden_seqno(void)
+{
+    return stock_seqno;
+}
+
+bool ksu_hidden_av_source(u32 source_type)
+{
+    return test_bit(source_type % HIDDEN_AV_SOURCES, hidden_av_sources);
+}
+
+bool ksu_hidden_av(const struct avtab_key *key, bool *present, u32 *data)
+{
+    u32 k[HIDDEN_KEY_WORDS] = { HIDDEN_AV, key->source_type, key->target_type, key->target_class, key->specified };
+    struct hidden_entry *e = lookup(k);
+
+    if (!e)
+        return false;
+    *present = e->present;
+    *data = e->data;
+    return true;
+}
+
+bool ksu_hidden_attr_added(u32 type, u32 attr)
+{
+    u32 k[HIDDEN_KEY_WORDS] = { HIDDEN_ATTR, type, attr };
+
+    return lookup(k) != NULL;
+}
+
+bool ksu_hidden_permissive(u32 type, bool live)
+{
+    u32 k[HIDDEN_KEY_WORDS] = { HIDDEN_PERMISSIVE, type };
+    struct hidden_entry *e = lookup(k);
+
+    return e ? e->present : live;
+}
+
+bool ksu_hidden_names_added(u32 tclass, u32 constraint, u32 expr, u32 type)
+{
+    u32 k[HIDDEN_KEY_WORDS] = { HIDDEN_NAMES, tclass, constraint, expr, type };
+
+    return lookup(k) != NULL;
+}
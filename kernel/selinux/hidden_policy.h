@@ -0,0 +1,45 @@
+#ifndef __KSU_H_HIDDEN_POLICY
+#define __KSU_H_HIDDEN_POLICY
+
+#include <linux/types.h>
+
+#include "ss/avtab.h"
+#include "ss/policydb.h"
+#include "ss/services.h"
+
+// The policy as it was before KernelSU changed it, answered from the live
+// policy and a record of the stock state of what KernelSU changed.
+// Types added by KernelSU do not exist in it, so nothing reachable through
+// them is recorded.
+
+// Start recording against @pol before its first modification, a no-op once
+// started. Caller holds policy_mutex.
+void ksu_hidden_policy_init(struct selinux_policy *pol);
+
+// Stop recording and free the record, the hidden policy is gone for good.
+void ksu_hidden_policy_drop(void);
+
+bool ksu_hidden_policy_available(void);
+
+// Record the stock state before sepolicy.c changes it, caller holds
+// policy_mutex. Only the first change of each item is kept.
+void ksu_hidden_record_av(struct policydb *db, struct avtab_key *key);
+void ksu_hidden_record_attr(struct policydb *db, u32 type, u32 attr);
+void ksu_hidden_record_permissive(struct policydb *db, u32 type);
+// Bit @type of the names of expression @expr of constraint @constraint of
+// class @tclass was set, ordinals are stable across clones.
+void ksu_hidden_record_names(u32 tclass, u32 constraint, u32 expr, u32 type);
+
+// Queries, caller holds rcu_read_lock()
+bool ksu_hidden_type(u32 type);
+u32 ksu_hidden_seqno(void);
+// Whether some AV key with @source_type was changed, a cheap prefilter
+bool ksu_hidden_av_source(u32 source_type);
+// Stock datum of an AV key KernelSU changed. Returns false if unchanged,
+// otherwise *present tells if the key existed and *data holds its value.
+bool ksu_hidden_av(const struct avtab_key *key, bool *present, u32 *data);
+bool ksu_hidden_attr_added(u32 type, u32 attr);
+bool ksu_hidden_permissive(u32 type, bool live);
+bool ksu_hidden_names_added(u32 tclass, u32 constraint, u32 expr, u32 type);
+
+#endif
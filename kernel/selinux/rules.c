@@ -6,17 +6,20 @@
 #include <linux/lockdep.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/pid.h>
+#include <linux/sched.h>
 
 #include "uapi/selinux.h"
 #include "klog.h" // IWYU pragma: keep
 #include "selinux.h"
 #include "sepolicy.h"
+#include "avc_evict.h"
+#include "hidden_policy.h"
 #include "ss/services.h"
 #include "linux/lsm_audit.h" // IWYU pragma: keep
 #include "xfrm.h"
 
-struct selinux_policy *backup_sepolicy;
-
 #define SELINUX_POLICY_INSTEAD_SELINUX_SS
 
 #define ALL NULL
@@ -26,22 +29,59 @@ extern int avc_ss_reset(u32 seqno);
 #else
 extern int avc_ss_reset(struct selinux_avc *avc, u32 seqno);
 #endif
-// reset avc cache table, otherwise the new rules will not take effect if already denied
-static void reset_avc_cache()
+// tell userspace object managers to drop their own caches
+static void notify_policyload(void)
 {
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0))
-    avc_ss_reset(0);
     selnl_notify_policyload(0);
     selinux_status_update_policyload(0);
 #else
-    struct selinux_avc *avc = selinux_state.avc;
-    avc_ss_reset(avc, 0);
     selnl_notify_policyload(0);
     selinux_status_update_policyload(&selinux_state, 0);
 #endif
     selinux_xfrm_notify_policyload();
 }
 
+// reset avc cache table, otherwise the new rules will not take effect if already denied
+static void reset_avc_cache()
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0))
+    avc_ss_reset(0);
+#else
+    struct selinux_avc *avc = selinux_state.avc;
+    avc_ss_reset(avc, 0);
+#endif
+    notify_policyload();
+}
+
+// Past this many affected types, flushing everything is cheaper than the
+// per entry context lookups and the recomputation is system wide anyway.
+#define KSU_AVC_EVICT_MAX_TYPES 64
+
+// Drop the cached decisions @changes may have altered, caller holds
+// policy_mutex with @pol live. NULL @changes flushes the whole AVC.
+static void invalidate_avc(struct selinux_policy *pol, struct ksu_sepolicy_changes *changes)
+{
+    struct ebitmap affected;
+    int evicted = -EINVAL;
+    u32 count;
+
+    if (changes) {
+        count = ksu_sepolicy_affected_types(&pol->policydb, changes, &affected, KSU_AVC_EVICT_MAX_TYPES);
+        if (count <= KSU_AVC_EVICT_MAX_TYPES)
+            evicted = ksu_avc_evict_types(pol, &affected);
+        ebitmap_destroy(&affected);
+    }
+
+    if (evicted < 0) {
+        reset_avc_cache();
+        ksu_avc_probe_misses(false, 0);
+    } else {
+        notify_policyload();
+        ksu_avc_probe_misses(true, evicted);
+    }
+}
+
 void apply_kernelsu_rules()
 {
     struct selinux_policy *pol, *old_pol = selinux_state.policy;
@@ -52,32 +92,11 @@ void apply_kernelsu_rules()
     }
 
     mutex_lock(&selinux_state.policy_mutex);
-    backup_sepolicy =
-        ksu_dup_sepolicy(rcu_dereference_protected(old_pol, lockdep_is_held(&selinux_state.policy_mutex)));
-    if (IS_ERR(backup_sepolicy)) {
-        pr_err("failed to create backup sepolicy: %ld\n", PTR_ERR(backup_sepolicy));
-        backup_sepolicy = NULL;
-    } else {
-        backup_sepolicy->sidtab = kzalloc(sizeof(*backup_sepolicy->sidtab), GFP_KERNEL);
-        if (!backup_sepolicy->sidtab) {
-            pr_err("failed to alloc backup sidtab\n");
-            ksu_destroy_sepolicy(backup_sepolicy);
-            backup_sepolicy = NULL;
-        } else {
-            int ret = policydb_load_isids(&backup_sepolicy->policydb, backup_sepolicy->sidtab);
-            if (ret) {
-                pr_err("failed to load isids for backup sepolicy: %d!\n", ret);
-                kfree(backup_sepolicy->sidtab);
-                ksu_destroy_sepolicy(backup_sepolicy);
-                backup_sepolicy = NULL;
-            } else {
-                pr_info("backup sepolicy success! latest_granting=%d\n", backup_sepolicy->latest_granting);
-            }
-        }
-    }
-    pol = ksu_dup_sepolicy(rcu_dereference_protected(old_pol, lockdep_is_held(&selinux_state.policy_mutex)));
+    // record the stock state of what the rules below change for selinux_hide
+    ksu_hidden_policy_init(rcu_dereference_protected(old_pol, lockdep_is_held(&selinux_state.policy_mutex)));
+    pol = ksu_clone_sepolicy(rcu_dereference_protected(old_pol, lockdep_is_held(&selinux_state.policy_mutex)));
     if (IS_ERR(pol)) {
-        pr_err("failed to dup selinux_policy: %ld\n", PTR_ERR(pol));
+        pr_err("failed to clone selinux_policy: %ld\n", PTR_ERR(pol));
         goto out_unlock;
     }
 
@@ -157,14 +176,19 @@ void apply_kernelsu_rules()
 
     rcu_assign_pointer(selinux_state.policy, pol);
     synchronize_rcu();
-    ksu_destroy_sepolicy(old_pol);
+    // pol now owns everything it shared with old_pol
+    ksu_release_sepolicy_clone(old_pol);
 
     reset_avc_cache();
+    ksu_sid_cache_invalidate();
 out_unlock:
     mutex_unlock(&selinux_state.policy_mutex);
 }
 
 #define KSU_SEPOLICY_MAX_BATCH_SIZE (8U * 1024U * 1024U)
+// Payloads are copied from userspace and applied in chunks of this size, so
+// peak memory does not grow with the payload. A record must fit in one.
+#define KSU_SEPOLICY_CHUNK_SIZE (64U * 1024U)
 #define KSU_SEPOLICY_MAX_ARGS 5
 
 struct sepol_data {
@@ -182,10 +206,11 @@ static size_t sepol_remaining(const struct sepol_batch_cursor *cursor)
     return (size_t)(cursor->end - cursor->cur);
 }
 
+// The readers return -ENODATA when the record continues past the cursor end
 static int sepol_read_cmd_header(struct sepol_batch_cursor *cursor, struct sepol_data *header)
 {
     if (sepol_remaining(cursor) < sizeof(*header)) {
-        return -EINVAL;
+        return -ENODATA;
     }
 
     memcpy(header, cursor->cur, sizeof(*header));
@@ -200,14 +225,14 @@ static int sepol_read_string(struct sepol_batch_cursor *cursor, const char **out
     const char *str;
 
     if (sepol_remaining(cursor) < sizeof(len)) {
-        return -EINVAL;
+        return -ENODATA;
     }
 
     memcpy(&len, cursor->cur, sizeof(len));
     cursor->cur += sizeof(len);
 
     if (len >= sepol_remaining(cursor)) {
-        return -EINVAL;
+        return len >= KSU_SEPOLICY_CHUNK_SIZE ? -E2BIG : -ENODATA;
     }
 
     str = (const char *)cursor->cur;
@@ -429,105 +454,422 @@ static int apply_one_sepolicy_cmd(struct policydb *db, const struct sepol_data *
     }
 }
 
-int handle_sepolicy(void __user *user_data, u64 data_len)
+// Number of types and attributes declared by a validated batch, so the
+// type arrays can be sized once before applying it
+static u32 sepol_count_type_decls(const u8 *payload, size_t len)
 {
-    struct selinux_policy *pol, *old_pol;
-    struct policydb *db;
-    struct sepol_batch_cursor cursor;
-    u8 *payload;
-    int ret;
-    int success_cmd_count;
-    u32 cmd_index;
-
-    if (!user_data || !data_len) {
-        return -EINVAL;
-    }
-
-    if (data_len > KSU_SEPOLICY_MAX_BATCH_SIZE) {
-        return -E2BIG;
-    }
+    struct sepol_batch_cursor cursor = { .cur = payload, .end = payload + len };
+    struct sepol_data header;
+    const char *arg;
+    u32 count = 0;
+    int argc;
 
-    payload = kvmalloc((size_t)data_len, GFP_KERNEL);
-    if (!payload) {
-        return -ENOMEM;
-    }
-
-    if (copy_from_user(payload, user_data, (size_t)data_len)) {
-        ret = -EFAULT;
-        goto out_free;
-    }
-
-    if (!getenforce()) {
-        pr_info("SELinux permissive or disabled when handle policy!\n");
+    while (cursor.cur < cursor.end) {
+        if (sepol_read_cmd_header(&cursor, &header) < 0)
+            break;
+        argc = sepol_expected_argc(header.cmd);
+        while (argc-- > 0) {
+            if (sepol_read_string(&cursor, &arg) < 0)
+                return count;
+        }
+        if (header.cmd == KSU_SEPOLICY_CMD_TYPE || header.cmd == KSU_SEPOLICY_CMD_ATTR)
+            count++;
     }
+    return count;
+}
 
-    mutex_lock(&selinux_state.policy_mutex);
+// Parse the records of @payload and apply them to @db unless NULL. A record
+// cut by the end of @payload is left for the next chunk unless @last.
+// Returns the bytes consumed, or a negative errno with
+// progress->error_offset set to the offending record.
+static ssize_t apply_sepolicy_records(struct policydb *db, const u8 *payload, size_t len, bool last,
+                                      struct ksu_sepolicy_progress *progress)
+{
+    struct sepol_batch_cursor cursor = { .cur = payload, .end = payload + len };
+    const u8 *record;
+    u32 type_decls;
+    int ret;
 
-    old_pol = selinux_state.policy;
-    pol = ksu_dup_sepolicy(rcu_dereference_protected(old_pol, lockdep_is_held(&selinux_state.policy_mutex)));
-    if (IS_ERR(pol)) {
-        ret = PTR_ERR(pol);
-        pr_err("ksu_dup_sepolicy err: %d\n", ret);
-        goto out_unlock;
+    if (db) {
+        // best effort, add_type grows the arrays on demand anyway
+        type_decls = sepol_count_type_decls(payload, len);
+        if (type_decls)
+            ksu_reserve_types(db, type_decls);
     }
-    db = &pol->policydb;
 
-    cursor.cur = payload;
-    cursor.end = payload + (size_t)data_len;
-
-    ret = 0;
-    success_cmd_count = 0;
-    cmd_index = 0;
     while (cursor.cur < cursor.end) {
         struct sepol_data header;
         const char *args[KSU_SEPOLICY_MAX_ARGS] = { 0 };
         int expected_argc;
         u32 arg_index;
 
+        record = cursor.cur;
         ret = sepol_read_cmd_header(&cursor, &header);
-        if (ret < 0) {
-            pr_err("sepol: failed to read cmd header #%u.\n", cmd_index);
-            goto out_drop_new_policy;
-        }
+        if (ret < 0)
+            goto bad_record;
 
         expected_argc = sepol_expected_argc(header.cmd);
         if (expected_argc < 0 || expected_argc > KSU_SEPOLICY_MAX_ARGS) {
             ret = -EINVAL;
-            pr_err("sepol: invalid cmd header #%u.\n", cmd_index);
-            goto out_drop_new_policy;
+            goto bad_record;
         }
 
         for (arg_index = 0; arg_index < (u32)expected_argc; arg_index++) {
             ret = sepol_read_string(&cursor, &args[arg_index]);
+            if (ret < 0)
+                goto bad_record;
+        }
+
+        if (db) {
+            ret = apply_one_sepolicy_cmd(db, &header, args);
             if (ret < 0) {
-                pr_err("sepol: failed to read cmd #%u arg #%u.\n", cmd_index, arg_index);
-                goto out_drop_new_policy;
+                pr_err("sepol: cmd #%u failed, cmd=%u subcmd=%u.\n", progress->records, header.cmd, header.subcmd);
+                if (!progress->failed++)
+                    progress->error_offset = progress->consumed + (record - payload);
+            } else {
+                progress->applied++;
             }
         }
+        progress->records++;
+    }
 
-        ret = apply_one_sepolicy_cmd(db, &header, args);
-        if (ret < 0) {
-            pr_err("sepol: cmd #%u failed, cmd=%u subcmd=%u.\n", cmd_index, header.cmd, header.subcmd);
+    return len;
+
+bad_record:
+    if (ret == -ENODATA && !last)
+        return record - payload;
+    pr_err("sepol: malformed cmd #%u at offset %llu: %d.\n", progress->records,
+           progress->consumed + (record - payload), ret);
+    if (!progress->failed++)
+        progress->error_offset = progress->consumed + (record - payload);
+    return ret == -ENODATA ? -EINVAL : ret;
+}
+
+// A private copy of the policy being patched. It shares unmodified parts with
+// @base, so it may only be touched under policy_mutex while @base is live.
+struct sepolicy_target {
+    struct policydb *db;
+    struct selinux_policy *base;
+    u32 base_seqno;
+    struct ksu_sepolicy_changes *changes;
+};
+
+// Caller holds policy_mutex
+static bool sepolicy_base_live(struct selinux_policy *base, u32 base_seqno)
+{
+    struct selinux_policy *live =
+        rcu_dereference_protected(selinux_state.policy, lockdep_is_held(&selinux_state.policy_mutex));
+
+    return live == base && live->latest_granting == base_seqno;
+}
+
+// Copy @len bytes of records from @data chunk by chunk and apply them to
+// @target, or only validate them if NULL. Chunks are copied outside
+// policy_mutex, a slow or faulting buffer must not stall policy loads.
+// Returns -EAGAIN if the base policy was replaced meanwhile.
+static int stream_sepolicy(const struct sepolicy_target *target, const u8 __user *data, u64 len,
+                           struct ksu_sepolicy_progress *progress)
+{
+    size_t fill = 0, n;
+    u64 pos = 0;
+    ssize_t used;
+    int ret = 0;
+    u8 *buf;
+
+    buf = kvmalloc(KSU_SEPOLICY_CHUNK_SIZE, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    while (pos < len || fill) {
+        n = min_t(u64, KSU_SEPOLICY_CHUNK_SIZE - fill, len - pos);
+        if (copy_from_user(buf + fill, data + pos, n)) {
+            ret = -EFAULT;
+            break;
+        }
+        fill += n;
+        pos += n;
+
+        if (target) {
+            mutex_lock(&selinux_state.policy_mutex);
+            if (!sepolicy_base_live(target->base, target->base_seqno)) {
+                mutex_unlock(&selinux_state.policy_mutex);
+                ret = -EAGAIN;
+                break;
+            }
+            ksu_sepolicy_track_changes(target->changes);
+            used = apply_sepolicy_records(target->db, buf, fill, pos == len, progress);
+            ksu_sepolicy_track_changes(NULL);
+            mutex_unlock(&selinux_state.policy_mutex);
         } else {
-            success_cmd_count++;
+            used = apply_sepolicy_records(NULL, buf, fill, pos == len, progress);
+        }
+        if (used < 0) {
+            ret = used;
+            break;
+        }
+        if (!used && fill == KSU_SEPOLICY_CHUNK_SIZE) {
+            pr_err("sepol: cmd #%u exceeds %u bytes.\n", progress->records, KSU_SEPOLICY_CHUNK_SIZE);
+            if (!progress->failed++)
+                progress->error_offset = progress->consumed;
+            ret = -E2BIG;
+            break;
         }
-        cmd_index++;
+        memmove(buf, buf + used, fill - used);
+        fill -= used;
+        progress->consumed += used;
     }
 
+    kvfree(buf);
+    return ret;
+}
+
+// Publish @pol, a clone of the live policy, caller holds policy_mutex
+static void publish_sepolicy(struct selinux_policy *pol, struct ksu_sepolicy_changes *changes)
+{
+    struct selinux_policy *old_pol =
+        rcu_dereference_protected(selinux_state.policy, lockdep_is_held(&selinux_state.policy_mutex));
+
     rcu_assign_pointer(selinux_state.policy, pol);
     synchronize_rcu();
-    ksu_destroy_sepolicy(old_pol);
+    ksu_release_sepolicy_clone(old_pol);
 
-    reset_avc_cache();
-    ret = success_cmd_count;
-    goto out_unlock;
+    invalidate_avc(pol, changes);
+    ksu_sid_cache_invalidate();
+}
 
-out_drop_new_policy:
-    ksu_destroy_sepolicy(pol);
-out_unlock:
+// A sepolicy transaction stages batches on one private copy of the policy
+// and publishes it once on commit. It is owned by the thread group that
+// began it; other callers get -EBUSY until it is committed or aborted.
+struct sepolicy_txn {
+    struct selinux_policy *staged;
+    // live policy the copy was made from, to detect reloads before commit
+    struct selinux_policy *base;
+    u32 base_seqno;
+    struct pid *owner;
+    u32 batches;
+    int applied;
+    struct ksu_sepolicy_changes changes;
+};
+
+static DEFINE_MUTEX(sepolicy_txn_lock);
+static struct sepolicy_txn txn;
+
+static void txn_drop_locked(void)
+{
+    if (txn.staged)
+        ksu_release_sepolicy_clone(txn.staged);
+    ebitmap_destroy(&txn.changes.types);
+    put_pid(txn.owner);
+    memset(&txn, 0, sizeof(txn));
+}
+
+// Returns true if the caller may use the open transaction. A transaction
+// left behind by an exited owner is dropped here.
+static bool txn_owned_by_current_locked(void)
+{
+    struct task_struct *owner;
+    bool alive;
+
+    if (!txn.staged)
+        return false;
+
+    if (txn.owner == task_tgid(current))
+        return true;
+
+    rcu_read_lock();
+    owner = pid_task(txn.owner, PIDTYPE_PID);
+    alive = owner && !(owner->flags & PF_EXITING);
+    rcu_read_unlock();
+    if (!alive) {
+        pr_warn("sepol: dropping transaction of exited owner, %u batches lost\n", txn.batches);
+        txn_drop_locked();
+    }
+    return false;
+}
+
+// The staged copy shares unmodified parts with its base, so it is only
+// usable while the base is still live. Caller holds policy_mutex.
+static bool txn_base_live_locked(void)
+{
+    return sepolicy_base_live(txn.base, txn.base_seqno);
+}
+
+static int txn_begin_locked(void)
+{
+    struct selinux_policy *pol, *live;
+
+    txn_owned_by_current_locked();
+    if (txn.staged)
+        return -EBUSY;
+
+    mutex_lock(&selinux_state.policy_mutex);
+    live = rcu_dereference_protected(selinux_state.policy, lockdep_is_held(&selinux_state.policy_mutex));
+    pol = ksu_clone_sepolicy(live);
+    if (!IS_ERR(pol)) {
+        txn.base = live;
+        txn.base_seqno = live->latest_granting;
+    }
+    mutex_unlock(&selinux_state.policy_mutex);
+
+    if (IS_ERR(pol)) {
+        pr_err("sepol: transaction clone policy err: %ld\n", PTR_ERR(pol));
+        return PTR_ERR(pol);
+    }
+
+    txn.staged = pol;
+    txn.owner = get_pid(task_tgid(current));
+    pr_info("sepol: transaction begin by %d\n", task_tgid_nr(current));
+    return 0;
+}
+
+static int txn_commit_locked(void)
+{
+    int ret;
+
+    if (!txn_owned_by_current_locked())
+        return -ENOENT;
+
+    mutex_lock(&selinux_state.policy_mutex);
+    if (!txn_base_live_locked()) {
+        // policy reloaded meanwhile, the staged copy is stale
+        mutex_unlock(&selinux_state.policy_mutex);
+        pr_err("sepol: policy changed during transaction, dropping %u batches\n", txn.batches);
+        txn_drop_locked();
+        return -EAGAIN;
+    }
+    publish_sepolicy(txn.staged, &txn.changes);
     mutex_unlock(&selinux_state.policy_mutex);
-out_free:
-    kvfree(payload);
+
+    pr_info("sepol: transaction committed, batches: %u, applied: %d\n", txn.batches, txn.applied);
+    ret = txn.applied;
+    // now owned by selinux_state
+    txn.staged = NULL;
+    txn_drop_locked();
+    return ret;
+}
+
+int ksu_sepolicy_txn(u32 operation)
+{
+    int ret;
+
+    mutex_lock(&sepolicy_txn_lock);
+    if (operation == KSU_SEPOLICY_TXN_BEGIN) {
+        ret = txn_begin_locked();
+    } else if (operation == KSU_SEPOLICY_TXN_COMMIT) {
+        ret = txn_commit_locked();
+    } else if (operation == KSU_SEPOLICY_TXN_ABORT) {
+        if (txn_owned_by_current_locked()) {
+            pr_info("sepol: transaction aborted, %u batches dropped\n", txn.batches);
+            txn_drop_locked();
+            ret = 0;
+        } else {
+            ret = -ENOENT;
+        }
+    } else {
+        ret = -EINVAL;
+    }
+    mutex_unlock(&sepolicy_txn_lock);
+
+    return ret;
+}
+
+int handle_sepolicy(void __user *user_data, u64 data_len, struct ksu_sepolicy_progress *progress)
+{
+    struct ksu_sepolicy_progress check = { .error_offset = data_len };
+    struct ksu_sepolicy_changes changes = {};
+    struct sepolicy_target target;
+    struct selinux_policy *pol, *old_pol;
+    int ret;
+
+    memset(progress, 0, sizeof(*progress));
+    progress->error_offset = data_len;
+
+    if (!user_data || !data_len) {
+        return -EINVAL;
+    }
+
+    if (data_len > KSU_SEPOLICY_MAX_BATCH_SIZE) {
+        return -E2BIG;
+    }
+
+    if (!getenforce()) {
+        pr_info("SELinux permissive or disabled when handle policy!\n");
+    }
+
+    mutex_lock(&sepolicy_txn_lock);
+    if (txn_owned_by_current_locked()) {
+        // validate first, a malformed batch must not touch the staged copy
+        ret = stream_sepolicy(NULL, user_data, data_len, &check);
+        if (ret < 0) {
+            *progress = check;
+            goto out_txn_unlock;
+        }
+
+        // stage only, published on commit
+        target = (struct sepolicy_target){
+            .db = &txn.staged->policydb,
+            .base = txn.base,
+            .base_seqno = txn.base_seqno,
+            .changes = &txn.changes,
+        };
+        ret = stream_sepolicy(&target, user_data, data_len, progress);
+        if (ret == -EAGAIN) {
+            pr_err("sepol: policy changed during transaction, dropping %u batches\n", txn.batches);
+            txn_drop_locked();
+            goto out_txn_unlock;
+        } else if (ret < 0) {
+            // the payload changed under us and the staged copy is half patched
+            pr_err("sepol: batch changed while applied, dropping %u batches\n", txn.batches);
+            txn_drop_locked();
+            goto out_txn_unlock;
+        }
+        txn.applied += progress->applied;
+        txn.batches++;
+        ret = progress->applied;
+        goto out_txn_unlock;
+    }
+    if (txn.staged) {
+        ret = -EBUSY;
+        goto out_txn_unlock;
+    }
+
+    mutex_lock(&selinux_state.policy_mutex);
+    old_pol = rcu_dereference_protected(selinux_state.policy, lockdep_is_held(&selinux_state.policy_mutex));
+    pol = ksu_clone_sepolicy(old_pol);
+    if (IS_ERR(pol)) {
+        mutex_unlock(&selinux_state.policy_mutex);
+        ret = PTR_ERR(pol);
+        pr_err("ksu_clone_sepolicy err: %d\n", ret);
+        goto out_txn_unlock;
+    }
+    target = (struct sepolicy_target){
+        .db = &pol->policydb,
+        .base = old_pol,
+        .base_seqno = old_pol->latest_granting,
+        .changes = &changes,
+    };
+    mutex_unlock(&selinux_state.policy_mutex);
+
+    ebitmap_init(&changes.types);
+    ret = stream_sepolicy(&target, user_data, data_len, progress);
+
+    mutex_lock(&selinux_state.policy_mutex);
+    if (ret >= 0 && !sepolicy_base_live(old_pol, target.base_seqno))
+        ret = -EAGAIN;
+    if (ret < 0) {
+        // nothing of a malformed payload is published
+        if (ret == -EAGAIN)
+            pr_err("sepol: policy changed while applied, batch dropped\n");
+        ksu_release_sepolicy_clone(pol);
+    } else {
+        publish_sepolicy(pol, &changes);
+        ret = progress->applied;
+    }
+    mutex_unlock(&selinux_state.policy_mutex);
+    ebitmap_destroy(&changes.types);
+
+out_txn_unlock:
+    mutex_unlock(&sepolicy_txn_lock);
 
     return ret;
 }
@@ -1,6 +1,13 @@
 #include "selinux.h"
 #include "linux/cred.h"
 #include "linux/sched.h"
+#include <linux/atomic.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/stringhash.h>
+#include "security.h"
 #include "objsec.h"
 #include "linux/version.h"
 #include "klog.h" // IWYU pragma: keep
@@ -23,6 +30,124 @@ static u32 cached_zygote_sid __read_mostly = 0;
 static u32 cached_init_sid __read_mostly = 0;
 u32 ksu_file_sid __read_mostly = 0;
 
+/*
+ * Context string -> SID cache shared by every domain transition.
+ * An entry is valid only under the policy seqno and the epoch it was
+ * resolved in; real policy loads move the seqno and KernelSU's own
+ * patching bumps the epoch. Stale entries are replaced on their next
+ * miss, and the table is emptied once it holds SID_CACHE_MAX entries.
+ */
+#define SID_CACHE_BITS 4
+#define SID_CACHE_MAX 64
+
+struct sid_cache_entry {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    u32 hash;
+    u32 sid;
+    u32 seqno;
+    u32 epoch;
+    char context[];
+};
+
+static DEFINE_HASHTABLE(sid_cache, SID_CACHE_BITS);
+static DEFINE_SPINLOCK(sid_cache_lock);
+static atomic_t sid_cache_epoch = ATOMIC_INIT(0);
+static u32 sid_cache_count;
+
+static u32 policy_seqno(void)
+{
+    u32 seqno;
+
+    rcu_read_lock();
+    seqno = rcu_dereference(selinux_state.policy)->latest_granting;
+    rcu_read_unlock();
+    return seqno;
+}
+
+static void sid_cache_clear_locked(void)
+{
+    struct sid_cache_entry *e;
+    struct hlist_node *tmp;
+    int bkt;
+
+    hash_for_each_safe (sid_cache, bkt, tmp, e, node) {
+        hash_del_rcu(&e->node);
+        kfree_rcu(e, rcu);
+    }
+    sid_cache_count = 0;
+}
+
+static void sid_cache_insert(const char *context, u32 len, u32 hash, u32 sid, u32 seqno, u32 epoch)
+{
+    struct sid_cache_entry *e, *old;
+    struct hlist_node *tmp;
+
+    e = kmalloc(sizeof(*e) + len + 1, GFP_KERNEL);
+    if (!e)
+        return;
+    e->hash = hash;
+    e->sid = sid;
+    e->seqno = seqno;
+    e->epoch = epoch;
+    memcpy(e->context, context, len + 1);
+
+    spin_lock(&sid_cache_lock);
+    hash_for_each_possible_safe (sid_cache, old, tmp, node, hash) {
+        if (old->hash == hash && !strcmp(old->context, context)) {
+            hash_del_rcu(&old->node);
+            kfree_rcu(old, rcu);
+            sid_cache_count--;
+        }
+    }
+    if (sid_cache_count >= SID_CACHE_MAX)
+        sid_cache_clear_locked();
+    hash_add_rcu(sid_cache, &e->node, hash);
+    sid_cache_count++;
+    spin_unlock(&sid_cache_lock);
+}
+
+int ksu_context_to_sid(const char *context, u32 *sid)
+{
+    struct sid_cache_entry *e;
+    u32 len = strlen(context);
+    u32 hash = full_name_hash(NULL, context, len);
+    u32 seqno = policy_seqno();
+    u32 epoch = atomic_read(&sid_cache_epoch);
+    int err;
+
+    rcu_read_lock();
+    hash_for_each_possible_rcu (sid_cache, e, node, hash) {
+        if (e->hash == hash && e->seqno == seqno && e->epoch == epoch && !strcmp(e->context, context)) {
+            *sid = e->sid;
+            rcu_read_unlock();
+            return 0;
+        }
+    }
+    rcu_read_unlock();
+
+    err = security_secctx_to_secid(context, len, sid);
+    if (err)
+        return err;
+
+    // a load or patch racing with the lookup leaves a stale entry behind
+    sid_cache_insert(context, len, hash, *sid, seqno, epoch);
+    return 0;
+}
+
+void ksu_sid_cache_invalidate(void)
+{
+    atomic_inc(&sid_cache_epoch);
+}
+
+void ksu_sid_cache_exit(void)
+{
+    spin_lock(&sid_cache_lock);
+    sid_cache_clear_locked();
+    spin_unlock(&sid_cache_lock);
+    rcu_barrier();
+}
+
 static int transive_to_domain(const char *domain, struct cred *cred, bool clear_exec_sid)
 {
     u32 sid;
@@ -37,7 +162,7 @@ static int transive_to_domain(const char *domain, struct cred *cred, bool clear_
         pr_err("tsec == NULL!\n");
         return -1;
     }
-    error = security_secctx_to_secid(domain, strlen(domain), &sid);
+    error = ksu_context_to_sid(domain, &sid);
     if (error) {
         pr_info("security_secctx_to_secid %s -> sid: %d, error: %d\n", domain, sid, error);
     }
@@ -118,7 +243,7 @@ void cache_sid(void)
 {
     int err;
 
-    err = security_secctx_to_secid(KERNEL_SU_CONTEXT, strlen(KERNEL_SU_CONTEXT), &cached_su_sid);
+    err = ksu_context_to_sid(KERNEL_SU_CONTEXT, &cached_su_sid);
     if (err) {
         pr_warn("Failed to cache kernel su domain SID: %d\n", err);
         cached_su_sid = 0;
@@ -126,7 +251,7 @@ void cache_sid(void)
         pr_info("Cached su SID: %u\n", cached_su_sid);
     }
 
-    err = security_secctx_to_secid(ZYGOTE_CONTEXT, strlen(ZYGOTE_CONTEXT), &cached_zygote_sid);
+    err = ksu_context_to_sid(ZYGOTE_CONTEXT, &cached_zygote_sid);
     if (err) {
         pr_warn("Failed to cache zygote SID: %d\n", err);
         cached_zygote_sid = 0;
@@ -134,7 +259,7 @@ void cache_sid(void)
         pr_info("Cached zygote SID: %u\n", cached_zygote_sid);
     }
 
-    err = security_secctx_to_secid(INIT_CONTEXT, strlen(INIT_CONTEXT), &cached_init_sid);
+    err = ksu_context_to_sid(INIT_CONTEXT, &cached_init_sid);
     if (err) {
         pr_warn("Failed to cache init SID: %d\n", err);
         cached_init_sid = 0;
@@ -142,7 +267,7 @@ void cache_sid(void)
         pr_info("Cached init SID: %u\n", cached_init_sid);
     }
 
-    err = security_secctx_to_secid(KSU_FILE_CONTEXT, strlen(KSU_FILE_CONTEXT), &ksu_file_sid);
+    err = ksu_context_to_sid(KSU_FILE_CONTEXT, &ksu_file_sid);
     if (err) {
         pr_warn("Failed to cache ksu_file SID: %d\n", err);
         ksu_file_sid = 0;
@@ -21,6 +21,15 @@ bool getenforce();
 
 void cache_sid(void);
 
+// Resolve @context through the SID cache, the cost of a hash lookup once
+// resolved. Returns the error of security_secctx_to_secid() on failure.
+int ksu_context_to_sid(const char *context, u32 *sid);
+
+// Called after KernelSU publishes a patched policy
+void ksu_sid_cache_invalidate(void);
+
+void ksu_sid_cache_exit(void);
+
 bool is_task_ksu_domain(const struct cred *cred);
 
 bool is_ksu_domain();
@@ -31,7 +40,20 @@ bool is_init(const struct cred *cred);
 
 void apply_kernelsu_rules();
 
-int handle_sepolicy(void __user *user_data, u64 data_len);
+// Where a sepolicy payload stopped, filled by handle_sepolicy()
+struct ksu_sepolicy_progress {
+    u64 consumed; // bytes of complete records parsed
+    u64 error_offset; // first record that failed to parse or apply, data_len if none
+    u32 records;
+    u32 applied;
+    u32 failed;
+};
+
+// Returns the number of applied commands
+int handle_sepolicy(void __user *user_data, u64 data_len, struct ksu_sepolicy_progress *progress);
+
+// KSU_SEPOLICY_TXN_* operation, commit returns the number of applied commands
+int ksu_sepolicy_txn(u32 operation);
 
 void setup_ksu_cred();
 
@@ -5,12 +5,15 @@
 #include "ss/policydb.h"
 #include "ss/services.h"
 #include <linux/gfp.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/printk.h>
 #include <linux/slab.h>
 #include <linux/version.h>
 #include <linux/vmalloc.h>
 
 #include "sepolicy.h"
+#include "hidden_policy.h"
 #include "klog.h" // IWYU pragma: keep
 #include "ss/symtab.h"
 
@@ -27,6 +30,17 @@ static bool is_redundant_avtab_node(struct avtab_node *node);
 
 static bool remove_avtab_node(struct policydb *db, struct avtab_node *node);
 
+static int clone_avtab(struct avtab *dst, struct avtab *src, u32 nrules);
+
+static void reserve_avtab(struct policydb *db, u64 extra);
+
+static int expand_types(struct policydb *db, struct type_datum *type, bool all, struct ebitmap *out);
+
+static int expand_classes(struct policydb *db, struct class_datum *cls, struct ebitmap *out);
+
+static bool add_avrule(struct policydb *db, u32 src, u32 tgt, u32 cls, struct perm_datum *perm, int effect,
+                       bool invert);
+
 static bool add_rule(struct policydb *db, const char *s, const char *t, const char *c, const char *p, int effect,
                      bool invert);
 
@@ -35,6 +49,8 @@ static bool add_rule_raw(struct policydb *db, struct type_datum *src, struct typ
 
 static void add_xperm_rule_raw(struct policydb *db, struct type_datum *src, struct type_datum *tgt,
                                struct class_datum *cls, uint16_t low, uint16_t high, int effect, bool invert);
+static void add_xperm_avrule(struct policydb *db, u32 src, u32 tgt, u32 cls, uint16_t low, uint16_t high, int effect,
+                             bool invert);
 static bool add_xperm_rule(struct policydb *db, const char *s, const char *t, const char *c, const char *range,
                            int effect, bool invert);
 
@@ -83,6 +99,53 @@ static bool add_typeattribute(struct policydb *db, const char *type, const char
 
 #define avtab_for_each(avtab, cur) ksu_hash_for_each(avtab.htable, avtab.nslot, cur);
 
+static struct ksu_sepolicy_changes *tracked_changes;
+
+void ksu_sepolicy_track_changes(struct ksu_sepolicy_changes *changes)
+{
+    tracked_changes = changes;
+}
+
+static void touch_type(u32 value)
+{
+    if (!tracked_changes || tracked_changes->all)
+        return;
+    if (ebitmap_set_bit(&tracked_changes->types, value - 1, 1))
+        tracked_changes->all = true;
+}
+
+static void touch_all_types(void)
+{
+    if (tracked_changes)
+        tracked_changes->all = true;
+}
+
+u32 ksu_sepolicy_affected_types(struct policydb *db, struct ksu_sepolicy_changes *changes, struct ebitmap *out,
+                                u32 max)
+{
+    struct ebitmap_node *node;
+    unsigned int bit;
+    u32 count = 0;
+    u32 i;
+
+    ebitmap_init(out);
+    if (changes->all)
+        return U32_MAX;
+
+    // type_attr_map_array[i] holds type i and its attributes
+    for (i = 0; i < db->p_types.nprim; i++) {
+        ebitmap_for_each_positive_bit(&changes->types, node, bit)
+        {
+            if (!ebitmap_get_bit(&db->type_attr_map_array[i], bit))
+                continue;
+            if (++count > max || ebitmap_set_bit(out, i, 1))
+                return U32_MAX;
+            break;
+        }
+    }
+    return count;
+}
+
 static struct avtab_node *get_avtab_node(struct policydb *db, struct avtab_key *key,
                                          struct avtab_extended_perms *xperms)
 {
@@ -146,48 +209,179 @@ static bool is_redundant_avtab_node(struct avtab_node *node)
     return node->datum.u.data == 0U;
 }
 
-static bool remove_avtab_node(struct policydb *db, struct avtab_node *node)
+// Same as avtab_hash() in avtab.c, which is private. The result is only a
+// hint: remove_avtab_node() falls back to a full scan on a miss.
+static u32 avtab_key_hash(const struct avtab_key *key, u32 mask)
 {
+    static const u32 c1 = 0xcc9e2d51;
+    static const u32 c2 = 0x1b873593;
+    static const u32 r1 = 15;
+    static const u32 r2 = 13;
+    static const u32 m = 5;
+    static const u32 n = 0xe6546b64;
+    const u32 input[] = { key->target_class, key->target_type, key->source_type };
+    u32 hash = 0;
     int i;
-    int ret;
+
+    for (i = 0; i < ARRAY_SIZE(input); i++) {
+        u32 v = input[i];
+
+        v *= c1;
+        v = (v << r1) | (v >> (32 - r1));
+        v *= c2;
+        hash ^= v;
+        hash = (hash << r2) | (hash >> (32 - r2));
+        hash = hash * m + n;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash & mask;
+}
+
+static bool unlink_avtab_node(struct avtab *h, u32 slot, struct avtab_node *node)
+{
+    struct avtab_node **pp;
+
+    for (pp = &h->htable[slot]; *pp; pp = &(*pp)->next) {
+        if (*pp != node)
+            continue;
+        *pp = node->next;
+        node->next = NULL;
+        if (h->nel > 0)
+            h->nel--;
+        return true;
+    }
+    return false;
+}
+
+static bool remove_avtab_node(struct policydb *db, struct avtab_node *node)
+{
+    struct avtab *h = &db->te_avtab;
     int shrink_size = sizeof(struct avtab_key) + sizeof(struct avtab_datum);
     struct avtab removed = {};
-    struct avtab_node *n;
-    struct avtab_node *prev;
+    bool found;
+    u32 i;
 
-    ret = avtab_alloc(&removed, 1);
-    if (ret < 0)
+    if (!h->nslot)
         return false;
 
-    for (i = 0; i < db->te_avtab.nslot; i++) {
-        prev = NULL;
-        for (n = db->te_avtab.htable[i]; n; prev = n, n = n->next) {
-            if (n != node)
-                continue;
+    found = unlink_avtab_node(h, avtab_key_hash(&node->key, h->mask), node);
+    for (i = 0; !found && i < h->nslot; i++)
+        found = unlink_avtab_node(h, i, node);
+    if (!found)
+        return false;
 
-            if (prev)
-                prev->next = n->next;
-            else
-                db->te_avtab.htable[i] = n->next;
+    if ((node->key.specified & AVTAB_XPERMS) && node->datum.u.xperms) {
+        shrink_size += sizeof(u8) + sizeof(u8) + sizeof(u32) * ARRAY_SIZE(node->datum.u.xperms->perms.p);
+    }
+    if (db->len >= shrink_size)
+        db->len -= shrink_size;
 
-            if (db->te_avtab.nel > 0)
-                db->te_avtab.nel--;
+    // nodes come from the private avtab cache, free it through a one slot table
+    if (avtab_alloc(&removed, 1) < 0) {
+        pr_warn("sepolicy: leaking removed avtab node\n");
+        return true;
+    }
+    removed.htable[0] = node;
+    removed.nel = 1;
+    avtab_destroy(&removed);
+    return true;
+}
 
-            if ((n->key.specified & AVTAB_XPERMS) && n->datum.u.xperms) {
-                shrink_size += sizeof(u8) + sizeof(u8) + sizeof(u32) * ARRAY_SIZE(n->datum.u.xperms->perms.p);
-            }
-            n->next = NULL;
-            removed.htable[0] = n;
-            removed.nel = 1;
-            avtab_destroy(&removed);
-            if (db->len >= shrink_size)
-                db->len -= shrink_size;
-            return true;
-        }
+static int clone_avtab(struct avtab *dst, struct avtab *src, u32 nrules)
+{
+    struct avtab_node *cur;
+    int ret;
+
+    avtab_init(dst);
+    ret = avtab_alloc(dst, nrules);
+    if (ret)
+        return ret;
+
+    ksu_hash_for_each(src->htable, src->nslot, cur)
+    {
+        // xperms are duplicated by the insert
+        if (!avtab_insert_nonunique(dst, &cur->key, &cur->datum))
+            return -ENOMEM;
     }
+    return 0;
+}
 
-    avtab_destroy(&removed);
-    return false;
+// te_avtab is sized for the policy it was loaded from. Before a bulk
+// insert of up to @extra nodes, rehash it into a table sized for the result
+// so the chains stay short. This is best effort, on failure the old table is
+// kept.
+#define KSU_AVTAB_MAX_LOAD 4
+
+static void reserve_avtab(struct policydb *db, u64 extra)
+{
+    struct avtab *h = &db->te_avtab;
+    struct avtab grown;
+    u64 want = h->nel + extra;
+
+    if (h->nslot >= MAX_AVTAB_HASH_BUCKETS || want <= (u64)h->nslot * KSU_AVTAB_MAX_LOAD)
+        return;
+
+    if (clone_avtab(&grown, h, min_t(u64, want, U32_MAX))) {
+        avtab_destroy(&grown);
+        return;
+    }
+    if (grown.nslot <= h->nslot) {
+        avtab_destroy(&grown);
+        return;
+    }
+
+    pr_info("sepolicy: avtab rehashed from %u to %u slots, %u rules + %llu\n", h->nslot, grown.nslot, h->nel,
+            extra);
+    avtab_destroy(h);
+    *h = grown;
+}
+
+// Expand @type into a bitmap of type values - 1. NULL expands to every type
+// if @all, otherwise to every attribute. Returns the number of bits set.
+static int expand_types(struct policydb *db, struct type_datum *type, bool all, struct ebitmap *out)
+{
+    struct type_datum *t;
+    int count = 0;
+    u32 i;
+
+    ebitmap_init(out);
+    if (type)
+        return ebitmap_set_bit(out, type->value - 1, 1) ?: 1;
+
+    for (i = 0; i < db->p_types.nprim; i++) {
+        t = db->type_val_to_struct[i];
+        if (!t || !(all || t->attribute))
+            continue;
+        if (ebitmap_set_bit(out, i, 1))
+            return -ENOMEM;
+        count++;
+    }
+    return count;
+}
+
+static int expand_classes(struct policydb *db, struct class_datum *cls, struct ebitmap *out)
+{
+    int count = 0;
+    u32 i;
+
+    ebitmap_init(out);
+    if (cls)
+        return ebitmap_set_bit(out, cls->value - 1, 1) ?: 1;
+
+    for (i = 0; i < db->p_classes.nprim; i++) {
+        if (!db->class_val_to_struct[i])
+            continue;
+        if (ebitmap_set_bit(out, i, 1))
+            return -ENOMEM;
+        count++;
+    }
+    return count;
 }
 
 static bool add_rule(struct policydb *db, const char *s, const char *t, const char *c, const char *p, int effect,
@@ -239,83 +433,91 @@ static bool add_rule(struct policydb *db, const char *s, const char *t, const ch
     return add_rule_raw(db, src, tgt, cls, perm, effect, invert);
 }
 
+static bool add_avrule(struct policydb *db, u32 src, u32 tgt, u32 cls, struct perm_datum *perm, int effect,
+                       bool invert)
+{
+    struct avtab_key key;
+    struct avtab_node *node;
+
+    key.source_type = src;
+    key.target_type = tgt;
+    key.target_class = cls;
+    key.specified = effect;
+
+    touch_type(src);
+    touch_type(tgt);
+    ksu_hidden_record_av(db, &key);
+
+    if (invert && effect != AVTAB_AUDITDENY) {
+        node = avtab_search_node(&db->te_avtab, &key);
+        if (!node)
+            return true;
+    } else {
+        node = get_avtab_node(db, &key, NULL);
+        if (!node)
+            return false;
+    }
+
+    if (invert) {
+        if (perm)
+            node->datum.u.data &= ~(1U << (perm->value - 1));
+        else
+            node->datum.u.data = 0U;
+    } else {
+        if (perm)
+            node->datum.u.data |= 1U << (perm->value - 1);
+        else
+            node->datum.u.data = ~0U;
+    }
+    if (is_redundant_avtab_node(node))
+        return remove_avtab_node(db, node);
+
+    return true;
+}
+
+// NULL src, tgt or cls is a wildcard. They are expanded to value bitmaps
+// once, then every (src, tgt, cls) key is applied with the table presized.
 static bool add_rule_raw(struct policydb *db, struct type_datum *src, struct type_datum *tgt, struct class_datum *cls,
                          struct perm_datum *perm, int effect, bool invert)
 {
+    struct ebitmap srcs, tgts, clss;
+    struct ebitmap_node *snode, *tnode, *cnode;
+    unsigned int s, t, c;
+    bool all = strip_av(effect, invert);
     bool success = true;
+    int nsrc, ntgt, ncls;
+
+    // a type wildcard reaches most of the policy
+    if (!src || !tgt)
+        touch_all_types();
+
+    nsrc = expand_types(db, src, all, &srcs);
+    ntgt = expand_types(db, tgt, all, &tgts);
+    ncls = expand_classes(db, cls, &clss);
+    if (nsrc < 0 || ntgt < 0 || ncls < 0) {
+        success = false;
+        goto out;
+    }
 
-    if (src == NULL) {
-        struct hashtab_node *node;
-        if (strip_av(effect, invert)) {
-            ksu_hashtab_for_each(db->p_types.table, node)
-            {
-                success &= add_rule_raw(db, (struct type_datum *)node->datum, tgt, cls, perm, effect, invert);
-            };
-        } else {
-            ksu_hashtab_for_each(db->p_types.table, node)
-            {
-                struct type_datum *type = (struct type_datum *)(node->datum);
-                if (type->attribute) {
-                    success &= add_rule_raw(db, type, tgt, cls, perm, effect, invert);
-                }
-            };
-        }
-    } else if (tgt == NULL) {
-        struct hashtab_node *node;
-        if (strip_av(effect, invert)) {
-            ksu_hashtab_for_each(db->p_types.table, node)
-            {
-                success &= add_rule_raw(db, src, (struct type_datum *)node->datum, cls, perm, effect, invert);
-            };
-        } else {
-            ksu_hashtab_for_each(db->p_types.table, node)
-            {
-                struct type_datum *type = (struct type_datum *)(node->datum);
-                if (type->attribute) {
-                    success &= add_rule_raw(db, src, type, cls, perm, effect, invert);
-                }
-            };
-        }
-    } else if (cls == NULL) {
-        struct hashtab_node *node;
-        ksu_hashtab_for_each(db->p_classes.table, node)
-        {
-            success &= add_rule_raw(db, src, tgt, (struct class_datum *)node->datum, perm, effect, invert);
-        }
-    } else {
-        struct avtab_key key;
-        struct avtab_node *node;
-
-        key.source_type = src->value;
-        key.target_type = tgt->value;
-        key.target_class = cls->value;
-        key.specified = effect;
-
-        if (invert && effect != AVTAB_AUDITDENY) {
-            node = avtab_search_node(&db->te_avtab, &key);
-            if (!node)
-                return true;
-        } else {
-            node = get_avtab_node(db, &key, NULL);
-            if (!node)
-                return false;
-        }
+    // removals only shrink the table, except for dontaudit
+    if (!invert || effect == AVTAB_AUDITDENY)
+        reserve_avtab(db, (u64)nsrc * ntgt * ncls);
 
-        if (invert) {
-            if (perm)
-                node->datum.u.data &= ~(1U << (perm->value - 1));
-            else
-                node->datum.u.data = 0U;
-        } else {
-            if (perm)
-                node->datum.u.data |= 1U << (perm->value - 1);
-            else
-                node->datum.u.data = ~0U;
+    ebitmap_for_each_positive_bit(&srcs, snode, s)
+    {
+        ebitmap_for_each_positive_bit(&tgts, tnode, t)
+        {
+            ebitmap_for_each_positive_bit(&clss, cnode, c)
+            {
+                success &= add_avrule(db, s + 1, t + 1, c + 1, perm, effect, invert);
+            }
         }
-        if (is_redundant_avtab_node(node))
-            return remove_avtab_node(db, node);
     }
 
+out:
+    ebitmap_destroy(&srcs);
+    ebitmap_destroy(&tgts);
+    ebitmap_destroy(&clss);
     return success;
 }
 
@@ -329,81 +531,96 @@ static bool add_rule_raw(struct policydb *db, struct type_datum *src, struct typ
 static void add_xperm_rule_raw(struct policydb *db, struct type_datum *src, struct type_datum *tgt,
                                struct class_datum *cls, uint16_t low, uint16_t high, int effect, bool invert)
 {
-    if (src == NULL) {
-        struct hashtab_node *node;
-        ksu_hashtab_for_each(db->p_types.table, node)
-        {
-            struct type_datum *type = (struct type_datum *)(node->datum);
-            if (type->attribute) {
-                add_xperm_rule_raw(db, type, tgt, cls, low, high, effect, invert);
-            }
-        };
-    } else if (tgt == NULL) {
-        struct hashtab_node *node;
-        ksu_hashtab_for_each(db->p_types.table, node)
-        {
-            struct type_datum *type = (struct type_datum *)(node->datum);
-            if (type->attribute) {
-                add_xperm_rule_raw(db, src, type, cls, low, high, effect, invert);
-            }
-        };
-    } else if (cls == NULL) {
-        struct hashtab_node *node;
-        ksu_hashtab_for_each(db->p_classes.table, node)
+    struct ebitmap srcs, tgts, clss;
+    struct ebitmap_node *snode, *tnode, *cnode;
+    unsigned int s, t, c;
+    int nsrc, ntgt, ncls;
+
+    if (!src || !tgt)
+        touch_all_types();
+
+    nsrc = expand_types(db, src, false, &srcs);
+    ntgt = expand_types(db, tgt, false, &tgts);
+    ncls = expand_classes(db, cls, &clss);
+    if (nsrc < 0 || ntgt < 0 || ncls < 0) {
+        pr_err("add_xperm_rule_raw expand failed\n");
+        goto out;
+    }
+
+    reserve_avtab(db, (u64)nsrc * ntgt * ncls);
+
+    ebitmap_for_each_positive_bit(&srcs, snode, s)
+    {
+        ebitmap_for_each_positive_bit(&tgts, tnode, t)
         {
-            add_xperm_rule_raw(db, src, tgt, (struct class_datum *)(node->datum), low, high, effect, invert);
-        };
-    } else {
-        struct avtab_key key;
-        key.source_type = src->value;
-        key.target_type = tgt->value;
-        key.target_class = cls->value;
-        key.specified = effect;
-
-        struct avtab_datum *datum;
-        struct avtab_node *node;
-        struct avtab_extended_perms xperms;
-
-        memset(&xperms, 0, sizeof(xperms));
-        if (ioctl_driver(low) != ioctl_driver(high)) {
-            xperms.specified = AVTAB_XPERMS_IOCTLDRIVER;
-            xperms.driver = 0;
-        } else {
-            xperms.specified = AVTAB_XPERMS_IOCTLFUNCTION;
-            xperms.driver = ioctl_driver(low);
-        }
-        int i;
-        if (xperms.specified == AVTAB_XPERMS_IOCTLDRIVER) {
-            for (i = ioctl_driver(low); i <= ioctl_driver(high); ++i) {
-                if (invert)
-                    xperm_clear(i, xperms.perms.p);
-                else
-                    xperm_set(i, xperms.perms.p);
-            }
-        } else {
-            for (i = ioctl_func(low); i <= ioctl_func(high); ++i) {
-                if (invert)
-                    xperm_clear(i, xperms.perms.p);
-                else
-                    xperm_set(i, xperms.perms.p);
+            ebitmap_for_each_positive_bit(&clss, cnode, c)
+            {
+                add_xperm_avrule(db, s + 1, t + 1, c + 1, low, high, effect, invert);
             }
         }
+    }
 
-        node = get_avtab_node(db, &key, &xperms);
-        if (!node) {
-            pr_warn("add_xperm_rule_raw cannot found node!\n");
-            return;
+out:
+    ebitmap_destroy(&srcs);
+    ebitmap_destroy(&tgts);
+    ebitmap_destroy(&clss);
+}
+
+static void add_xperm_avrule(struct policydb *db, u32 src, u32 tgt, u32 cls, uint16_t low, uint16_t high, int effect,
+                             bool invert)
+{
+    struct avtab_key key;
+    key.source_type = src;
+    key.target_type = tgt;
+    key.target_class = cls;
+    key.specified = effect;
+
+    touch_type(src);
+    touch_type(tgt);
+
+    struct avtab_datum *datum;
+    struct avtab_node *node;
+    struct avtab_extended_perms xperms;
+
+    memset(&xperms, 0, sizeof(xperms));
+    if (ioctl_driver(low) != ioctl_driver(high)) {
+        xperms.specified = AVTAB_XPERMS_IOCTLDRIVER;
+        xperms.driver = 0;
+    } else {
+        xperms.specified = AVTAB_XPERMS_IOCTLFUNCTION;
+        xperms.driver = ioctl_driver(low);
+    }
+    int i;
+    if (xperms.specified == AVTAB_XPERMS_IOCTLDRIVER) {
+        for (i = ioctl_driver(low); i <= ioctl_driver(high); ++i) {
+            if (invert)
+                xperm_clear(i, xperms.perms.p);
+            else
+                xperm_set(i, xperms.perms.p);
+        }
+    } else {
+        for (i = ioctl_func(low); i <= ioctl_func(high); ++i) {
+            if (invert)
+                xperm_clear(i, xperms.perms.p);
+            else
+                xperm_set(i, xperms.perms.p);
         }
-        datum = &node->datum;
+    }
 
-        if (datum->u.xperms == NULL) {
-            datum->u.xperms = (struct avtab_extended_perms *)(kzalloc(sizeof(xperms), GFP_KERNEL));
-            if (!datum->u.xperms) {
-                pr_err("alloc xperms failed\n");
-                return;
-            }
-            memcpy(datum->u.xperms, &xperms, sizeof(xperms));
+    node = get_avtab_node(db, &key, &xperms);
+    if (!node) {
+        pr_warn("add_xperm_rule_raw cannot found node!\n");
+        return;
+    }
+    datum = &node->datum;
+
+    if (datum->u.xperms == NULL) {
+        datum->u.xperms = (struct avtab_extended_perms *)(kzalloc(sizeof(xperms), GFP_KERNEL));
+        if (!datum->u.xperms) {
+            pr_err("alloc xperms failed\n");
+            return;
         }
+        memcpy(datum->u.xperms, &xperms, sizeof(xperms));
     }
 }
 
@@ -655,6 +872,57 @@ void *ksu_kvrealloc_compat(const void *p, size_t oldsize, size_t newsize, gfp_t
 #define ksu_kvrealloc(p, new_size, old_size) ksu_kvrealloc_compat(p, old_size, new_size, GFP_KERNEL)
 #endif
 
+// The type arrays of a policy being modified hold type_capacity(nprim)
+// entries, so adding types one by one only reallocates them when the count
+// crosses a power of two.
+static u32 type_capacity(u32 nprim)
+{
+    return roundup_pow_of_two(max_t(u32, nprim, 64));
+}
+
+static int resize_type_arrays(struct policydb *db, u32 old_cap, u32 new_cap)
+{
+    struct ebitmap *new_type_attr_map_array;
+    struct type_datum **new_type_val_to_struct;
+    char **new_val_to_name_types;
+
+    new_type_attr_map_array = ksu_kvrealloc(db->type_attr_map_array, new_cap * sizeof(struct ebitmap),
+                                            old_cap * sizeof(struct ebitmap));
+    if (!new_type_attr_map_array) {
+        pr_err("add_type: alloc type_attr_map_array failed\n");
+        return -ENOMEM;
+    }
+    db->type_attr_map_array = new_type_attr_map_array;
+
+    new_type_val_to_struct = ksu_kvrealloc(db->type_val_to_struct, sizeof(*db->type_val_to_struct) * new_cap,
+                                           sizeof(*db->type_val_to_struct) * old_cap);
+    if (!new_type_val_to_struct) {
+        pr_err("add_type: alloc type_val_to_struct failed\n");
+        return -ENOMEM;
+    }
+    db->type_val_to_struct = new_type_val_to_struct;
+
+    new_val_to_name_types =
+        ksu_kvrealloc(db->sym_val_to_name[SYM_TYPES], sizeof(char *) * new_cap, sizeof(char *) * old_cap);
+    if (!new_val_to_name_types) {
+        pr_err("add_type: alloc val_to_name failed\n");
+        return -ENOMEM;
+    }
+    db->sym_val_to_name[SYM_TYPES] = new_val_to_name_types;
+
+    return 0;
+}
+
+int ksu_reserve_types(struct policydb *db, u32 count)
+{
+    u32 nprim = db->p_types.nprim;
+
+    if (type_capacity(nprim + count) <= type_capacity(nprim))
+        return 0;
+
+    return resize_type_arrays(db, type_capacity(nprim), type_capacity(nprim + count));
+}
+
 static bool add_type(struct policydb *db, const char *type_name, bool attr)
 {
     struct type_datum *type = symtab_search(&db->p_types, type_name);
@@ -663,7 +931,10 @@ static bool add_type(struct policydb *db, const char *type_name, bool attr)
         return true;
     }
 
-    u32 value = ++db->p_types.nprim;
+    u32 value = db->p_types.nprim + 1;
+    if (value > type_capacity(value - 1) && resize_type_arrays(db, type_capacity(value - 1), type_capacity(value)))
+        return false;
+
     type = (struct type_datum *)kzalloc(sizeof(struct type_datum), GFP_KERNEL);
     if (!type) {
         pr_err("add_type: alloc type_datum failed.\n");
@@ -677,47 +948,27 @@ static bool add_type(struct policydb *db, const char *type_name, bool attr)
     char *key = kstrdup(type_name, GFP_KERNEL);
     if (!key) {
         pr_err("add_type: alloc key failed.\n");
+        kfree(type);
         return false;
     }
 
     if (symtab_insert(&db->p_types, key, type)) {
         pr_err("add_type: insert symtab failed.\n");
+        kfree(key);
+        kfree(type);
         return false;
     }
 
-    struct ebitmap *new_type_attr_map_array =
-        ksu_kvrealloc(db->type_attr_map_array, value * sizeof(struct ebitmap), (value - 1) * sizeof(struct ebitmap));
-
-    if (!new_type_attr_map_array) {
-        pr_err("add_type: alloc type_attr_map_array failed\n");
-        return false;
-    }
-
-    struct type_datum **new_type_val_to_struct = ksu_kvrealloc(
-        db->type_val_to_struct, sizeof(*db->type_val_to_struct) * value, sizeof(*db->type_val_to_struct) * (value - 1));
-
-    if (!new_type_val_to_struct) {
-        pr_err("add_type: alloc type_val_to_struct failed\n");
-        return false;
-    }
-
-    char **new_val_to_name_types =
-        ksu_kvrealloc(db->sym_val_to_name[SYM_TYPES], sizeof(char *) * value, sizeof(char *) * (value - 1));
-    if (!new_val_to_name_types) {
-        pr_err("add_type: alloc val_to_name failed\n");
-        return false;
-    }
-
-    db->type_attr_map_array = new_type_attr_map_array;
     ebitmap_init(&db->type_attr_map_array[value - 1]);
     ebitmap_set_bit(&db->type_attr_map_array[value - 1], value - 1, 1);
 
-    db->type_val_to_struct = new_type_val_to_struct;
     db->type_val_to_struct[value - 1] = type;
 
-    db->sym_val_to_name[SYM_TYPES] = new_val_to_name_types;
     db->sym_val_to_name[SYM_TYPES][value - 1] = key;
 
+    // only now is every per-type slot of value initialized
+    db->p_types.nprim = value;
+
     int i;
     for (i = 0; i < db->p_roles.nprim; ++i) {
         ebitmap_set_bit(&db->role_val_to_struct[i]->types, value - 1, 1);
@@ -731,9 +982,11 @@ static bool set_type_state(struct policydb *db, const char *type_name, bool perm
     struct type_datum *type;
     if (type_name == NULL) {
         struct hashtab_node *node;
+        touch_all_types();
         ksu_hashtab_for_each(db->p_types.table, node)
         {
             type = (struct type_datum *)(node->datum);
+            ksu_hidden_record_permissive(db, type->value);
             if (ebitmap_set_bit(&db->permissive_map, type->value, permissive))
                 pr_info("Could not set bit in permissive map\n");
         };
@@ -743,6 +996,8 @@ static bool set_type_state(struct policydb *db, const char *type_name, bool perm
             pr_info("type %s does not exist\n", type_name);
             return false;
         }
+        touch_type(type->value);
+        ksu_hidden_record_permissive(db, type->value);
         if (ebitmap_set_bit(&db->permissive_map, type->value, permissive)) {
             pr_info("Could not set bit in permissive map\n");
             return false;
@@ -754,17 +1009,22 @@ static bool set_type_state(struct policydb *db, const char *type_name, bool perm
 static void add_typeattribute_raw(struct policydb *db, struct type_datum *type, struct type_datum *attr)
 {
     struct ebitmap *sattr = &db->type_attr_map_array[type->value - 1];
+    ksu_hidden_record_attr(db, type->value, attr->value);
     ebitmap_set_bit(sattr, attr->value - 1, 1);
+    touch_type(type->value);
 
     struct hashtab_node *node;
     struct constraint_node *n;
     struct constraint_expr *e;
+    u32 cidx, eidx;
     ksu_hashtab_for_each(db->p_classes.table, node)
     {
         struct class_datum *cls = (struct class_datum *)(node->datum);
-        for (n = cls->constraints; n; n = n->next) {
-            for (e = n->expr; e; e = e->next) {
+        for (n = cls->constraints, cidx = 0; n; n = n->next, cidx++) {
+            for (e = n->expr, eidx = 0; e; e = e->next, eidx++) {
                 if (e->expr_type == CEXPR_NAMES && ebitmap_get_bit(&e->type_names->types, attr->value - 1)) {
+                    if (!ebitmap_get_bit(&e->names, type->value - 1))
+                        ksu_hidden_record_names(cls->value, cidx, eidx, type->value);
                     ebitmap_set_bit(&e->names, type->value - 1, 1);
                 }
             }
@@ -973,3 +1233,388 @@ out_free_data:
 
     return ERR_PTR(ret);
 }
+
+// ======== structural clone ========
+//
+// Only the parts of the policydb KernelSU modifies are copied: te_avtab,
+// types, roles, classes with their constraints, type_attr_map_array,
+// permissive_map and filename_trans. Everything else (conditional rules,
+// users, ocontexts, genfs, role and class keys, class permissions,
+// constraint type_names...) is shared with the source policy.
+//
+// Once the clone is published, it owns the shared parts too and the source
+// policy must be freed with ksu_release_sepolicy_clone(), which frees only
+// the copied parts. An unpublished clone is freed the same way.
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+
+static int clone_type_attr_map(struct policydb *dst, struct policydb *src, u32 nprim)
+{
+    u32 i;
+    int ret;
+
+    for (i = 0; i < nprim; i++) {
+        ret = ebitmap_cpy(&dst->type_attr_map_array[i], &src->type_attr_map_array[i]);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+static int clone_types(struct policydb *dst, struct policydb *src)
+{
+    struct hashtab_node *node;
+    struct type_datum *type;
+    u32 nprim = src->p_types.nprim;
+    char *key;
+    int ret;
+
+    ret = symtab_init(&dst->p_types, src->p_types.table.nel);
+    if (ret)
+        return ret;
+
+    // room for new types, see type_capacity()
+    dst->type_val_to_struct = kvcalloc(type_capacity(nprim), sizeof(*dst->type_val_to_struct), GFP_KERNEL);
+    dst->sym_val_to_name[SYM_TYPES] = kvcalloc(type_capacity(nprim), sizeof(char *), GFP_KERNEL);
+    dst->type_attr_map_array = kvcalloc(type_capacity(nprim), sizeof(struct ebitmap), GFP_KERNEL);
+    if (!dst->type_val_to_struct || !dst->sym_val_to_name[SYM_TYPES] || !dst->type_attr_map_array)
+        return -ENOMEM;
+    // sizes the arrays for ksu_release_sepolicy_clone()
+    dst->p_types.nprim = nprim;
+
+    ksu_hashtab_for_each(src->p_types.table, node)
+    {
+        type = kmemdup(node->datum, sizeof(*type), GFP_KERNEL);
+        key = kstrdup(node->key, GFP_KERNEL);
+        if (!type || !key || symtab_insert(&dst->p_types, key, type)) {
+            kfree(type);
+            kfree(key);
+            return -ENOMEM;
+        }
+        // aliases share the value of their primary type
+        if (type->primary) {
+            dst->type_val_to_struct[type->value - 1] = type;
+            dst->sym_val_to_name[SYM_TYPES][type->value - 1] = key;
+        }
+    }
+
+    return clone_type_attr_map(dst, src, nprim);
+}
+
+static int clone_roles(struct policydb *dst, struct policydb *src)
+{
+    struct hashtab_node *node;
+    struct role_datum *role;
+    int ret;
+
+    ret = symtab_init(&dst->p_roles, src->p_roles.table.nel);
+    if (ret)
+        return ret;
+
+    dst->role_val_to_struct = kvcalloc(src->p_roles.nprim, sizeof(*dst->role_val_to_struct), GFP_KERNEL);
+    if (!dst->role_val_to_struct)
+        return -ENOMEM;
+
+    ksu_hashtab_for_each(src->p_roles.table, node)
+    {
+        role = kmemdup(node->datum, sizeof(*role), GFP_KERNEL);
+        if (!role)
+            return -ENOMEM;
+        ebitmap_init(&role->dominates);
+        ebitmap_init(&role->types);
+        // keys are shared, the datum is ours
+        if (symtab_insert(&dst->p_roles, node->key, role)) {
+            kfree(role);
+            return -ENOMEM;
+        }
+        dst->role_val_to_struct[role->value - 1] = role;
+        ret = ebitmap_cpy(&role->dominates, &((struct role_datum *)node->datum)->dominates);
+        if (!ret)
+            ret = ebitmap_cpy(&role->types, &((struct role_datum *)node->datum)->types);
+        if (ret)
+            return ret;
+    }
+    dst->p_roles.nprim = src->p_roles.nprim;
+    return 0;
+}
+
+static int clone_constraints(struct constraint_node **dst, struct constraint_node *src)
+{
+    struct constraint_node *n, **tail = dst;
+    struct constraint_expr *e, **etail;
+    int ret;
+
+    *dst = NULL;
+    for (; src; src = src->next) {
+        n = kzalloc(sizeof(*n), GFP_KERNEL);
+        if (!n)
+            return -ENOMEM;
+        n->permissions = src->permissions;
+        *tail = n;
+        tail = &n->next;
+
+        etail = &n->expr;
+        for (e = src->expr; e; e = e->next) {
+            struct constraint_expr *ne = kzalloc(sizeof(*ne), GFP_KERNEL);
+            if (!ne)
+                return -ENOMEM;
+            ne->expr_type = e->expr_type;
+            ne->attr = e->attr;
+            ne->op = e->op;
+            // type_names is never modified, share it
+            ne->type_names = e->type_names;
+            *etail = ne;
+            etail = &ne->next;
+            ret = ebitmap_cpy(&ne->names, &e->names);
+            if (ret)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+static void free_constraints(struct constraint_node *n)
+{
+    struct constraint_node *next_n;
+    struct constraint_expr *e, *next_e;
+
+    for (; n; n = next_n) {
+        for (e = n->expr; e; e = next_e) {
+            next_e = e->next;
+            ebitmap_destroy(&e->names);
+            kfree(e);
+        }
+        next_n = n->next;
+        kfree(n);
+    }
+}
+
+static int clone_classes(struct policydb *dst, struct policydb *src)
+{
+    struct hashtab_node *node;
+    struct class_datum *cls;
+    int ret;
+
+    ret = symtab_init(&dst->p_classes, src->p_classes.table.nel);
+    if (ret)
+        return ret;
+
+    dst->class_val_to_struct = kvcalloc(src->p_classes.nprim, sizeof(*dst->class_val_to_struct), GFP_KERNEL);
+    if (!dst->class_val_to_struct)
+        return -ENOMEM;
+
+    ksu_hashtab_for_each(src->p_classes.table, node)
+    {
+        // permissions, comdatum and validatetrans are shared
+        cls = kmemdup(node->datum, sizeof(*cls), GFP_KERNEL);
+        if (!cls)
+            return -ENOMEM;
+        cls->constraints = NULL;
+        if (symtab_insert(&dst->p_classes, node->key, cls)) {
+            kfree(cls);
+            return -ENOMEM;
+        }
+        dst->class_val_to_struct[cls->value - 1] = cls;
+        ret = clone_constraints(&cls->constraints, ((struct class_datum *)node->datum)->constraints);
+        if (ret)
+            return ret;
+    }
+    dst->p_classes.nprim = src->p_classes.nprim;
+    return 0;
+}
+
+static int clone_filename_trans(struct policydb *dst, struct policydb *src)
+{
+    struct hashtab_node *node;
+    struct filename_trans_key *key;
+    struct filename_trans_datum *datum, *copy, **tail;
+    int ret;
+
+    ret = hashtab_init(&dst->filename_trans, src->filename_trans.nel);
+    if (ret)
+        return ret;
+
+    ksu_hashtab_for_each(src->filename_trans, node)
+    {
+        key = kmemdup(node->key, sizeof(*key), GFP_KERNEL);
+        if (!key)
+            return -ENOMEM;
+        key->name = kstrdup(((struct filename_trans_key *)node->key)->name, GFP_KERNEL);
+        if (!key->name) {
+            kfree(key);
+            return -ENOMEM;
+        }
+
+        copy = NULL;
+        tail = &copy;
+        for (datum = node->datum; datum; datum = datum->next) {
+            *tail = kzalloc(sizeof(**tail), GFP_KERNEL);
+            if (!*tail || ebitmap_cpy(&(*tail)->stypes, &datum->stypes))
+                break;
+            (*tail)->otype = datum->otype;
+            tail = &(*tail)->next;
+        }
+
+        if (datum || hashtab_insert(&dst->filename_trans, key, copy, filenametr_key_params)) {
+            for (datum = copy; datum; datum = copy) {
+                copy = datum->next;
+                ebitmap_destroy(&datum->stypes);
+                kfree(datum);
+            }
+            kfree(key->name);
+            kfree(key);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static int release_type(void *k, void *d, void *args)
+{
+    kfree(k);
+    kfree(d);
+    return 0;
+}
+
+static int release_role(void *k, void *d, void *args)
+{
+    struct role_datum *role = d;
+
+    ebitmap_destroy(&role->dominates);
+    ebitmap_destroy(&role->types);
+    kfree(role);
+    return 0;
+}
+
+static int release_class(void *k, void *d, void *args)
+{
+    struct class_datum *cls = d;
+
+    free_constraints(cls->constraints);
+    kfree(cls);
+    return 0;
+}
+
+static int release_filename_trans(void *k, void *d, void *args)
+{
+    struct filename_trans_key *key = k;
+    struct filename_trans_datum *datum = d, *next;
+
+    for (; datum; datum = next) {
+        next = datum->next;
+        ebitmap_destroy(&datum->stypes);
+        kfree(datum);
+    }
+    kfree(key->name);
+    kfree(key);
+    return 0;
+}
+
+void ksu_release_sepolicy_clone(struct selinux_policy *pol)
+{
+    struct policydb *db = &pol->policydb;
+    u32 i;
+
+    avtab_destroy(&db->te_avtab);
+
+    hashtab_map(&db->p_types.table, release_type, NULL);
+    hashtab_destroy(&db->p_types.table);
+    if (db->type_attr_map_array) {
+        for (i = 0; i < db->p_types.nprim; i++)
+            ebitmap_destroy(&db->type_attr_map_array[i]);
+    }
+    kvfree(db->type_attr_map_array);
+    kvfree(db->type_val_to_struct);
+    kvfree(db->sym_val_to_name[SYM_TYPES]);
+
+    hashtab_map(&db->p_roles.table, release_role, NULL);
+    hashtab_destroy(&db->p_roles.table);
+    kvfree(db->role_val_to_struct);
+
+    hashtab_map(&db->p_classes.table, release_class, NULL);
+    hashtab_destroy(&db->p_classes.table);
+    kvfree(db->class_val_to_struct);
+
+    ebitmap_destroy(&db->permissive_map);
+
+    hashtab_map(&db->filename_trans, release_filename_trans, NULL);
+    hashtab_destroy(&db->filename_trans);
+
+    kfree(pol);
+}
+
+struct selinux_policy *ksu_clone_sepolicy(struct selinux_policy *old_pol)
+{
+    struct policydb *src = &old_pol->policydb, *dst;
+    struct selinux_policy *new_pol;
+    ktime_t start = ktime_get();
+    int ret;
+
+    new_pol = kmemdup(old_pol, sizeof(*old_pol), GFP_KERNEL);
+    if (!new_pol) {
+        pr_err("sepolicy: clone old pol\n");
+        return ERR_PTR(-ENOMEM);
+    }
+    dst = &new_pol->policydb;
+
+    // Reset what gets copied, so a partial clone can be released
+    memset(&dst->te_avtab, 0, sizeof(dst->te_avtab));
+    memset(&dst->p_types, 0, sizeof(dst->p_types));
+    memset(&dst->p_roles, 0, sizeof(dst->p_roles));
+    memset(&dst->p_classes, 0, sizeof(dst->p_classes));
+    memset(&dst->filename_trans, 0, sizeof(dst->filename_trans));
+    dst->type_attr_map_array = NULL;
+    dst->type_val_to_struct = NULL;
+    dst->sym_val_to_name[SYM_TYPES] = NULL;
+    dst->role_val_to_struct = NULL;
+    dst->class_val_to_struct = NULL;
+    ebitmap_init(&dst->permissive_map);
+
+    ret = clone_avtab(&dst->te_avtab, &src->te_avtab, src->te_avtab.nel);
+    if (!ret)
+        ret = clone_types(dst, src);
+    if (!ret)
+        ret = clone_roles(dst, src);
+    if (!ret)
+        ret = clone_classes(dst, src);
+    if (!ret)
+        ret = ebitmap_cpy(&dst->permissive_map, &src->permissive_map);
+    if (!ret)
+        ret = clone_filename_trans(dst, src);
+    if (ret) {
+        pr_err("sepolicy: clone failed: %d\n", ret);
+        ksu_release_sepolicy_clone(new_pol);
+        return ERR_PTR(ret);
+    }
+
+    pr_info("sepolicy: cloned in %lld us, avtab: %u, types: %u\n", ktime_us_delta(ktime_get(), start),
+            dst->te_avtab.nel, dst->p_types.nprim);
+    return new_pol;
+}
+
+#else
+
+// No structural clone before 5.9, fall back to a full duplicate
+struct selinux_policy *ksu_clone_sepolicy(struct selinux_policy *old_pol)
+{
+    struct selinux_policy *pol = ksu_dup_sepolicy(old_pol);
+    u32 nprim;
+
+    if (IS_ERR(pol))
+        return pol;
+
+    // policydb_read sizes the type arrays exactly
+    nprim = pol->policydb.p_types.nprim;
+    if (resize_type_arrays(&pol->policydb, nprim, type_capacity(nprim))) {
+        ksu_destroy_sepolicy(pol);
+        return ERR_PTR(-ENOMEM);
+    }
+    return pol;
+}
+
+void ksu_release_sepolicy_clone(struct selinux_policy *pol)
+{
+    ksu_destroy_sepolicy(pol);
+}
+
+#endif
@@ -3,13 +3,37 @@
 
 #include <linux/types.h>
 
+#include "ss/ebitmap.h"
 #include "ss/policydb.h"
 
 struct selinux_policy *ksu_dup_sepolicy(struct selinux_policy *old_pol);
 
 void ksu_destroy_sepolicy(struct selinux_policy *orig);
 
+// Copy only what KernelSU modifies and share the rest with @old_pol.
+// The source of a published clone, or an unpublished clone, is freed with
+// ksu_release_sepolicy_clone(); ksu_destroy_sepolicy() is for full copies.
+struct selinux_policy *ksu_clone_sepolicy(struct selinux_policy *old_pol);
+void ksu_release_sepolicy_clone(struct selinux_policy *pol);
+
+// Types whose access decisions a set of modifications changed
+struct ksu_sepolicy_changes {
+    struct ebitmap types; // type values - 1, attributes not expanded
+    bool all; // not tracked precisely, anything may have changed
+};
+
+// Record modifications into @changes until called with NULL.
+// Caller holds policy_mutex.
+void ksu_sepolicy_track_changes(struct ksu_sepolicy_changes *changes);
+
+// Fill @out with the types affected by @changes, expanding attributes to
+// their members. Returns the number of affected types, or U32_MAX once it
+// exceeds @max.
+u32 ksu_sepolicy_affected_types(struct policydb *db, struct ksu_sepolicy_changes *changes, struct ebitmap *out,
+                                u32 max);
+
 // Operation on types
+int ksu_reserve_types(struct policydb *db, u32 count);
 bool ksu_type(struct policydb *db, const char *name, const char *attr);
 bool ksu_attribute(struct policydb *db, const char *name);
 bool ksu_permissive(struct policydb *db, const char *type);
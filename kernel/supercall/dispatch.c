@@ -1,9 +1,11 @@
 #include <linux/capability.h>
 #include <linux/cred.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
 #include <linux/thread_info.h>
+#include "uapi/selinux.h"
 #include "uapi/supercall.h"
 #include "supercall/internal.h"
 #include "arch.h" // IWYU pragma: keep
@@ -17,6 +19,7 @@
 #include "selinux/selinux.h"
 #include "infra/file_wrapper.h"
 #include "hook/tp_marker.h"
+#include "hook/syscall_hook_manager.h"
 #include "policy/app_profile.h"
 #include "sulog/event.h"
 #include "sulog/fd.h"
@@ -142,12 +145,61 @@ static int do_report_event(void __user *arg)
 static int do_set_sepolicy(void __user *arg)
 {
     struct ksu_set_sepolicy_cmd cmd;
+    struct ksu_sepolicy_progress progress;
 
     if (copy_from_user(&cmd, arg, sizeof(cmd))) {
         return -EFAULT;
     }
 
-    return handle_sepolicy((void __user *)cmd.data, cmd.data_len);
+    return handle_sepolicy((void __user *)cmd.data, cmd.data_len, &progress);
+}
+
+static int do_sepolicy_stream(void __user *arg)
+{
+    struct ksu_sepolicy_stream_cmd cmd;
+    struct ksu_sepolicy_progress progress;
+    int ret;
+
+    if (copy_from_user(&cmd, arg, sizeof(cmd))) {
+        return -EFAULT;
+    }
+
+    ret = handle_sepolicy((void __user *)cmd.data, cmd.data_len, &progress);
+
+    // reported on failure too, it tells where the payload stopped
+    cmd.consumed = progress.consumed;
+    cmd.error_offset = progress.error_offset;
+    cmd.records = progress.records;
+    cmd.applied = progress.applied;
+    if (copy_to_user(arg, &cmd, sizeof(cmd))) {
+        pr_err("sepolicy_stream: copy_to_user failed\n");
+        return -EFAULT;
+    }
+
+    return ret;
+}
+
+static int do_sepolicy_txn(void __user *arg)
+{
+    struct ksu_sepolicy_txn_cmd cmd;
+    int ret;
+
+    if (copy_from_user(&cmd, arg, sizeof(cmd))) {
+        return -EFAULT;
+    }
+
+    ret = ksu_sepolicy_txn(cmd.operation);
+    if (ret < 0) {
+        return ret;
+    }
+
+    cmd.applied = cmd.operation == KSU_SEPOLICY_TXN_COMMIT ? ret : 0;
+    if (copy_to_user(arg, &cmd, sizeof(cmd))) {
+        pr_err("sepolicy_txn: copy_to_user failed\n");
+        return -EFAULT;
+    }
+
+    return 0;
 }
 
 static int do_check_safemode(void __user *arg)
@@ -368,7 +420,7 @@ static int do_set_app_profile(void __user *arg)
     ret = ksu_set_app_profile(&cmd.profile);
     if (!ret) {
         ksu_persistent_allow_list();
-        ksu_mark_running_process();
+        ksu_mark_uid_process(cmd.profile.curr_uid);
     }
     return ret;
 }
@@ -481,7 +533,7 @@ static int do_manage_mark(void __user *arg)
     }
     case KSU_MARK_REFRESH: {
         ksu_mark_running_process();
-        pr_info("manage_mark: refreshed running processes\n");
+        pr_info("manage_mark: scheduled refresh of running processes\n");
         break;
     }
     default: {
@@ -688,6 +740,71 @@ static int do_disable_escape_to_root(void __user *arg)
     return 0;
 }
 
+// Upper bound of entries copied out per call, far above the handlers we register
+#define KSU_HOOK_STATS_MAX_ENTRIES 256
+
+static int do_hook_stats(void __user *arg)
+{
+    struct ksu_hook_stats_cmd cmd;
+    struct ksu_hook_stat_entry *entries = NULL;
+    u32 cap, total;
+    int err = 0;
+
+    if (copy_from_user(&cmd, arg, sizeof(cmd))) {
+        pr_err("hook_stats: copy_from_user failed\n");
+        return -EFAULT;
+    }
+
+    switch (cmd.operation) {
+    case KSU_HOOK_STATS_GET: {
+        cap = min_t(u32, cmd.count, KSU_HOOK_STATS_MAX_ENTRIES);
+        if (cap && !cmd.entries)
+            return -EINVAL;
+        if (cap) {
+            entries = kvcalloc(cap, sizeof(*entries), GFP_KERNEL);
+            if (!entries)
+                return -ENOMEM;
+        }
+        total = ksu_collect_syscall_handler_stats(entries, cap);
+        if (cap && copy_to_user((void __user *)cmd.entries, entries, sizeof(*entries) * min(cap, total))) {
+            pr_err("hook_stats: copy_to_user entries failed\n");
+            err = -EFAULT;
+            goto out;
+        }
+        cmd.count = total;
+        break;
+    }
+    case KSU_HOOK_STATS_ENABLE_LATENCY: {
+        ksu_set_syscall_latency_enabled(true);
+        break;
+    }
+    case KSU_HOOK_STATS_DISABLE_LATENCY: {
+        ksu_set_syscall_latency_enabled(false);
+        break;
+    }
+    case KSU_HOOK_STATS_RESET: {
+        ksu_reset_syscall_handler_stats();
+        break;
+    }
+    default: {
+        pr_err("hook_stats: invalid operation %u\n", cmd.operation);
+        return -EINVAL;
+    }
+    }
+
+    cmd.latency_enabled = ksu_syscall_latency_enabled();
+    if (copy_to_user(arg, &cmd, sizeof(cmd))) {
+        pr_err("hook_stats: copy_to_user failed\n");
+        err = -EFAULT;
+    }
+
+out:
+    if (entries) {
+        kvfree(entries);
+    }
+    return err;
+}
+
 // IOCTL handlers mapping table
 // clang-format off
 static const struct ksu_ioctl_cmd_map ksu_ioctl_handlers[] = {
@@ -721,6 +838,18 @@ static const struct ksu_ioctl_cmd_map ksu_ioctl_handlers[] = {
         .handler = do_set_sepolicy,
         .perm_check = only_root
     },
+    {
+        .cmd = KSU_IOCTL_SEPOLICY_TXN,
+        .name = "SEPOLICY_TXN",
+        .handler = do_sepolicy_txn,
+        .perm_check = only_root
+    },
+    {
+        .cmd = KSU_IOCTL_SEPOLICY_STREAM,
+        .name = "SEPOLICY_STREAM",
+        .handler = do_sepolicy_stream,
+        .perm_check = only_root
+    },
     {
         .cmd = KSU_IOCTL_CHECK_SAFEMODE,
         .name = "CHECK_SAFEMODE",
@@ -835,6 +964,12 @@ static const struct ksu_ioctl_cmd_map ksu_ioctl_handlers[] = {
         .handler = do_disable_escape_to_root, 
         .perm_check = only_root 
     },
+    {
+        .cmd = KSU_IOCTL_HOOK_STATS,
+        .name = "HOOK_STATS",
+        .handler = do_hook_stats,
+        .perm_check = only_root
+    },
     {
         .cmd = 0,
         .name = NULL,
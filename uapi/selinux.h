@@ -28,4 +28,8 @@ static const __u32 KSU_SEPOLICY_SUBCMD_TYPE_STATE_ENFORCE = 2;
 static const __u32 KSU_SEPOLICY_SUBCMD_TYPE_CHANGE_CHANGE = 1;
 static const __u32 KSU_SEPOLICY_SUBCMD_TYPE_CHANGE_MEMBER = 2;
 
+static const __u32 KSU_SEPOLICY_TXN_BEGIN = 1;
+static const __u32 KSU_SEPOLICY_TXN_COMMIT = 2;
+static const __u32 KSU_SEPOLICY_TXN_ABORT = 3;
+
 #endif
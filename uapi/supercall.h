@@ -64,6 +64,30 @@ struct ksu_sepolicy_cmd_hdr {
  * KSU_SEPOLICY_CMD_GENFSCON=3.
  */
 
+/*
+ * Between KSU_SEPOLICY_TXN_BEGIN and COMMIT, KSU_IOCTL_SET_SEPOLICY calls of the
+ * same process are applied to a staged copy of the policy, which is published
+ * once on commit. SET_SEPOLICY of other processes fails with EBUSY meanwhile.
+ */
+struct ksu_sepolicy_txn_cmd {
+    __u32 operation; /* Input: KSU_SEPOLICY_TXN_* */
+    __u32 applied; /* Output: for commit, number of commands applied in the transaction */
+};
+
+/*
+ * Same payload as KSU_IOCTL_SET_SEPOLICY. The kernel copies and applies it in
+ * 64 KiB chunks, so a single record must fit in one, and reports where it
+ * stopped even when the ioctl fails.
+ */
+struct ksu_sepolicy_stream_cmd {
+    __u64 data_len; /* Input: bytes of serialized command payload */
+    __aligned_u64 data; /* Input: pointer to serialized payload */
+    __u64 consumed; /* Output: bytes of complete records parsed */
+    __u64 error_offset; /* Output: offset of the first record that failed to parse or apply, data_len if none */
+    __u32 records; /* Output: number of records parsed */
+    __u32 applied; /* Output: number of commands applied */
+};
+
 struct ksu_check_safemode_cmd {
     __u8 in_safe_mode; /* Output: true if in safe mode, false otherwise */
 };
@@ -144,6 +168,33 @@ struct ksu_get_sulog_fd_cmd {
     __u32 flags; /* Input: reserved for future use, must be 0 */
 };
 
+#define KSU_HOOK_NAME_LEN 32
+#define KSU_HOOK_LATENCY_BUCKETS 32
+
+struct ksu_hook_stat_entry {
+    char name[KSU_HOOK_NAME_LEN]; /* Output: handler name */
+    __s32 nr; /* Output: syscall number */
+    __s32 priority; /* Output: position in the chain, lower runs first */
+    __u32 enabled; /* Output: true if the handler is enabled */
+    __u32 reserved;
+    __u64 calls; /* Output: times the handler ran */
+    __u64 handled; /* Output: times the handler served the syscall itself */
+    /* Output: bucket i counts calls that took [2^i, 2^(i+1)) ns, bucket 0 also counts 0 ns */
+    __u64 latency[KSU_HOOK_LATENCY_BUCKETS];
+};
+
+struct ksu_hook_stats_cmd {
+    __u32 operation; /* Input: KSU_HOOK_STATS_* */
+    __u32 count; /* Input: capacity of entries; Output: number of registered handlers */
+    __aligned_u64 entries; /* Input: pointer to struct ksu_hook_stat_entry array, for get */
+    __u8 latency_enabled; /* Output: true if latency collection is on */
+};
+
+static const __u32 KSU_HOOK_STATS_GET = 1;
+static const __u32 KSU_HOOK_STATS_ENABLE_LATENCY = 2;
+static const __u32 KSU_HOOK_STATS_DISABLE_LATENCY = 3;
+static const __u32 KSU_HOOK_STATS_RESET = 4;
+
 static const __u8 KSU_UMOUNT_WIPE = 0; /* ignore everything and wipe list */
 static const __u8 KSU_UMOUNT_ADD = 1; /* add entry (path + flags) */
 static const __u8 KSU_UMOUNT_DEL = 2; /* delete entry, strcmp */
@@ -176,5 +227,8 @@ static const __u32 KSU_IOCTL_ADD_TRY_UMOUNT = _IOC(_IOC_WRITE, 'K', 18, 0);
 static const __u32 KSU_IOCTL_SET_INIT_PGRP = _IO('K', 19);
 static const __u32 KSU_IOCTL_GET_SULOG_FD = _IOW('K', 20, struct ksu_get_sulog_fd_cmd);
 static const __u32 KSU_IOCTL_DISABLE_ESCAPE_TO_ROOT = _IO('K', 21);
+static const __u32 KSU_IOCTL_HOOK_STATS = _IOWR('K', 22, struct ksu_hook_stats_cmd);
+static const __u32 KSU_IOCTL_SEPOLICY_TXN = _IOWR('K', 23, struct ksu_sepolicy_txn_cmd);
+static const __u32 KSU_IOCTL_SEPOLICY_STREAM = _IOWR('K', 24, struct ksu_sepolicy_stream_cmd);
 
 #endif
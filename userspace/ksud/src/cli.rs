@@ -222,6 +222,12 @@ enum Debug {
         command: MarkCommand,
     },
 
+    /// Kernel syscall handler stats and latency histograms
+    Hooks {
+        #[command(subcommand)]
+        command: Option<HooksCommand>,
+    },
+
     /// Launch sulogd daemon manually
     Sulogd,
 
@@ -259,6 +265,21 @@ enum MarkCommand {
     Refresh,
 }
 
+#[derive(clap::Subcommand, Debug)]
+enum HooksCommand {
+    /// Show calls, handled count and p50/p99/max latency of every handler (default)
+    Show,
+
+    /// Start collecting latency histograms
+    Enable,
+
+    /// Stop collecting latency histograms
+    Disable,
+
+    /// Clear all counters and histograms
+    Reset,
+}
+
 #[derive(clap::Subcommand, Debug)]
 enum Sepolicy {
     /// Patch sepolicy
@@ -718,6 +739,12 @@ pub fn run() -> Result<()> {
                 MarkCommand::Unmark { pid } => debug::mark_unset(pid),
                 MarkCommand::Refresh => debug::mark_refresh(),
             },
+            Debug::Hooks { command } => match command.unwrap_or(HooksCommand::Show) {
+                HooksCommand::Show => debug::hooks_show(),
+                HooksCommand::Enable => debug::hooks_latency(true),
+                HooksCommand::Disable => debug::hooks_latency(false),
+                HooksCommand::Reset => debug::hooks_reset(),
+            },
             Debug::Sulogd => sulog::ensure_sulogd_running(),
             Debug::Info => {
                 let info = ksucalls::get_info();
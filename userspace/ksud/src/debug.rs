@@ -1,4 +1,4 @@
-use anyhow::{Context, Ok, Result, bail, ensure};
+use anyhow::{Context, Ok, Result, ensure};
 use std::{
     ffi::CString,
     fs,
@@ -70,7 +70,8 @@ pub fn insmod(module: &Path, params: &[String]) -> Result<()> {
 pub fn mark_get(pid: i32) -> Result<()> {
     let result = ksucalls::mark_get(pid)?;
     if pid == 0 {
-        bail!("Please specify a pid to get its mark status");
+        println!("Processes marked by the last full refresh: {result}");
+        return Ok(());
     }
     println!(
         "Process {pid} mark status: {}",
@@ -107,3 +108,65 @@ pub fn mark_refresh() -> Result<()> {
     println!("Refreshed mark for all running processes");
     Ok(())
 }
+
+/// Upper bound in ns of the bucket holding the @pct percentile, 0 if nothing was recorded
+fn latency_percentile(latency: &[u64], pct: u64) -> u64 {
+    let total: u64 = latency.iter().sum();
+    if total == 0 {
+        return 0;
+    }
+    let target = (total * pct).div_ceil(100);
+    let mut seen = 0;
+    for (i, count) in latency.iter().enumerate() {
+        seen += count;
+        if seen >= target {
+            return 1u64 << (i + 1);
+        }
+    }
+    1u64 << latency.len()
+}
+
+/// Show syscall handler stats
+pub fn hooks_show() -> Result<()> {
+    let (stats, latency_enabled) = ksucalls::get_hook_stats()?;
+    println!(
+        "Latency collection: {}",
+        if latency_enabled { "on" } else { "off" }
+    );
+    println!(
+        "{:<14} {:>5} {:>5} {:>8} {:>12} {:>10} {:>10} {:>10} {:>10}",
+        "handler", "nr", "prio", "enabled", "calls", "handled", "p50(ns)", "p99(ns)", "max(ns)"
+    );
+    for s in stats {
+        println!(
+            "{:<14} {:>5} {:>5} {:>8} {:>12} {:>10} {:>10} {:>10} {:>10}",
+            s.name,
+            s.nr,
+            s.priority,
+            s.enabled,
+            s.calls,
+            s.handled,
+            latency_percentile(&s.latency, 50),
+            latency_percentile(&s.latency, 99),
+            latency_percentile(&s.latency, 100),
+        );
+    }
+    Ok(())
+}
+
+/// Turn latency collection on or off
+pub fn hooks_latency(enable: bool) -> Result<()> {
+    ksucalls::set_hook_latency(enable)?;
+    println!(
+        "Latency collection {}",
+        if enable { "enabled" } else { "disabled" }
+    );
+    Ok(())
+}
+
+/// Reset syscall handler stats
+pub fn hooks_reset() -> Result<()> {
+    ksucalls::reset_hook_stats()?;
+    println!("Hook stats reset");
+    Ok(())
+}
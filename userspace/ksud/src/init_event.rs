@@ -84,6 +84,8 @@ pub fn on_post_data_fs() -> Result<()> {
     }
 
     // load sepolicy.rule
+    // module and profile rules are staged and published with a single policy swap
+    let sepolicy_txn = crate::sepolicy::Transaction::begin();
     if crate::module::load_sepolicy_rule().is_err() {
         warn!("load sepolicy.rule failed");
     }
@@ -92,6 +94,10 @@ pub fn on_post_data_fs() -> Result<()> {
         warn!("apply root profile sepolicy failed: {e}");
     }
 
+    if let Err(e) = sepolicy_txn.commit() {
+        warn!("{e:#}");
+    }
+
     // load feature config
     if is_safe_mode() {
         warn!("safe mode, skip load feature config");
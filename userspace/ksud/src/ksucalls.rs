@@ -153,6 +153,36 @@ pub fn set_sepolicy(payload: *const u8, payload_len: u64) -> std::io::Result<i32
     ksuctl(ksu_uapi::KSU_IOCTL_SET_SEPOLICY, &raw mut ioctl_cmd)
 }
 
+/// Apply a payload through the chunked sepolicy ioctl. The returned command
+/// tells where the kernel stopped, also when the ioctl fails.
+pub fn sepolicy_stream(
+    payload: &[u8],
+) -> (
+    std::io::Result<i32>,
+    crate::ksu_uapi::ksu_sepolicy_stream_cmd,
+) {
+    let mut cmd = crate::ksu_uapi::ksu_sepolicy_stream_cmd {
+        data_len: payload.len() as u64,
+        data: payload.as_ptr() as u64,
+        consumed: 0,
+        error_offset: 0,
+        records: 0,
+        applied: 0,
+    };
+    let result = ksuctl(ksu_uapi::KSU_IOCTL_SEPOLICY_STREAM, &raw mut cmd);
+    (result, cmd)
+}
+
+/// Begin, commit or abort a sepolicy transaction, commit returns the applied command count
+pub fn sepolicy_txn(operation: u32) -> std::io::Result<u32> {
+    let mut cmd = ksu_uapi::ksu_sepolicy_txn_cmd {
+        operation,
+        applied: 0,
+    };
+    ksuctl(ksu_uapi::KSU_IOCTL_SEPOLICY_TXN, &raw mut cmd)?;
+    Ok(cmd.applied)
+}
+
 /// Get feature value and support status from kernel
 /// Returns (value, supported)
 pub fn get_feature(feature_id: u32) -> std::io::Result<(u64, bool)> {
@@ -231,6 +261,90 @@ pub fn mark_refresh() -> std::io::Result<()> {
     Ok(())
 }
 
+/// Counters and latency histogram of one kernel syscall handler
+pub struct HookStat {
+    pub name: String,
+    pub nr: i32,
+    pub priority: i32,
+    pub enabled: bool,
+    pub calls: u64,
+    pub handled: u64,
+    /// bucket i counts calls that took [2^i, 2^(i+1)) ns
+    pub latency: Vec<u64>,
+}
+
+fn hook_stats_ctl(
+    operation: u32,
+    entries: &mut [ksu_uapi::ksu_hook_stat_entry],
+) -> std::io::Result<ksu_uapi::ksu_hook_stats_cmd> {
+    let mut cmd = ksu_uapi::ksu_hook_stats_cmd {
+        operation,
+        count: entries.len() as u32,
+        entries: entries.as_mut_ptr() as u64,
+        latency_enabled: 0,
+    };
+    ksuctl(ksu_uapi::KSU_IOCTL_HOOK_STATS, &raw mut cmd)?;
+    Ok(cmd)
+}
+
+/// Get stats of all registered syscall handlers and whether latency collection is on
+pub fn get_hook_stats() -> std::io::Result<(Vec<HookStat>, bool)> {
+    let empty = ksu_uapi::ksu_hook_stat_entry {
+        name: [0; ksu_uapi::KSU_HOOK_NAME_LEN as usize],
+        nr: 0,
+        priority: 0,
+        enabled: 0,
+        reserved: 0,
+        calls: 0,
+        handled: 0,
+        latency: [0; ksu_uapi::KSU_HOOK_LATENCY_BUCKETS as usize],
+    };
+    let total = hook_stats_ctl(ksu_uapi::KSU_HOOK_STATS_GET, &mut [])?.count as usize;
+    let mut entries = vec![empty; total];
+    let cmd = hook_stats_ctl(ksu_uapi::KSU_HOOK_STATS_GET, &mut entries)?;
+    // handlers registered in between are picked up next time
+    entries.truncate((cmd.count as usize).min(total));
+
+    let stats = entries
+        .iter()
+        .map(|e| {
+            let name: Vec<u8> = e
+                .name
+                .iter()
+                .take_while(|&&c| c != 0)
+                .map(|&c| c as u8)
+                .collect();
+            HookStat {
+                name: String::from_utf8_lossy(&name).into_owned(),
+                nr: e.nr,
+                priority: e.priority,
+                enabled: e.enabled != 0,
+                calls: e.calls,
+                handled: e.handled,
+                latency: e.latency.to_vec(),
+            }
+        })
+        .collect();
+    Ok((stats, cmd.latency_enabled != 0))
+}
+
+/// Turn latency collection of syscall handlers on or off
+pub fn set_hook_latency(enable: bool) -> std::io::Result<()> {
+    let operation = if enable {
+        ksu_uapi::KSU_HOOK_STATS_ENABLE_LATENCY
+    } else {
+        ksu_uapi::KSU_HOOK_STATS_DISABLE_LATENCY
+    };
+    hook_stats_ctl(operation, &mut [])?;
+    Ok(())
+}
+
+/// Clear counters and histograms of all syscall handlers
+pub fn reset_hook_stats() -> std::io::Result<()> {
+    hook_stats_ctl(ksu_uapi::KSU_HOOK_STATS_RESET, &mut [])?;
+    Ok(())
+}
+
 pub fn nuke_ext4_sysfs(mnt: &str) -> anyhow::Result<()> {
     let c_mnt = std::ffi::CString::new(mnt)?;
     let mut ioctl_cmd = ksu_uapi::ksu_nuke_ext4_sysfs_cmd {
@@ -94,6 +94,8 @@ pub fn run(package_name: &String, kmi: Option<String>, allow_shell: bool) -> Res
     }
 
     // 6. Load SELinux rules
+    // module and profile rules are staged and published with a single policy swap
+    let sepolicy_txn = crate::sepolicy::Transaction::begin();
     if crate::module::load_sepolicy_rule().is_err() {
         warn!("load sepolicy.rule failed");
     }
@@ -102,6 +104,10 @@ pub fn run(package_name: &String, kmi: Option<String>, allow_shell: bool) -> Res
         warn!("apply root profile sepolicy failed: {e}");
     }
 
+    if let Err(e) = sepolicy_txn.commit() {
+        warn!("{e:#}");
+    }
+
     // 7. Initialize features
     if let Err(e) = crate::feature::init_features() {
         warn!("init features failed: {e}");
@@ -165,20 +165,18 @@ fn foreach_active_module(f: impl FnMut(&Path) -> Result<()>) -> Result<()> {
 }
 
 pub fn load_sepolicy_rule() -> Result<()> {
+    let mut rule_files = vec![];
     foreach_active_module(|path| {
         let rule_file = path.join("sepolicy.rule");
         if !rule_file.exists() {
             return Ok(());
         }
         info!("load policy: {}", rule_file.display());
-
-        if sepolicy::apply_file(&rule_file).is_err() {
-            warn!("Failed to load sepolicy.rule for {}", rule_file.display());
-        }
+        rule_files.push(rule_file);
         Ok(())
     })?;
 
-    Ok(())
+    sepolicy::apply_module_rules(&rule_files)
 }
 
 pub fn exec_script<T: AsRef<Path>>(path: T, wait: bool) -> Result<()> {
@@ -7,7 +7,11 @@ use nom::{
     character::complete::{space0, space1},
     combinator::map,
 };
-use std::{path::Path, vec};
+use std::{
+    collections::HashMap,
+    path::{Path, PathBuf},
+    vec,
+};
 
 type SeObject<'a> = Vec<&'a str>;
 
@@ -726,15 +730,47 @@ fn apply_rules_batch<'a>(statements: &'a [PolicyStatement<'a>], strict: bool) ->
     }
 
     let payload = serialize_atomic_statements(&policies)?;
+    send_payload(&payload, policies.len(), strict)
+}
+
+/// Hands `payload` to the kernel, returning the number of applied statements
+fn submit_payload(payload: &[u8]) -> std::io::Result<i32> {
+    let (result, progress) = crate::ksucalls::sepolicy_stream(payload);
+    match result {
+        // kernels without the chunked ioctl
+        Err(e) if e.raw_os_error() == Some(libc::ENOTTY) => {
+            crate::ksucalls::set_sepolicy(payload.as_ptr(), payload.len() as u64)
+        }
+        Err(e) => {
+            log::warn!(
+                "sepolicy batch stopped at record {} (offset {}/{})",
+                progress.records,
+                progress.error_offset,
+                payload.len()
+            );
+            Err(e)
+        }
+        Ok(applied) => {
+            if (progress.error_offset as usize) < payload.len() {
+                log::warn!(
+                    "first failing sepolicy record at offset {}/{}",
+                    progress.error_offset,
+                    payload.len()
+                );
+            }
+            Ok(applied)
+        }
+    }
+}
 
-    match crate::ksucalls::set_sepolicy(payload.as_ptr(), payload.len() as u64) {
+fn send_payload(payload: &[u8], statement_count: usize, strict: bool) -> Result<()> {
+    match submit_payload(payload) {
         Ok(applied_count) => {
             let applied_count = usize::try_from(applied_count)
                 .context("kernel returned negative sepolicy applied count")?;
-            if applied_count < policies.len() {
+            if applied_count < statement_count {
                 let err = anyhow::anyhow!(
-                    "apply sepolicy batch partially succeeded: {applied_count}/{}",
-                    policies.len()
+                    "apply sepolicy batch partially succeeded: {applied_count}/{statement_count}"
                 );
                 if strict {
                     return Err(err);
@@ -753,6 +789,229 @@ fn apply_rules_batch<'a>(statements: &'a [PolicyStatement<'a>], strict: bool) ->
     Ok(())
 }
 
+/// Serialized atomic statements of one rule file, tagged with their cmd
+fn compile_rules(policy: &str) -> Result<Vec<(u32, Vec<u8>)>> {
+    let statements = parse_sepolicy(policy.trim(), false)?;
+    let policies = flatten_atomic_statements(&statements)?;
+    policies
+        .iter()
+        .map(|statement| {
+            let mut record = vec![];
+            append_atomic_statement(&mut record, statement)?;
+            Ok((statement.cmd, record))
+        })
+        .collect()
+}
+
+/// Which occurrences of a repeated statement must be kept
+enum Keep {
+    First,
+    Last,
+    FirstAndLast,
+}
+
+const fn keep_policy(cmd: u32) -> Keep {
+    match cmd {
+        // only creates, later rules may need it to exist
+        crate::ksu_uapi::KSU_SEPOLICY_CMD_ATTR => Keep::First,
+        // creates the type, and may only manage to add the attribute once a
+        // later module declared it
+        crate::ksu_uapi::KSU_SEPOLICY_CMD_TYPE => Keep::FirstAndLast,
+        // the rest set, clear or add to something that may only be declared
+        // by a later module, and nothing depends on them within the batch
+        _ => Keep::Last,
+    }
+}
+
+/// Drops repeated statements without changing the resulting policy.
+/// Rules set or clear bits and the last write wins, and the last occurrence
+/// is the one most likely to find its types declared, so only that one is
+/// kept. Declarations that create something are also kept at their first
+/// occurrence so rules in between can use it.
+fn dedup_records(records: Vec<(u32, Vec<u8>)>) -> Vec<Vec<u8>> {
+    let mut first = HashMap::new();
+    let mut last = HashMap::new();
+    for (index, (_, record)) in records.iter().enumerate() {
+        first.entry(record.as_slice()).or_insert(index);
+        last.insert(record.as_slice(), index);
+    }
+
+    let keep: Vec<bool> = records
+        .iter()
+        .enumerate()
+        .map(|(index, (cmd, record))| {
+            let is_first = first[record.as_slice()] == index;
+            let is_last = last[record.as_slice()] == index;
+            match keep_policy(*cmd) {
+                Keep::First => is_first,
+                Keep::Last => is_last,
+                Keep::FirstAndLast => is_first || is_last,
+            }
+        })
+        .collect();
+
+    records
+        .into_iter()
+        .zip(keep)
+        .filter_map(|((_, record), keep)| keep.then_some(record))
+        .collect()
+}
+
+/// Cache of the merged payload of all module rules.
+/// Layout: sha256 key in hex, '\n', statement count as u32, payload.
+fn rules_cache_key(sources: &[(&PathBuf, String)]) -> String {
+    let mut input = crate::defs::VERSION_CODE.as_bytes().to_vec();
+    input.push(0);
+    for (path, content) in sources {
+        input.extend_from_slice(path.as_os_str().as_encoded_bytes());
+        input.push(0);
+        input.extend_from_slice(&(content.len() as u64).to_ne_bytes());
+        input.extend_from_slice(content.as_bytes());
+    }
+    sha256::digest(input.as_slice())
+}
+
+fn read_rules_cache(key: &str) -> Option<(usize, Vec<u8>)> {
+    let cache = std::fs::read(crate::defs::SEPOLICY_CACHE_PATH).ok()?;
+    parse_rules_cache(&cache, key)
+}
+
+fn parse_rules_cache(cache: &[u8], key: &str) -> Option<(usize, Vec<u8>)> {
+    let header_len = key.len() + 1 + size_of::<u32>();
+    if cache.len() < header_len
+        || &cache[..key.len()] != key.as_bytes()
+        || cache[key.len()] != b'\n'
+    {
+        return None;
+    }
+    let count = u32::from_ne_bytes(cache[key.len() + 1..header_len].try_into().ok()?) as usize;
+    let payload = &cache[header_len..];
+    // every record holds at least its cmd and subcmd
+    let min_record = 2 * size_of::<u32>();
+    if count == 0 || payload.len() < count.saturating_mul(min_record) {
+        log::warn!(
+            "invalid sepolicy rules cache: {count} rules in {} bytes",
+            payload.len()
+        );
+        return None;
+    }
+    Some((count, payload.to_vec()))
+}
+
+fn write_rules_cache(key: &str, count: usize, payload: &[u8]) -> Result<()> {
+    let mut cache = Vec::with_capacity(key.len() + 1 + size_of::<u32>() + payload.len());
+    cache.extend_from_slice(key.as_bytes());
+    cache.push(b'\n');
+    cache.extend_from_slice(&u32::try_from(count)?.to_ne_bytes());
+    cache.extend_from_slice(payload);
+
+    let tmp = format!("{}.tmp", crate::defs::SEPOLICY_CACHE_PATH);
+    std::fs::write(&tmp, cache)?;
+    std::fs::rename(&tmp, crate::defs::SEPOLICY_CACHE_PATH)?;
+    Ok(())
+}
+
+/// Applies the rule files of all modules as one deduplicated batch. The
+/// compiled batch is cached and reused until a rule file or ksud changes.
+pub fn apply_module_rules(files: &[PathBuf]) -> Result<()> {
+    let sources: Vec<_> = files
+        .iter()
+        .filter_map(|file| match std::fs::read_to_string(file) {
+            Ok(content) => Some((file, content)),
+            Err(e) => {
+                log::warn!("Failed to read {}: {e}", file.display());
+                None
+            }
+        })
+        .collect();
+    if sources.is_empty() {
+        return Ok(());
+    }
+
+    let key = rules_cache_key(&sources);
+    if let Some((count, payload)) = read_rules_cache(&key) {
+        log::info!("sepolicy rules cache hit, {count} rules");
+        match submit_payload(&payload) {
+            Ok(applied) => {
+                if usize::try_from(applied).is_ok_and(|applied| applied < count) {
+                    log::warn!("apply sepolicy batch partially succeeded: {applied}/{count}");
+                }
+                return Ok(());
+            }
+            Err(e) => {
+                log::warn!("cached sepolicy rules rejected: {e}, applying rule files one by one");
+                for (file, content) in &sources {
+                    let result = parse_sepolicy(content.trim(), false)
+                        .and_then(|statements| apply_rules_batch(&statements, false));
+                    if let Err(e) = result {
+                        log::warn!("Failed to load sepolicy.rule for {}: {e}", file.display());
+                    }
+                }
+                return Ok(());
+            }
+        }
+    }
+
+    let mut records = vec![];
+    for (file, content) in &sources {
+        match compile_rules(content) {
+            Ok(mut compiled) => records.append(&mut compiled),
+            Err(e) => log::warn!("Failed to load sepolicy.rule for {}: {e}", file.display()),
+        }
+    }
+    let total = records.len();
+    let records = dedup_records(records);
+    log::info!("sepolicy rules compiled, {}/{total} unique", records.len());
+    if records.is_empty() {
+        return Ok(());
+    }
+
+    let payload = records.concat();
+    if let Err(e) = write_rules_cache(&key, records.len(), &payload) {
+        log::warn!("write sepolicy rules cache failed: {e}");
+    }
+    send_payload(&payload, records.len(), false)
+}
+
+/// Stages every sepolicy batch applied while it is alive, so the kernel
+/// duplicates and swaps the policy once on commit. Dropping it without commit
+/// discards the staged batches. Kernels without transactions apply batches
+/// immediately.
+pub struct Transaction {
+    active: bool,
+}
+
+impl Transaction {
+    pub fn begin() -> Self {
+        match crate::ksucalls::sepolicy_txn(crate::ksu_uapi::KSU_SEPOLICY_TXN_BEGIN) {
+            Ok(_) => Self { active: true },
+            Err(e) => {
+                log::warn!("sepolicy transaction unavailable, apply directly: {e}");
+                Self { active: false }
+            }
+        }
+    }
+
+    pub fn commit(mut self) -> Result<()> {
+        if !self.active {
+            return Ok(());
+        }
+        self.active = false;
+        let applied = crate::ksucalls::sepolicy_txn(crate::ksu_uapi::KSU_SEPOLICY_TXN_COMMIT)
+            .context("commit sepolicy transaction")?;
+        log::info!("sepolicy transaction committed, {applied} rules applied");
+        Ok(())
+    }
+}
+
+impl Drop for Transaction {
+    fn drop(&mut self) {
+        if self.active {
+            let _ = crate::ksucalls::sepolicy_txn(crate::ksu_uapi::KSU_SEPOLICY_TXN_ABORT);
+        }
+    }
+}
+
 pub fn live_patch(policy: &str) -> Result<()> {
     let result = parse_sepolicy(policy.trim(), false)?;
     for statement in &result {
@@ -777,3 +1036,108 @@ pub fn check_rule(policy: &str) -> Result<()> {
     parse_sepolicy(policy.trim(), true)?;
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn compile(policy: &str) -> Vec<(u32, Vec<u8>)> {
+        compile_rules(policy).unwrap()
+    }
+
+    fn cache_bytes(key: &str, count: u32, payload: &[u8]) -> Vec<u8> {
+        let mut cache = key.as_bytes().to_vec();
+        cache.push(b'\n');
+        cache.extend_from_slice(&count.to_ne_bytes());
+        cache.extend_from_slice(payload);
+        cache
+    }
+
+    #[test]
+    fn dedup_keeps_last_rule_write() {
+        let records = compile("allow a b file read\ndeny a b file read\nallow a b file read");
+        assert_eq!(records.len(), 3);
+        let expected = vec![records[1].1.clone(), records[2].1.clone()];
+        assert_eq!(dedup_records(records), expected);
+    }
+
+    #[test]
+    fn dedup_keeps_declarations_where_they_take_effect() {
+        let records = compile(
+            "type t a\ntypeattribute t b\nattribute x\ntype t a\ntypeattribute t b\nattribute x",
+        );
+        assert_eq!(records.len(), 6);
+        // type: first and last, typeattribute: last, attribute: first
+        let expected = vec![
+            records[0].1.clone(),
+            records[2].1.clone(),
+            records[3].1.clone(),
+            records[4].1.clone(),
+        ];
+        assert_eq!(dedup_records(records), expected);
+    }
+
+    #[test]
+    fn dedup_keeps_distinct_records() {
+        let records = compile("allow a b file read\nallow a b file write\nattribute x");
+        let expected: Vec<_> = records.iter().map(|(_, record)| record.clone()).collect();
+        assert_eq!(dedup_records(records), expected);
+    }
+
+    #[test]
+    fn rules_cache_roundtrip() {
+        let payload: Vec<u8> = compile("allow a b file read")
+            .into_iter()
+            .flat_map(|(_, record)| record)
+            .collect();
+        let cache = cache_bytes("key", 1, &payload);
+        assert_eq!(parse_rules_cache(&cache, "key"), Some((1, payload)));
+    }
+
+    #[test]
+    fn rules_cache_rejects_mismatched_key() {
+        let cache = cache_bytes("key", 1, &[0; 8]);
+        assert_eq!(parse_rules_cache(&cache, "other"), None);
+        assert_eq!(parse_rules_cache(&cache, "ke"), None);
+    }
+
+    #[test]
+    fn rules_cache_rejects_zero_count() {
+        let cache = cache_bytes("key", 0, &[0; 8]);
+        assert_eq!(parse_rules_cache(&cache, "key"), None);
+    }
+
+    #[test]
+    fn rules_cache_rejects_truncated_cache() {
+        // payload too short for the claimed records
+        let cache = cache_bytes("key", 2, &[0; 12]);
+        assert_eq!(parse_rules_cache(&cache, "key"), None);
+        // header cut inside the count
+        let cache = cache_bytes("key", 1, &[0; 8]);
+        assert_eq!(parse_rules_cache(&cache[..5], "key"), None);
+    }
+
+    #[test]
+    fn rules_cache_key_tracks_paths_and_contents() {
+        let a = PathBuf::from("/data/adb/modules/a/sepolicy.rule");
+        let b = PathBuf::from("/data/adb/modules/b/sepolicy.rule");
+        let key = rules_cache_key(&[(&a, "allow a b file read".to_string())]);
+        assert_eq!(
+            key,
+            rules_cache_key(&[(&a, "allow a b file read".to_string())])
+        );
+        assert_ne!(
+            key,
+            rules_cache_key(&[(&b, "allow a b file read".to_string())])
+        );
+        assert_ne!(
+            key,
+            rules_cache_key(&[(&a, "allow a b file write".to_string())])
+        );
+        // content boundaries are part of the key
+        assert_ne!(
+            rules_cache_key(&[(&a, "ab".to_string()), (&b, "c".to_string())]),
+            rules_cache_key(&[(&a, "a".to_string()), (&b, "bc".to_string())])
+        );
+    }
+}